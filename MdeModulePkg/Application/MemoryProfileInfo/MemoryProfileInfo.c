@@ -482,6 +482,37 @@ DumpMemoryProfileMemoryRange (
   return (VOID *) Descriptor;
 }
 
+/**
+  Dump memory profile pool statistics.
+
+  @param[in] PoolStats          Pointer to memory profile pool statistics.
+
+  @return Pointer to the end of memory profile pool statistics buffer.
+
+**/
+VOID *
+DumpMemoryProfilePoolStats (
+  IN MEMORY_PROFILE_POOL_STATS  *PoolStats
+  )
+{
+  if (PoolStats->Header.Signature != MEMORY_PROFILE_POOL_STATS_SIGNATURE) {
+    return NULL;
+  }
+  Print (L"MEMORY_PROFILE_POOL_STATS\n");
+  Print (L"  Signature                     - 0x%08x\n", PoolStats->Header.Signature);
+  Print (L"  Length                        - 0x%04x\n", PoolStats->Header.Length);
+  Print (L"  Revision                      - 0x%04x\n", PoolStats->Header.Revision);
+  Print (L"  AllocateCount                 - 0x%016lx\n", PoolStats->AllocateCount);
+  Print (L"  FreeCount                     - 0x%016lx\n", PoolStats->FreeCount);
+  Print (L"  FreeListHitCount              - 0x%016lx\n", PoolStats->FreeListHitCount);
+  Print (L"  PageAllocateCount             - 0x%016lx\n", PoolStats->PageAllocateCount);
+  Print (L"  PageFreeCount                 - 0x%016lx\n", PoolStats->PageFreeCount);
+  Print (L"  PageCacheHitCount             - 0x%016lx\n", PoolStats->PageCacheHitCount);
+  Print (L"  PageCacheStoreCount           - 0x%016lx\n", PoolStats->PageCacheStoreCount);
+
+  return (VOID *) ((UINTN) PoolStats + PoolStats->Header.Length);
+}
+
 /**
   Scan memory profile by Signature.
 
@@ -533,6 +564,7 @@ DumpMemoryProfile (
   MEMORY_PROFILE_CONTEXT        *Context;
   MEMORY_PROFILE_FREE_MEMORY    *FreeMemory;
   MEMORY_PROFILE_MEMORY_RANGE   *MemoryRange;
+  MEMORY_PROFILE_POOL_STATS     *PoolStats;
 
   Context = (MEMORY_PROFILE_CONTEXT *) ScanMemoryProfileBySignature (ProfileBuffer, ProfileSize, MEMORY_PROFILE_CONTEXT_SIGNATURE);
   if (Context != NULL) {
@@ -548,6 +580,11 @@ DumpMemoryProfile (
   if (MemoryRange != NULL) {
     DumpMemoryProfileMemoryRange (MemoryRange);
   }
+
+  PoolStats = (MEMORY_PROFILE_POOL_STATS *) ScanMemoryProfileBySignature (ProfileBuffer, ProfileSize, MEMORY_PROFILE_POOL_STATS_SIGNATURE);
+  if (PoolStats != NULL) {
+    DumpMemoryProfilePoolStats (PoolStats);
+  }
 }
 
 /**
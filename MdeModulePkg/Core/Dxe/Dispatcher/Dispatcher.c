@@ -478,6 +478,12 @@ CoreDispatcher (
       // Untrused to Scheduled it would have already been loaded so we may need to
       // skip the LoadImage
       //
+      // The image is not loaded ahead of time while the previous driver runs.
+      // LoadImage() goes through the FV, section extraction, security and
+      // memory services, none of which may be called from an AP. It also
+      // installs the Loaded Image protocol, whose notifications and security
+      // checks must see the state left by every driver started before it.
+      //
       if (DriverEntry->ImageHandle == NULL && !DriverEntry->IsFvImage) {
         DEBUG ((DEBUG_INFO, "Loading driver %g\n", &DriverEntry->FileName));
         Status = CoreLoadImage (
@@ -2225,6 +2225,17 @@ CoreDisplayDiscoveredNotDispatched (
   );
 
 
+/**
+  Displays the lookup counters of the protocol database.  Only used in Debug
+  Builds.
+
+**/
+VOID
+CoreDisplayProtocolDatabaseStats (
+  VOID
+  );
+
+
 /**
   Place holder function until all the Boot Services and Runtime Services are
   available.
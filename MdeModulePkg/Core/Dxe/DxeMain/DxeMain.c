@@ -481,6 +481,14 @@ DxeMain (
     CoreDisplayDiscoveredNotDispatched ();
   DEBUG_CODE_END ();
 
+  //
+  // Display how the protocol database lookups performed during dispatch
+  // if this is a debug build
+  //
+  DEBUG_CODE_BEGIN ();
+    CoreDisplayProtocolDatabaseStats ();
+  DEBUG_CODE_END ();
+
   //
   // Assert if the Architectural Protocols are not present.
   //
@@ -40,6 +40,10 @@ typedef struct {
   LIST_ENTRY      Link;
   UINT64          TriggerTime;
   UINT64          Period;
+  ///
+  /// Level of the timer wheel the event is queued on
+  ///
+  UINTN           Level;
 } TIMER_EVENT_INFO;
 
 #define EVENT_SIGNATURE         SIGNATURE_32('e','v','n','t')
@@ -16,11 +16,29 @@ WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
 #include "DxeMain.h"
 #include "Event.h"
 
+//
+// The timer database is a hierarchical timer wheel.  Level 0 has one slot
+// per tick of 2^TIMER_WHEEL_SHIFT 100ns units, each higher level has slots
+// TIMER_WHEEL_SLOTS times wider.  Timers further out than the last level
+// are kept on the overflow list.  A timer is queued by its trigger time
+// relative to mTimerWheelTick, and moved down a level when the wheel
+// reaches the start of its slot, so insert and cancel are O(1).
+//
+#define TIMER_WHEEL_SHIFT       16
+#define TIMER_WHEEL_SLOT_BITS   6
+#define TIMER_WHEEL_SLOTS       (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_SLOT_MASK   (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS      4
+
 //
 // Internal data
 //
 
-LIST_ENTRY       mEfiTimerList = INITIALIZE_LIST_HEAD_VARIABLE (mEfiTimerList);
+LIST_ENTRY       mTimerWheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+LIST_ENTRY       mTimerWheelOverflow = INITIALIZE_LIST_HEAD_VARIABLE (mTimerWheelOverflow);
+UINTN            mTimerWheelCount[TIMER_WHEEL_LEVELS + 1];
+UINT64           mTimerWheelTick = 0;
+UINT64           mTimerWheelNextTime = MAX_UINT64;
 EFI_LOCK         mEfiTimerLock = EFI_INITIALIZE_LOCK_VARIABLE (TPL_HIGH_LEVEL - 1);
 EFI_EVENT        mEfiCheckTimerEvent = NULL;
 
@@ -30,6 +48,30 @@ UINT64           mEfiSystemTime = 0;
 //
 // Timer functions
 //
+/**
+  Returns the timer wheel slot that holds a tick at a level of the wheel.
+
+  @param  Level                  The level of the wheel, TIMER_WHEEL_LEVELS
+                                 for the overflow list
+  @param  Tick                   The tick
+
+  @return The list head of the slot
+
+**/
+STATIC
+LIST_ENTRY *
+CoreTimerWheelSlot (
+  IN UINTN    Level,
+  IN UINT64   Tick
+  )
+{
+  if (Level == TIMER_WHEEL_LEVELS) {
+    return &mTimerWheelOverflow;
+  }
+
+  return &mTimerWheel[Level][(UINTN) RShiftU64 (Tick, Level * TIMER_WHEEL_SLOT_BITS) & TIMER_WHEEL_SLOT_MASK];
+}
+
 /**
   Inserts the timer event.
 
@@ -42,91 +84,209 @@ CoreInsertEventTimer (
   IN IEVENT   *Event
   )
 {
-  UINT64          TriggerTime;
-  LIST_ENTRY      *Link;
-  IEVENT          *Event2;
+  UINT64          Tick;
+  UINT64          Delta;
+  UINTN           Level;
 
   ASSERT_LOCKED (&mEfiTimerLock);
 
   //
-  // Get the timer's trigger time
+  // Get the tick of the timer's trigger time
   //
-  TriggerTime = Event->Timer.TriggerTime;
+  Tick = RShiftU64 (Event->Timer.TriggerTime, TIMER_WHEEL_SHIFT);
+  if (Tick < mTimerWheelTick) {
+    Tick = mTimerWheelTick;
+  }
 
   //
-  // Insert the timer into the timer database in assending sorted order
+  // Queue the timer on the lowest level that reaches its tick
   //
-  for (Link = mEfiTimerList.ForwardLink; Link != &mEfiTimerList; Link = Link->ForwardLink) {
-    Event2 = CR (Link, IEVENT, Timer.Link, EVENT_SIGNATURE);
-
-    if (Event2->Timer.TriggerTime > TriggerTime) {
+  Delta = Tick - mTimerWheelTick;
+  for (Level = 0; Level < TIMER_WHEEL_LEVELS; Level++) {
+    if (Delta < LShiftU64 (1, (Level + 1) * TIMER_WHEEL_SLOT_BITS)) {
       break;
     }
   }
 
-  InsertTailList (Link, &Event->Timer.Link);
+  InsertTailList (CoreTimerWheelSlot (Level, Tick), &Event->Timer.Link);
+  Event->Timer.Level = Level;
+  mTimerWheelCount[Level] += 1;
+
+  if (Event->Timer.TriggerTime < mTimerWheelNextTime) {
+    mTimerWheelNextTime = Event->Timer.TriggerTime;
+  }
 }
 
 /**
-  Returns the current system time.
+  Removes the timer event from the timer wheel.
 
-  @return The current system time
+  @param  Event                  Points to the internal structure of timer event
+                                 to be removed
 
 **/
-UINT64
-CoreCurrentSystemTime (
+STATIC
+VOID
+CoreRemoveEventTimer (
+  IN IEVENT   *Event
+  )
+{
+  ASSERT_LOCKED (&mEfiTimerLock);
+  ASSERT (mTimerWheelCount[Event->Timer.Level] != 0);
+
+  RemoveEntryList (&Event->Timer.Link);
+  Event->Timer.Link.ForwardLink = NULL;
+  mTimerWheelCount[Event->Timer.Level] -= 1;
+}
+
+/**
+  Checks if any timer is queued to the timer wheel.
+
+  @retval TRUE                   No timer is queued
+  @retval FALSE                  At least one timer is queued
+
+**/
+STATIC
+BOOLEAN
+CoreIsTimerWheelEmpty (
   VOID
   )
 {
-  UINT64          SystemTime;
+  UINTN           Level;
 
-  CoreAcquireLock (&mEfiSystemTimeLock);
-  SystemTime = mEfiSystemTime;
-  CoreReleaseLock (&mEfiSystemTimeLock);
+  for (Level = 0; Level <= TIMER_WHEEL_LEVELS; Level++) {
+    if (mTimerWheelCount[Level] != 0) {
+      return FALSE;
+    }
+  }
 
-  return SystemTime;
+  return TRUE;
 }
 
 /**
-  Checks the sorted timer list against the current system time.
-  Signals any expired event timer.
+  Requeues the timers of the slot of a level that starts at mTimerWheelTick.
+  They all go to lower levels, or back to the overflow list.
 
-  @param  CheckEvent             Not used
-  @param  Context                Not used
+  @param  Level                  The level of the wheel
 
 **/
+STATIC
 VOID
-EFIAPI
-CoreCheckTimers (
-  IN EFI_EVENT            CheckEvent,
-  IN VOID                 *Context
+CoreCascadeTimerWheel (
+  IN UINTN    Level
   )
 {
-  UINT64                  SystemTime;
-  IEVENT                  *Event;
+  LIST_ENTRY      *Head;
+  LIST_ENTRY      Slot;
+  IEVENT          *Event;
+
+  Head = CoreTimerWheelSlot (Level, mTimerWheelTick);
+  if (IsListEmpty (Head)) {
+    return;
+  }
+
+  InitializeListHead (&Slot);
+  while (!IsListEmpty (Head)) {
+    Event = CR (Head->ForwardLink, IEVENT, Timer.Link, EVENT_SIGNATURE);
+    RemoveEntryList (&Event->Timer.Link);
+    InsertTailList (&Slot, &Event->Timer.Link);
+  }
+
+  while (!IsListEmpty (&Slot)) {
+    Event = CR (Slot.ForwardLink, IEVENT, Timer.Link, EVENT_SIGNATURE);
+    CoreRemoveEventTimer (Event);
+    CoreInsertEventTimer (Event);
+  }
+}
+
+/**
+  Moves mTimerWheelTick forward, at most to Tick.  It stops at the next tick
+  where a timer may be signaled or moved down a level.
+
+  @param  Tick                   The tick of the current system time
+
+**/
+STATIC
+VOID
+CoreAdvanceTimerWheel (
+  IN UINT64   Tick
+  )
+{
+  UINT64          NextTick;
+  UINTN           Level;
 
   //
-  // Check the timer database for expired timers
+  // Nothing happens before the next slot of the lowest level in use
   //
-  CoreAcquireLock (&mEfiTimerLock);
-  SystemTime = CoreCurrentSystemTime ();
+  for (Level = 0; Level <= TIMER_WHEEL_LEVELS; Level++) {
+    if (mTimerWheelCount[Level] != 0) {
+      break;
+    }
+  }
+
+  NextTick = Tick;
+  if (Level <= TIMER_WHEEL_LEVELS) {
+    NextTick = LShiftU64 (RShiftU64 (mTimerWheelTick, Level * TIMER_WHEEL_SLOT_BITS) + 1, Level * TIMER_WHEEL_SLOT_BITS);
+    if (NextTick > Tick) {
+      NextTick = Tick;
+    }
+  }
+
+  mTimerWheelTick = NextTick;
+
+  //
+  // Move down the timers of every level whose slot starts at the new tick
+  //
+  for (Level = TIMER_WHEEL_LEVELS; Level > 0; Level--) {
+    if ((NextTick & (LShiftU64 (1, Level * TIMER_WHEEL_SLOT_BITS) - 1)) == 0) {
+      CoreCascadeTimerWheel (Level);
+    }
+  }
+}
+
+/**
+  Signals the expired timers of the level 0 slot of mTimerWheelTick.
+
+  @param  SystemTime             The current system time
+
+**/
+STATIC
+VOID
+CoreSignalTimerWheelSlot (
+  IN UINT64   SystemTime
+  )
+{
+  LIST_ENTRY      *Head;
+  LIST_ENTRY      Slot;
+  IEVENT          *Event;
+
+  Head = CoreTimerWheelSlot (0, mTimerWheelTick);
+
+  //
+  // Take the slot over, periodic timers may be queued back to it
+  //
+  InitializeListHead (&Slot);
+  while (!IsListEmpty (Head)) {
+    Event = CR (Head->ForwardLink, IEVENT, Timer.Link, EVENT_SIGNATURE);
+    RemoveEntryList (&Event->Timer.Link);
+    InsertTailList (&Slot, &Event->Timer.Link);
+  }
 
-  while (!IsListEmpty (&mEfiTimerList)) {
-    Event = CR (mEfiTimerList.ForwardLink, IEVENT, Timer.Link, EVENT_SIGNATURE);
+  while (!IsListEmpty (&Slot)) {
+    Event = CR (Slot.ForwardLink, IEVENT, Timer.Link, EVENT_SIGNATURE);
 
     //
-    // If this timer is not expired, then we're done
+    // If this timer is not expired, leave it in the slot
     //
     if (Event->Timer.TriggerTime > SystemTime) {
-      break;
+      RemoveEntryList (&Event->Timer.Link);
+      InsertTailList (Head, &Event->Timer.Link);
+      continue;
     }
 
     //
     // Remove this timer from the timer queue
     //
-
-    RemoveEntryList (&Event->Timer.Link);
-    Event->Timer.Link.ForwardLink = NULL;
+    CoreRemoveEventTimer (Event);
 
     //
     // Signal it
@@ -156,6 +316,128 @@ CoreCheckTimers (
       CoreInsertEventTimer (Event);
     }
   }
+}
+
+/**
+  Computes the system time at which CoreCheckTimers() has work to do next.
+
+  @return The system time, or MAX_UINT64 if no timer is queued
+
+**/
+STATIC
+UINT64
+CoreNextTimerWheelTime (
+  VOID
+  )
+{
+  LIST_ENTRY      *Head;
+  LIST_ENTRY      *Link;
+  IEVENT          *Event;
+  UINT64          NextTime;
+  UINT64          Time;
+  UINTN           Offset;
+  UINTN           Level;
+
+  NextTime = MAX_UINT64;
+
+  //
+  // The timers left in the current level 0 slot, this includes the periodic
+  // timers that were queued back to it while it was being signaled
+  //
+  Head = CoreTimerWheelSlot (0, mTimerWheelTick);
+  for (Link = Head->ForwardLink; Link != Head; Link = Link->ForwardLink) {
+    Event = CR (Link, IEVENT, Timer.Link, EVENT_SIGNATURE);
+    if (Event->Timer.TriggerTime < NextTime) {
+      NextTime = Event->Timer.TriggerTime;
+    }
+  }
+
+  //
+  // The next used level 0 slot, all of them are within one turn of the wheel
+  //
+  if (mTimerWheelCount[0] != 0) {
+    for (Offset = 1; Offset < TIMER_WHEEL_SLOTS; Offset++) {
+      if (!IsListEmpty (CoreTimerWheelSlot (0, mTimerWheelTick + Offset))) {
+        Time = LShiftU64 (mTimerWheelTick + Offset, TIMER_WHEEL_SHIFT);
+        if (Time < NextTime) {
+          NextTime = Time;
+        }
+        break;
+      }
+    }
+  }
+
+  //
+  // The next slot of the lowest higher level in use, where timers move down
+  //
+  for (Level = 1; Level <= TIMER_WHEEL_LEVELS; Level++) {
+    if (mTimerWheelCount[Level] != 0) {
+      Time = LShiftU64 (RShiftU64 (mTimerWheelTick, Level * TIMER_WHEEL_SLOT_BITS) + 1, Level * TIMER_WHEEL_SLOT_BITS);
+      Time = LShiftU64 (Time, TIMER_WHEEL_SHIFT);
+      if (Time < NextTime) {
+        NextTime = Time;
+      }
+      break;
+    }
+  }
+
+  return NextTime;
+}
+
+/**
+  Returns the current system time.
+
+  @return The current system time
+
+**/
+UINT64
+CoreCurrentSystemTime (
+  VOID
+  )
+{
+  UINT64          SystemTime;
+
+  CoreAcquireLock (&mEfiSystemTimeLock);
+  SystemTime = mEfiSystemTime;
+  CoreReleaseLock (&mEfiSystemTimeLock);
+
+  return SystemTime;
+}
+
+/**
+  Advances the timer wheel to the current system time.
+  Signals any expired event timer.
+
+  @param  CheckEvent             Not used
+  @param  Context                Not used
+
+**/
+VOID
+EFIAPI
+CoreCheckTimers (
+  IN EFI_EVENT            CheckEvent,
+  IN VOID                 *Context
+  )
+{
+  UINT64                  SystemTime;
+  UINT64                  Tick;
+
+  //
+  // Check the timer database for expired timers
+  //
+  CoreAcquireLock (&mEfiTimerLock);
+  SystemTime = CoreCurrentSystemTime ();
+  Tick       = RShiftU64 (SystemTime, TIMER_WHEEL_SHIFT);
+
+  for (;;) {
+    CoreSignalTimerWheelSlot (SystemTime);
+    if (mTimerWheelTick >= Tick) {
+      break;
+    }
+    CoreAdvanceTimerWheel (Tick);
+  }
+
+  mTimerWheelNextTime = CoreNextTimerWheelTime ();
 
   CoreReleaseLock (&mEfiTimerLock);
 }
@@ -171,6 +453,14 @@ CoreInitializeTimer (
   )
 {
   EFI_STATUS  Status;
+  UINTN       Level;
+  UINTN       Index;
+
+  for (Level = 0; Level < TIMER_WHEEL_LEVELS; Level++) {
+    for (Index = 0; Index < TIMER_WHEEL_SLOTS; Index++) {
+      InitializeListHead (&mTimerWheel[Level][Index]);
+    }
+  }
 
   Status = CoreCreateEventInternal (
              EVT_NOTIFY_SIGNAL,
@@ -197,8 +487,6 @@ CoreTimerTick (
   IN UINT64   Duration
   )
 {
-  IEVENT          *Event;
-
   //
   // Check runtiem flag in case there are ticks while exiting boot services
   //
@@ -210,15 +498,11 @@ CoreTimerTick (
   mEfiSystemTime += Duration;
 
   //
-  // If the head of the list is expired, fire the timer event
+  // If the timer wheel has work due, fire the timer event
   // to process it
   //
-  if (!IsListEmpty (&mEfiTimerList)) {
-    Event = CR (mEfiTimerList.ForwardLink, IEVENT, Timer.Link, EVENT_SIGNATURE);
-
-    if (Event->Timer.TriggerTime <= mEfiSystemTime) {
-      CoreSignalEvent (mEfiCheckTimerEvent);
-    }
+  if (mTimerWheelNextTime <= mEfiSystemTime) {
+    CoreSignalEvent (mEfiCheckTimerEvent);
   }
 
   CoreReleaseLock (&mEfiSystemTimeLock);
@@ -271,8 +555,7 @@ CoreSetTimer (
   // If the timer is queued to the timer database, remove it
   //
   if (Event->Timer.Link.ForwardLink != NULL) {
-    RemoveEntryList (&Event->Timer.Link);
-    Event->Timer.Link.ForwardLink = NULL;
+    CoreRemoveEventTimer (Event);
   }
 
   Event->Timer.TriggerTime = 0;
@@ -287,6 +570,14 @@ CoreSetTimer (
       Event->Timer.Period = TriggerTime;
     }
 
+    //
+    // An idle timer wheel may be far behind, catch it up so the timer is
+    // queued relative to now
+    //
+    if (CoreIsTimerWheelEmpty ()) {
+      mTimerWheelTick = RShiftU64 (CoreCurrentSystemTime (), TIMER_WHEEL_SHIFT);
+    }
+
     Event->Timer.TriggerTime = CoreCurrentSystemTime () + TriggerTime;
     CoreInsertEventTimer (Event);
 
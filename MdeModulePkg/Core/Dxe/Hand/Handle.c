@@ -27,6 +27,103 @@ LIST_ENTRY      gHandleList           = INITIALIZE_LIST_HEAD_VARIABLE (gHandleLi
 EFI_LOCK        gProtocolDatabaseLock = EFI_INITIALIZE_LOCK_VARIABLE (TPL_NOTIFY);
 UINT64          gHandleDatabaseKey    = 0;
 
+//
+// mProtocolHash          - Protocol entries hashed by GUID, also on mProtocolDatabase
+// mHandleHash            - Handles hashed by address, also on gHandleList
+// gProtocolDatabaseStats - Lookup counters of the two hash tables
+//
+// Both tables are only modified with gProtocolDatabaseLock owned.
+//
+#define PROTOCOL_HASH_SIZE  64
+#define HANDLE_HASH_SIZE    256
+
+LIST_ENTRY      mProtocolHash[PROTOCOL_HASH_SIZE];
+LIST_ENTRY      mHandleHash[HANDLE_HASH_SIZE];
+BOOLEAN         mHashInitialized      = FALSE;
+PROTOCOL_DATABASE_STATS  gProtocolDatabaseStats;
+
+
+
+/**
+  Initialize the bucket lists of the protocol and handle hash tables the
+  first time one of them is used.
+
+**/
+VOID
+CoreInitializeHandleHash (
+  VOID
+  )
+{
+  UINTN  Index;
+
+  if (mHashInitialized) {
+    return;
+  }
+
+  for (Index = 0; Index < PROTOCOL_HASH_SIZE; Index++) {
+    InitializeListHead (&mProtocolHash[Index]);
+  }
+  for (Index = 0; Index < HANDLE_HASH_SIZE; Index++) {
+    InitializeListHead (&mHandleHash[Index]);
+  }
+  mHashInitialized = TRUE;
+}
+
+
+
+/**
+  Returns the protocol hash bucket of a GUID.
+
+  @param  Protocol               The ID of the protocol
+
+  @return The bucket list head
+
+**/
+LIST_ENTRY *
+CoreProtocolHashBucket (
+  IN EFI_GUID   *Protocol
+  )
+{
+  UINT32  Hash;
+
+  CoreInitializeHandleHash ();
+
+  Hash = ReadUnaligned32 ((UINT32 *)Protocol) ^
+         ReadUnaligned32 ((UINT32 *)Protocol + 1) ^
+         ReadUnaligned32 ((UINT32 *)Protocol + 2) ^
+         ReadUnaligned32 ((UINT32 *)Protocol + 3);
+  Hash ^= Hash >> 16;
+  Hash ^= Hash >> 8;
+
+  return &mProtocolHash[Hash & (PROTOCOL_HASH_SIZE - 1)];
+}
+
+
+
+/**
+  Returns the handle hash bucket of a handle.  Handles are pool allocations,
+  so the low bits of the address carry no information.
+
+  @param  Handle                 The handle
+
+  @return The bucket list head
+
+**/
+LIST_ENTRY *
+CoreHandleHashBucket (
+  IN EFI_HANDLE Handle
+  )
+{
+  UINTN   Hash;
+
+  CoreInitializeHandleHash ();
+
+  Hash = (UINTN)Handle >> 3;
+  Hash ^= Hash >> 8;
+
+  return &mHandleHash[Hash & (HANDLE_HASH_SIZE - 1)];
+}
+
 
 
 /**
@@ -72,11 +169,35 @@ CoreValidateHandle (
   )
 {
   IHANDLE             *Handle;
+  LIST_ENTRY          *Bucket;
+  LIST_ENTRY          *Link;
+  EFI_TPL             OldTpl;
 
   Handle = (IHANDLE *)UserHandle;
   if (Handle == NULL) {
     return EFI_INVALID_PARAMETER;
   }
+
+  //
+  // Look the handle up instead of dereferencing it, so that a stale or
+  // bogus pointer is rejected as well.  The TPL is raised rather than
+  // taking the lock because some callers already own it.
+  //
+  OldTpl = CoreRaiseTpl (TPL_NOTIFY);
+  gProtocolDatabaseStats.HandleLookups++;
+  Bucket = CoreHandleHashBucket (UserHandle);
+  for (Link = Bucket->ForwardLink; Link != Bucket; Link = Link->ForwardLink) {
+    gProtocolDatabaseStats.HandleProbes++;
+    if (Link == &Handle->HashLink) {
+      gProtocolDatabaseStats.HandleHits++;
+      break;
+    }
+  }
+  CoreRestoreTpl (OldTpl);
+
+  if (Link == Bucket) {
+    return EFI_INVALID_PARAMETER;
+  }
   if (Handle->Signature != EFI_HANDLE_SIGNATURE) {
     return EFI_INVALID_PARAMETER;
   }
@@ -101,6 +222,7 @@ CoreFindProtocolEntry (
   IN BOOLEAN    Create
   )
 {
+  LIST_ENTRY          *Bucket;
   LIST_ENTRY          *Link;
   PROTOCOL_ENTRY      *Item;
   PROTOCOL_ENTRY      *ProtEntry;
@@ -108,21 +230,25 @@ CoreFindProtocolEntry (
   ASSERT_LOCKED(&gProtocolDatabaseLock);
 
   //
-  // Search the database for the matching GUID
+  // Search the hash bucket of the GUID for the matching entry
   //
 
   ProtEntry = NULL;
-  for (Link = mProtocolDatabase.ForwardLink;
-       Link != &mProtocolDatabase;
+  Bucket = CoreProtocolHashBucket (Protocol);
+  gProtocolDatabaseStats.ProtocolLookups++;
+  for (Link = Bucket->ForwardLink;
+       Link != Bucket;
        Link = Link->ForwardLink) {
 
-    Item = CR(Link, PROTOCOL_ENTRY, AllEntries, PROTOCOL_ENTRY_SIGNATURE);
+    gProtocolDatabaseStats.ProtocolProbes++;
+    Item = CR(Link, PROTOCOL_ENTRY, HashLink, PROTOCOL_ENTRY_SIGNATURE);
     if (CompareGuid (&Item->ProtocolID, Protocol)) {
 
       //
       // This is the protocol entry
       //
 
+      gProtocolDatabaseStats.ProtocolHits++;
       ProtEntry = Item;
       break;
     }
@@ -148,6 +274,7 @@ CoreFindProtocolEntry (
       // Add it to protocol database
       //
       InsertTailList (&mProtocolDatabase, &ProtEntry->AllEntries);
+      InsertTailList (Bucket, &ProtEntry->HashLink);
     }
   }
 
@@ -428,6 +555,7 @@ CoreInstallProtocolInterfaceNotify (
     // in the system
     //
     InsertTailList (&gHandleList, &Handle->AllHandles);
+    InsertTailList (CoreHandleHashBucket (Handle), &Handle->HashLink);
   }
 
   Status = CoreValidateHandle (Handle);
@@ -795,6 +923,7 @@ CoreUninstallProtocolInterface (
   if (IsListEmpty (&Handle->Protocols)) {
     Handle->Signature = 0;
     RemoveEntryList (&Handle->AllHandles);
+    RemoveEntryList (&Handle->HashLink);
     CoreFreePool (Handle);
   }
 
@@ -1551,3 +1680,27 @@ CoreConnectHandlesByKey (
 
   CoreFreePool(HandleBuffer);
 }
+
+
+
+/**
+  Displays the lookup counters of the protocol database.  Only used in Debug
+  Builds.
+
+**/
+VOID
+CoreDisplayProtocolDatabaseStats (
+  VOID
+  )
+{
+  DEBUG ((DEBUG_INFO, "Protocol lookups: %ld, hits: %ld, probes: %ld\n",
+    gProtocolDatabaseStats.ProtocolLookups,
+    gProtocolDatabaseStats.ProtocolHits,
+    gProtocolDatabaseStats.ProtocolProbes
+    ));
+  DEBUG ((DEBUG_INFO, "Handle lookups: %ld, hits: %ld, probes: %ld\n",
+    gProtocolDatabaseStats.HandleLookups,
+    gProtocolDatabaseStats.HandleHits,
+    gProtocolDatabaseStats.HandleProbes
+    ));
+}
@@ -30,6 +30,8 @@ typedef struct {
   UINTN               LocateRequest;
   /// The Handle Database Key value when this handle was last created or modified
   UINT64              Key;
+  /// Link on the handle hash bucket used by CoreValidateHandle()
+  LIST_ENTRY          HashLink;
 } IHANDLE;
 
 #define ASSERT_IS_HANDLE(a)  ASSERT((a)->Signature == EFI_HANDLE_SIGNATURE)
@@ -45,6 +47,8 @@ typedef struct {
   UINTN               Signature;
   /// Link Entry inserted to mProtocolDatabase
   LIST_ENTRY          AllEntries;  
+  /// Link on the protocol hash bucket of ProtocolID
+  LIST_ENTRY          HashLink;
   /// ID of the protocol
   EFI_GUID            ProtocolID;  
   /// All protocol interfaces
@@ -108,6 +112,19 @@ typedef struct {
   LIST_ENTRY          *Position;              
 } PROTOCOL_NOTIFY;
 
+///
+/// PROTOCOL_DATABASE_STATS - lookup counters of the protocol and handle
+/// hash tables.  A probe is one bucket entry compared with the key.
+///
+typedef struct {
+  UINT64              ProtocolLookups;
+  UINT64              ProtocolHits;
+  UINT64              ProtocolProbes;
+  UINT64              HandleLookups;
+  UINT64              HandleHits;
+  UINT64              HandleProbes;
+} PROTOCOL_DATABASE_STATS;
+
 
 
 /**
@@ -266,5 +283,6 @@ CoreValidateHandle (
 extern EFI_LOCK         gProtocolDatabaseLock;
 extern LIST_ENTRY       gHandleList;
 extern UINT64           gHandleDatabaseKey;
+extern PROTOCOL_DATABASE_STATS  gProtocolDatabaseStats;
 
 #endif
@@ -36,7 +36,7 @@ WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
 //
 
 #define MEMORY_MAP_SIGNATURE   SIGNATURE_32('m','m','a','p')
-typedef struct {
+typedef struct _MEMORY_MAP {
   UINTN           Signature;
   LIST_ENTRY      Link;
   BOOLEAN         FromPages;
@@ -47,6 +47,16 @@ typedef struct {
 
   UINT64          VirtualStart;
   UINT64          Attribute;
+
+  //
+  // Node of the address ordered memory map tree.  MaxFreeBytes is the size
+  // of the largest EfiConventionalMemory entry in the subtree.
+  //
+  struct _MEMORY_MAP  *Parent;
+  struct _MEMORY_MAP  *Left;
+  struct _MEMORY_MAP  *Right;
+  BOOLEAN             Red;
+  UINT64              MaxFreeBytes;
 } MEMORY_MAP;
 
 //
@@ -144,6 +154,108 @@ CoreReleaseMemoryLock (
   );
 
 
+/**
+  Internal function.  Adds a memory map entry to the tree.  The entry must
+  not overlap any entry already in the tree.
+
+  @param  Entry                  The memory map entry
+
+**/
+VOID
+CoreMemoryMapTreeInsert (
+  IN MEMORY_MAP  *Entry
+  );
+
+
+/**
+  Internal function.  Removes a memory map entry from the tree.
+
+  @param  Entry                  The memory map entry
+
+**/
+VOID
+CoreMemoryMapTreeRemove (
+  IN MEMORY_MAP  *Entry
+  );
+
+
+/**
+  Internal function.  Must be called after the Start or End of an entry in
+  the tree has been changed in place.  The entry must keep its position in
+  the address order.
+
+  @param  Entry                  The memory map entry
+
+**/
+VOID
+CoreMemoryMapTreeUpdate (
+  IN MEMORY_MAP  *Entry
+  );
+
+
+/**
+  Internal function.  Finds the entry with the highest Start address that
+  is not above Address.
+
+  @param  Address                The address to look up
+
+  @return The memory map entry, or NULL if all entries start above Address
+
+**/
+MEMORY_MAP *
+CoreMemoryMapTreeFind (
+  IN UINT64  Address
+  );
+
+
+/**
+  Internal function.  Returns the entry with the lowest address.
+
+  @return The memory map entry, or NULL if the map is empty
+
+**/
+MEMORY_MAP *
+CoreMemoryMapTreeFirst (
+  VOID
+  );
+
+
+/**
+  Internal function.  Returns the entry that follows another one in the
+  address order.
+
+  @param  Entry                  The memory map entry
+
+  @return The next memory map entry, or NULL if Entry is the last one
+
+**/
+MEMORY_MAP *
+CoreMemoryMapTreeNext (
+  IN MEMORY_MAP  *Entry
+  );
+
+
+/**
+  Internal function.  Finds the free range that can hold NumberOfBytes below
+  MaxAddress and above MinAddress, and that ends at the highest address.
+
+  @param  MaxAddress             The last byte the range may use
+  @param  MinAddress             The address that the range must be above
+  @param  NumberOfBytes          The size of the range
+  @param  Alignment              Bits to align with
+
+  @return The last byte of the range, or 0 if no range was found
+
+**/
+UINT64
+CoreMemoryMapTreeFindFree (
+  IN UINT64  MaxAddress,
+  IN UINT64  MinAddress,
+  IN UINT64  NumberOfBytes,
+  IN UINTN   Alignment
+  );
+
+
 //
 // Internal Global data
 //
@@ -151,4 +263,5 @@ CoreReleaseMemoryLock (
 extern EFI_LOCK           gMemoryLock;
 extern LIST_ENTRY         gMemoryMap;
 extern LIST_ENTRY         mGcdMemorySpaceMap;
+extern MEMORY_PROFILE_POOL_STATS  gPoolStats;
 #endif
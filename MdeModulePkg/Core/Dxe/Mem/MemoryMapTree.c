@@ -0,0 +1,587 @@
+/** @file
+  Address ordered index of the memory map.
+
+  Every MEMORY_MAP entry on gMemoryMap is also a node of a red-black tree
+  keyed by its Start address.  Each node caches the size of the largest
+  EfiConventionalMemory range in its subtree, so that the free page search
+  can skip subtrees that cannot satisfy a request.
+
+  The tree is intrusive on purpose.  It is updated with gMemoryLock owned,
+  from inside the page allocator, where no pool can be allocated for
+  separate tree nodes.
+
+Copyright (c) 2006 - 2015, Intel Corporation. All rights reserved.<BR>
+This program and the accompanying materials
+are licensed and made available under the terms and conditions of the BSD License
+which accompanies this distribution.  The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+**/
+
+#include "DxeMain.h"
+#include "Imem.h"
+
+//
+// Root of the memory map tree
+//
+MEMORY_MAP  *mMemoryMapRoot = NULL;
+
+/**
+  Internal function.  Returns the number of free bytes an entry itself
+  contributes to the free range index.
+
+  @param  Entry                  The memory map entry
+
+  @return The size of the entry if it is free memory, otherwise 0
+
+**/
+STATIC
+UINT64
+MemoryMapFreeBytes (
+  IN MEMORY_MAP  *Entry
+  )
+{
+  if (Entry->Type != EfiConventionalMemory || Entry->End < Entry->Start) {
+    return 0;
+  }
+  return Entry->End - Entry->Start + 1;
+}
+
+/**
+  Internal function.  Recomputes the cached largest free range of a node
+  from the node and its two children.
+
+  @param  Entry                  The memory map entry
+
+**/
+STATIC
+VOID
+MemoryMapTreeRecompute (
+  IN MEMORY_MAP  *Entry
+  )
+{
+  UINT64  MaxFreeBytes;
+
+  MaxFreeBytes = MemoryMapFreeBytes (Entry);
+  if (Entry->Left != NULL && Entry->Left->MaxFreeBytes > MaxFreeBytes) {
+    MaxFreeBytes = Entry->Left->MaxFreeBytes;
+  }
+  if (Entry->Right != NULL && Entry->Right->MaxFreeBytes > MaxFreeBytes) {
+    MaxFreeBytes = Entry->Right->MaxFreeBytes;
+  }
+  Entry->MaxFreeBytes = MaxFreeBytes;
+}
+
+/**
+  Internal function.  Recomputes the cached largest free range from a node
+  up to the root.
+
+  @param  Entry                  The memory map entry, or NULL
+
+**/
+STATIC
+VOID
+MemoryMapTreePropagate (
+  IN MEMORY_MAP  *Entry
+  )
+{
+  for (; Entry != NULL; Entry = Entry->Parent) {
+    MemoryMapTreeRecompute (Entry);
+  }
+}
+
+/**
+  Internal function.  Puts a node in the place of another one in its
+  parent, or at the root.
+
+  @param  Old                    The node being replaced
+  @param  New                    The replacement, or NULL
+
+**/
+STATIC
+VOID
+MemoryMapTreeReplace (
+  IN MEMORY_MAP  *Old,
+  IN MEMORY_MAP  *New
+  )
+{
+  if (Old->Parent == NULL) {
+    mMemoryMapRoot = New;
+  } else if (Old == Old->Parent->Left) {
+    Old->Parent->Left = New;
+  } else {
+    Old->Parent->Right = New;
+  }
+  if (New != NULL) {
+    New->Parent = Old->Parent;
+  }
+}
+
+/**
+  Internal function.  Rotates a node down to the left.
+
+  @param  Entry                  The node, its right child takes its place
+
+**/
+STATIC
+VOID
+MemoryMapTreeRotateLeft (
+  IN MEMORY_MAP  *Entry
+  )
+{
+  MEMORY_MAP  *Child;
+
+  Child = Entry->Right;
+  Entry->Right = Child->Left;
+  if (Child->Left != NULL) {
+    Child->Left->Parent = Entry;
+  }
+  MemoryMapTreeReplace (Entry, Child);
+  Child->Left   = Entry;
+  Entry->Parent = Child;
+
+  MemoryMapTreeRecompute (Entry);
+  MemoryMapTreeRecompute (Child);
+}
+
+/**
+  Internal function.  Rotates a node down to the right.
+
+  @param  Entry                  The node, its left child takes its place
+
+**/
+STATIC
+VOID
+MemoryMapTreeRotateRight (
+  IN MEMORY_MAP  *Entry
+  )
+{
+  MEMORY_MAP  *Child;
+
+  Child = Entry->Left;
+  Entry->Left = Child->Right;
+  if (Child->Right != NULL) {
+    Child->Right->Parent = Entry;
+  }
+  MemoryMapTreeReplace (Entry, Child);
+  Child->Right  = Entry;
+  Entry->Parent = Child;
+
+  MemoryMapTreeRecompute (Entry);
+  MemoryMapTreeRecompute (Child);
+}
+
+/**
+  Internal function.  Checks the color of a node, NULL leaves are black.
+
+  @param  Entry                  The node, or NULL
+
+  @return TRUE if the node is red
+
+**/
+STATIC
+BOOLEAN
+MemoryMapTreeIsRed (
+  IN MEMORY_MAP  *Entry
+  )
+{
+  return (BOOLEAN) (Entry != NULL && Entry->Red);
+}
+
+/**
+  Internal function.  Adds a memory map entry to the tree.  The entry must
+  not overlap any entry already in the tree.
+
+  @param  Entry                  The memory map entry
+
+**/
+VOID
+CoreMemoryMapTreeInsert (
+  IN MEMORY_MAP  *Entry
+  )
+{
+  MEMORY_MAP  *Parent;
+  MEMORY_MAP  *Uncle;
+  MEMORY_MAP  **Link;
+
+  ASSERT_LOCKED (&gMemoryLock);
+
+  Parent = NULL;
+  Link   = &mMemoryMapRoot;
+  while (*Link != NULL) {
+    Parent = *Link;
+    if (Entry->Start < Parent->Start) {
+      Link = &Parent->Left;
+    } else {
+      Link = &Parent->Right;
+    }
+  }
+
+  Entry->Parent = Parent;
+  Entry->Left   = NULL;
+  Entry->Right  = NULL;
+  Entry->Red    = TRUE;
+  *Link         = Entry;
+  MemoryMapTreePropagate (Entry);
+
+  while (MemoryMapTreeIsRed (Entry->Parent)) {
+    Parent = Entry->Parent;
+    if (Parent == Parent->Parent->Left) {
+      Uncle = Parent->Parent->Right;
+      if (MemoryMapTreeIsRed (Uncle)) {
+        Parent->Red         = FALSE;
+        Uncle->Red          = FALSE;
+        Parent->Parent->Red = TRUE;
+        Entry               = Parent->Parent;
+        continue;
+      }
+      if (Entry == Parent->Right) {
+        Entry = Parent;
+        MemoryMapTreeRotateLeft (Entry);
+        Parent = Entry->Parent;
+      }
+      Parent->Red         = FALSE;
+      Parent->Parent->Red = TRUE;
+      MemoryMapTreeRotateRight (Parent->Parent);
+    } else {
+      Uncle = Parent->Parent->Left;
+      if (MemoryMapTreeIsRed (Uncle)) {
+        Parent->Red         = FALSE;
+        Uncle->Red          = FALSE;
+        Parent->Parent->Red = TRUE;
+        Entry               = Parent->Parent;
+        continue;
+      }
+      if (Entry == Parent->Left) {
+        Entry = Parent;
+        MemoryMapTreeRotateRight (Entry);
+        Parent = Entry->Parent;
+      }
+      Parent->Red         = FALSE;
+      Parent->Parent->Red = TRUE;
+      MemoryMapTreeRotateLeft (Parent->Parent);
+    }
+  }
+
+  mMemoryMapRoot->Red = FALSE;
+}
+
+/**
+  Internal function.  Removes a memory map entry from the tree.
+
+  @param  Entry                  The memory map entry
+
+**/
+VOID
+CoreMemoryMapTreeRemove (
+  IN MEMORY_MAP  *Entry
+  )
+{
+  MEMORY_MAP  *Next;
+  MEMORY_MAP  *Child;
+  MEMORY_MAP  *Parent;
+  MEMORY_MAP  *Sibling;
+  BOOLEAN     RemovedRed;
+
+  ASSERT_LOCKED (&gMemoryLock);
+
+  //
+  // Unlink the entry, or its successor if it has two children
+  //
+  RemovedRed = Entry->Red;
+  if (Entry->Left == NULL) {
+    Child  = Entry->Right;
+    Parent = Entry->Parent;
+    MemoryMapTreeReplace (Entry, Child);
+  } else if (Entry->Right == NULL) {
+    Child  = Entry->Left;
+    Parent = Entry->Parent;
+    MemoryMapTreeReplace (Entry, Child);
+  } else {
+    Next = Entry->Right;
+    while (Next->Left != NULL) {
+      Next = Next->Left;
+    }
+    RemovedRed = Next->Red;
+    Child      = Next->Right;
+    if (Next->Parent == Entry) {
+      Parent = Next;
+    } else {
+      Parent = Next->Parent;
+      MemoryMapTreeReplace (Next, Child);
+      Next->Right = Entry->Right;
+      Next->Right->Parent = Next;
+    }
+    MemoryMapTreeReplace (Entry, Next);
+    Next->Left = Entry->Left;
+    Next->Left->Parent = Next;
+    Next->Red = Entry->Red;
+  }
+
+  Entry->Parent = NULL;
+  Entry->Left   = NULL;
+  Entry->Right  = NULL;
+  MemoryMapTreePropagate (Parent);
+
+  if (RemovedRed) {
+    return;
+  }
+
+  //
+  // A black node is gone, restore the black height on the side of Child
+  //
+  while (Child != mMemoryMapRoot && !MemoryMapTreeIsRed (Child)) {
+    if (Child == Parent->Left) {
+      Sibling = Parent->Right;
+      if (MemoryMapTreeIsRed (Sibling)) {
+        Sibling->Red = FALSE;
+        Parent->Red  = TRUE;
+        MemoryMapTreeRotateLeft (Parent);
+        Sibling = Parent->Right;
+      }
+      if (!MemoryMapTreeIsRed (Sibling->Left) && !MemoryMapTreeIsRed (Sibling->Right)) {
+        Sibling->Red = TRUE;
+        Child  = Parent;
+        Parent = Child->Parent;
+        continue;
+      }
+      if (!MemoryMapTreeIsRed (Sibling->Right)) {
+        Sibling->Left->Red = FALSE;
+        Sibling->Red       = TRUE;
+        MemoryMapTreeRotateRight (Sibling);
+        Sibling = Parent->Right;
+      }
+      Sibling->Red        = Parent->Red;
+      Parent->Red         = FALSE;
+      Sibling->Right->Red = FALSE;
+      MemoryMapTreeRotateLeft (Parent);
+    } else {
+      Sibling = Parent->Left;
+      if (MemoryMapTreeIsRed (Sibling)) {
+        Sibling->Red = FALSE;
+        Parent->Red  = TRUE;
+        MemoryMapTreeRotateRight (Parent);
+        Sibling = Parent->Left;
+      }
+      if (!MemoryMapTreeIsRed (Sibling->Left) && !MemoryMapTreeIsRed (Sibling->Right)) {
+        Sibling->Red = TRUE;
+        Child  = Parent;
+        Parent = Child->Parent;
+        continue;
+      }
+      if (!MemoryMapTreeIsRed (Sibling->Left)) {
+        Sibling->Right->Red = FALSE;
+        Sibling->Red        = TRUE;
+        MemoryMapTreeRotateLeft (Sibling);
+        Sibling = Parent->Left;
+      }
+      Sibling->Red       = Parent->Red;
+      Parent->Red        = FALSE;
+      Sibling->Left->Red = FALSE;
+      MemoryMapTreeRotateRight (Parent);
+    }
+    Child = mMemoryMapRoot;
+    break;
+  }
+
+  if (Child != NULL) {
+    Child->Red = FALSE;
+  }
+}
+
+/**
+  Internal function.  Must be called after the Start or End of an entry in
+  the tree has been changed in place.  The entry must keep its position in
+  the address order.
+
+  @param  Entry                  The memory map entry
+
+**/
+VOID
+CoreMemoryMapTreeUpdate (
+  IN MEMORY_MAP  *Entry
+  )
+{
+  ASSERT_LOCKED (&gMemoryLock);
+
+  MemoryMapTreePropagate (Entry);
+}
+
+/**
+  Internal function.  Finds the entry with the highest Start address that
+  is not above Address.
+
+  @param  Address                The address to look up
+
+  @return The memory map entry, or NULL if all entries start above Address
+
+**/
+MEMORY_MAP *
+CoreMemoryMapTreeFind (
+  IN UINT64  Address
+  )
+{
+  MEMORY_MAP  *Entry;
+  MEMORY_MAP  *Found;
+
+  Found = NULL;
+  Entry = mMemoryMapRoot;
+  while (Entry != NULL) {
+    if (Entry->Start <= Address) {
+      Found = Entry;
+      Entry = Entry->Right;
+    } else {
+      Entry = Entry->Left;
+    }
+  }
+  return Found;
+}
+
+/**
+  Internal function.  Returns the entry with the lowest address.
+
+  @return The memory map entry, or NULL if the map is empty
+
+**/
+MEMORY_MAP *
+CoreMemoryMapTreeFirst (
+  VOID
+  )
+{
+  MEMORY_MAP  *Entry;
+
+  Entry = mMemoryMapRoot;
+  if (Entry != NULL) {
+    while (Entry->Left != NULL) {
+      Entry = Entry->Left;
+    }
+  }
+  return Entry;
+}
+
+/**
+  Internal function.  Returns the entry that follows another one in the
+  address order.
+
+  @param  Entry                  The memory map entry
+
+  @return The next memory map entry, or NULL if Entry is the last one
+
+**/
+MEMORY_MAP *
+CoreMemoryMapTreeNext (
+  IN MEMORY_MAP  *Entry
+  )
+{
+  if (Entry->Right != NULL) {
+    Entry = Entry->Right;
+    while (Entry->Left != NULL) {
+      Entry = Entry->Left;
+    }
+    return Entry;
+  }
+
+  while (Entry->Parent != NULL && Entry == Entry->Parent->Right) {
+    Entry = Entry->Parent;
+  }
+  return Entry->Parent;
+}
+
+/**
+  Internal function.  Searches a subtree for the free range that ends at the
+  highest address, visiting higher addresses first.
+
+  @param  Entry                  The root of the subtree
+  @param  MaxAddress             The address that the range must be below
+  @param  MinAddress             The address that the range must be above
+  @param  NumberOfBytes          The size of the range
+  @param  Alignment              Bits to align with
+
+  @return The last byte of the usable part of the range, or 0 if not found
+
+**/
+STATIC
+UINT64
+MemoryMapTreeFindFree (
+  IN MEMORY_MAP  *Entry,
+  IN UINT64      MaxAddress,
+  IN UINT64      MinAddress,
+  IN UINT64      NumberOfBytes,
+  IN UINTN       Alignment
+  )
+{
+  UINT64  DescEnd;
+
+  if (Entry == NULL || Entry->MaxFreeBytes < NumberOfBytes) {
+    return 0;
+  }
+
+  //
+  // The entry and everything right of it start at or past MaxAddress
+  //
+  if (Entry->Start < MaxAddress) {
+    DescEnd = MemoryMapTreeFindFree (Entry->Right, MaxAddress, MinAddress, NumberOfBytes, Alignment);
+    if (DescEnd != 0) {
+      return DescEnd;
+    }
+
+    if (Entry->Type == EfiConventionalMemory && Entry->End >= MinAddress) {
+      //
+      // If desc ends past max allowed address, clip the end
+      //
+      DescEnd = Entry->End;
+      if (DescEnd >= MaxAddress) {
+        DescEnd = MaxAddress;
+      }
+
+      DescEnd = ((DescEnd + 1) & (~(Alignment - 1))) - 1;
+
+      //
+      // Use it if there is still enough of it after alignment clipping, and
+      // the allocated range does not start below the min address allowed
+      //
+      if (DescEnd >= Entry->Start &&
+          DescEnd - Entry->Start + 1 >= NumberOfBytes &&
+          DescEnd - NumberOfBytes + 1 >= MinAddress) {
+        return DescEnd;
+      }
+    }
+  }
+
+  //
+  // Everything left of the entry ends below its start
+  //
+  if (Entry->Start > MinAddress) {
+    return MemoryMapTreeFindFree (Entry->Left, MaxAddress, MinAddress, NumberOfBytes, Alignment);
+  }
+
+  return 0;
+}
+
+/**
+  Internal function.  Finds the free range that can hold NumberOfBytes below
+  MaxAddress and above MinAddress, and that ends at the highest address.
+
+  @param  MaxAddress             The last byte the range may use
+  @param  MinAddress             The address that the range must be above
+  @param  NumberOfBytes          The size of the range
+  @param  Alignment              Bits to align with
+
+  @return The last byte of the range, or 0 if no range was found
+
+**/
+UINT64
+CoreMemoryMapTreeFindFree (
+  IN UINT64  MaxAddress,
+  IN UINT64  MinAddress,
+  IN UINT64  NumberOfBytes,
+  IN UINTN   Alignment
+  )
+{
+  ASSERT_LOCKED (&gMemoryLock);
+
+  return MemoryMapTreeFindFree (mMemoryMapRoot, MaxAddress, MinAddress, NumberOfBytes, Alignment);
+}
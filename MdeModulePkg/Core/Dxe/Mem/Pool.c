@@ -62,6 +62,12 @@ STATIC CONST UINT16 mPoolSizeTable[] = {
 
 #define MAX_POOL_SIZE     (MAX_ADDRESS - POOL_OVERHEAD)
 
+//
+// Number of emptied pool pages kept per memory type, so that allocation
+// churn does not convert the same pages back and forth in the memory map
+//
+#define POOL_PAGE_CACHE_SIZE  8
+
 //
 // Globals
 //
@@ -73,6 +79,8 @@ typedef struct {
     EFI_MEMORY_TYPE  MemoryType;
     LIST_ENTRY       FreeList[MAX_POOL_LIST];
     LIST_ENTRY       Link;
+    UINTN            PageCacheCount;
+    VOID             *PageCache[POOL_PAGE_CACHE_SIZE];
 } POOL;
 
 //
@@ -85,6 +93,18 @@ POOL            mPoolHead[EfiMaxMemoryType];
 //
 LIST_ENTRY      mPoolHeadList = INITIALIZE_LIST_HEAD_VARIABLE (mPoolHeadList);
 
+//
+// Pool allocation statistics, reported through the memory profile.
+//
+MEMORY_PROFILE_POOL_STATS  gPoolStats = {
+  {
+    MEMORY_PROFILE_POOL_STATS_SIGNATURE,
+    sizeof (MEMORY_PROFILE_POOL_STATS),
+    MEMORY_PROFILE_POOL_STATS_REVISION
+  },
+  0
+};
+
 /**
   Get pool size table index from the specified size.
 
@@ -125,6 +145,7 @@ CoreInitializePool (
     mPoolHead[Type].Signature  = 0;
     mPoolHead[Type].Used       = 0;
     mPoolHead[Type].MemoryType = (EFI_MEMORY_TYPE) Type;
+    mPoolHead[Type].PageCacheCount = 0;
     for (Index=0; Index < MAX_POOL_LIST; Index++) {
       InitializeListHead (&mPoolHead[Type].FreeList[Index]);
     }
@@ -175,6 +196,7 @@ LookupPoolHead (
     Pool->Signature = POOL_SIGNATURE;
     Pool->Used      = 0;
     Pool->MemoryType = MemoryType;
+    Pool->PageCacheCount = 0;
     for (Index=0; Index < MAX_POOL_LIST; Index++) {
       InitializeListHead (&Pool->FreeList[Index]);
     }
@@ -188,6 +210,87 @@ LookupPoolHead (
 }
 
 
+/**
+  Check whether emptied pool pages of a pool may be cached.  Only types
+  that the OS reclaims anyway are cached, so the cache never leaves
+  runtime, ACPI or reserved memory behind in the final memory map.
+
+  @param  Pool                   The pool head
+
+  @return TRUE if the pool pages of this type may be cached
+
+**/
+STATIC
+BOOLEAN
+IsPoolPageCacheable (
+  IN POOL             *Pool
+  )
+{
+  return (BOOLEAN) (Pool->MemoryType == EfiLoaderCode       ||
+                    Pool->MemoryType == EfiLoaderData       ||
+                    Pool->MemoryType == EfiBootServicesCode ||
+                    Pool->MemoryType == EfiBootServicesData);
+}
+
+/**
+  Get one page of pool memory, from the page cache of the pool if it has
+  one, otherwise from the memory map.
+  Caller must have the memory lock held
+
+  @param  Pool                   The pool head
+  @param  Granularity            The pool page size
+
+  @return The pool page, or NULL
+
+**/
+STATIC
+VOID *
+CoreAllocatePoolPage (
+  IN POOL             *Pool,
+  IN UINTN            Granularity
+  )
+{
+  if (Pool->PageCacheCount != 0) {
+    gPoolStats.PageCacheHitCount++;
+    Pool->PageCacheCount--;
+    return Pool->PageCache[Pool->PageCacheCount];
+  }
+
+  gPoolStats.PageAllocateCount++;
+  return CoreAllocatePoolPages (Pool->MemoryType, EFI_SIZE_TO_PAGES (Granularity), Granularity);
+}
+
+/**
+  Release one page of pool memory that has no allocations left.  It is kept
+  in the page cache of the pool if there is room, otherwise it is returned
+  to the memory map.
+  Caller must have the memory lock held
+
+  @param  Pool                   The pool head
+  @param  Page                   The pool page
+  @param  Granularity            The pool page size
+
+**/
+STATIC
+VOID
+CoreFreePoolPage (
+  IN POOL             *Pool,
+  IN VOID             *Page,
+  IN UINTN            Granularity
+  )
+{
+  if (IsPoolPageCacheable (Pool) && Pool->PageCacheCount < POOL_PAGE_CACHE_SIZE) {
+    gPoolStats.PageCacheStoreCount++;
+    Pool->PageCache[Pool->PageCacheCount] = Page;
+    Pool->PageCacheCount++;
+    return;
+  }
+
+  gPoolStats.PageFreeCount++;
+  CoreFreePoolPages ((EFI_PHYSICAL_ADDRESS) (UINTN) Page, EFI_SIZE_TO_PAGES (Granularity));
+}
+
+
 
 /**
   Allocate pool of a particular type.
@@ -344,6 +447,7 @@ CoreAllocatePoolI (
   if (Index >= SIZE_TO_LIST (Granularity)) {
     NoPages = EFI_SIZE_TO_PAGES(Size) + EFI_SIZE_TO_PAGES (Granularity) - 1;
     NoPages &= ~(UINTN)(EFI_SIZE_TO_PAGES (Granularity) - 1);
+    gPoolStats.PageAllocateCount++;
     Head = CoreAllocatePoolPages (PoolType, NoPages, Granularity);
     goto Done;
   }
@@ -372,7 +476,7 @@ CoreAllocatePoolI (
     //
     // Get another page
     //
-    NewPage = CoreAllocatePoolPages(PoolType, EFI_SIZE_TO_PAGES (Granularity), Granularity);
+    NewPage = CoreAllocatePoolPage (Pool, Granularity);
     if (NewPage == NULL) {
       goto Done;
     }
@@ -410,6 +514,7 @@ Carve:
   //
   Free = CR (Pool->FreeList[Index].ForwardLink, POOL_FREE, Link, POOL_FREE_SIGNATURE);
   RemoveEntryList (&Free->Link);
+  gPoolStats.FreeListHitCount++;
 
   Head = (POOL_HEAD *) Free;
 
@@ -442,6 +547,7 @@ Done:
     // Account the allocation
     //
     Pool->Used += Size;
+    gPoolStats.AllocateCount++;
 
   } else {
     DEBUG ((DEBUG_ERROR | DEBUG_POOL, "AllocatePool: failed to allocate %ld bytes\n", (UINT64) Size));
@@ -568,6 +674,7 @@ CoreFreePoolI (
     return EFI_INVALID_PARAMETER;
   }
   Pool->Used -= Size;
+  gPoolStats.FreeCount++;
   DEBUG ((DEBUG_POOL, "FreePool: %p (len %lx) %,ld\n", Head->Data, (UINT64)(Head->Size - POOL_OVERHEAD), (UINT64) Pool->Used));
 
   if  (Head->Type == EfiACPIReclaimMemory   ||
@@ -596,6 +703,7 @@ CoreFreePoolI (
     //
     NoPages = EFI_SIZE_TO_PAGES(Size) + EFI_SIZE_TO_PAGES (Granularity) - 1;
     NoPages &= ~(UINTN)(EFI_SIZE_TO_PAGES (Granularity) - 1);
+    gPoolStats.PageFreeCount++;
     CoreFreePoolPages ((EFI_PHYSICAL_ADDRESS) (UINTN) Head, NoPages);
 
   } else {
@@ -652,7 +760,7 @@ CoreFreePoolI (
         //
         // Free the page
         //
-        CoreFreePoolPages ((EFI_PHYSICAL_ADDRESS) (UINTN)NewPage, EFI_SIZE_TO_PAGES (Granularity));
+        CoreFreePoolPage (Pool, NewPage, Granularity);
       }
     }
   }
@@ -111,6 +111,20 @@ typedef struct {
   //MEMORY_PROFILE_DESCRIPTOR     MemoryDescriptor[MemoryRangeCount];
 } MEMORY_PROFILE_MEMORY_RANGE;
 
+#define MEMORY_PROFILE_POOL_STATS_SIGNATURE SIGNATURE_32 ('M','P','P','S')
+#define MEMORY_PROFILE_POOL_STATS_REVISION 0x0001
+
+typedef struct {
+  MEMORY_PROFILE_COMMON_HEADER  Header;
+  UINT64                        AllocateCount;
+  UINT64                        FreeCount;
+  UINT64                        FreeListHitCount;
+  UINT64                        PageAllocateCount;
+  UINT64                        PageFreeCount;
+  UINT64                        PageCacheHitCount;
+  UINT64                        PageCacheStoreCount;
+} MEMORY_PROFILE_POOL_STATS;
+
 //
 // UEFI memory profile layout:
 // +--------------------------------+
@@ -128,6 +142,8 @@ typedef struct {
 // +--------------------------------+
 // | ALLOC_INFO(n, mn)              |
 // +--------------------------------+
+// | POOL_STATS                     |
+// +--------------------------------+
 //
 
 typedef struct _EDKII_MEMORY_PROFILE_PROTOCOL EDKII_MEMORY_PROFILE_PROTOCOL;
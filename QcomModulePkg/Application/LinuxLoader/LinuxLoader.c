@@ -201,15 +201,18 @@ LinuxLoaderEntry (IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *SystemTable)
     goto stack_guard_update_default;
   }
 
+  BootTimelineBegin (BT_PARTITION_ENUM);
   Status = EnumeratePartitions ();
 
   if (EFI_ERROR (Status)) {
     DEBUG ((EFI_D_ERROR, "LinuxLoader: Could not enumerate partitions: %r\n",
             Status));
+    BootTimelineFail (BT_PARTITION_ENUM);
     goto stack_guard_update_default;
   }
 
   UpdatePartitionEntries ();
+  BootTimelineEnd (BT_PARTITION_ENUM);
   /*Check for multislot boot support*/
   MultiSlotBoot = PartitionHasMultiSlot ((CONST CHAR16 *)L"boot");
   if (MultiSlotBoot) {
@@ -305,11 +308,25 @@ LinuxLoaderEntry (IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *SystemTable)
     Info.MultiSlotBoot = MultiSlotBoot;
     Info.BootIntoRecovery = BootIntoRecovery;
     Info.BootReasonAlarm = BootReasonAlarm;
+
+#if !TARGET_BOARD_TYPE_AUTO
+    /* The orange state warning replaces the splash, save the splash
+     * while the images are read and verified instead of after.
+     */
+    if (IsEnableDisplayMenuFlagSupported () &&
+        IsUnlocked ()) {
+      StartBootLogoBackUp ();
+    }
+#endif
+
+    BootTimelineBegin (BT_AVB_VERIFY);
     Status = LoadImageAndAuth (&Info);
     if (Status != EFI_SUCCESS) {
       DEBUG ((EFI_D_ERROR, "LoadImageAndAuth failed: %r\n", Status));
+      BootTimelineFail (BT_AVB_VERIFY);
       goto fastboot;
     }
+    BootTimelineEnd (BT_AVB_VERIFY);
 
     Status = WaitForDisplayCompletion ();
     if (Status != EFI_SUCCESS) {
@@ -186,8 +186,28 @@ typedef struct BootLinuxParamlist {
   BOOLEAN BootingWith32BitKernel;
   BOOLEAN BootingWithPatchedKernel;
   BOOLEAN BootingWithGzipPkgKernel;
+  BOOLEAN BootingWithLz4PkgKernel;
+  BOOLEAN RamdiskInPlace;
 } BootParamlist;
 
+/* Kernel, DTB and ramdisk fragments */
+#define MAX_BOOT_REGIONS 4
+
+/* One destination range of the memory handed to the kernel, Src is NULL
+ * when the content is already there or produced at Dest by another step.
+ */
+typedef struct {
+  CONST CHAR8 *Name;
+  UINT64 Dest;
+  UINT64 Size;
+  CONST VOID *Src;
+} BootRegion;
+
+typedef struct {
+  BootRegion Regions[MAX_BOOT_REGIONS];
+  UINT32 NumRegions;
+} BootLayout;
+
 EFI_STATUS
 BootLinux (BootInfo *Info);
 EFI_STATUS
@@ -40,6 +40,32 @@ typedef enum {
   BS_MAX,
 } BS_ENTRY;
 
+/* Enough for one "<name>:<start us>:<duration us>[:failed]" timeline entry */
+#define BT_SPAN_STR_LEN 64
+
+/* Named spans of the boot timeline, keep BootTimelineNames in sync */
+typedef enum {
+  BT_PARTITION_ENUM = 0,
+  BT_AVB_VERIFY,
+  BT_DTB_SELECT,
+  BT_DTB_OVERLAY,
+  BT_KERNEL_DECOMPRESS,
+  BT_CMDLINE_UPDATE,
+  BT_MAX,
+} BT_SPAN;
+
 void
 BootStatsSetTimeStamp (BS_ENTRY BootStatId);
+
+void
+BootTimelineBegin (BT_SPAN Span);
+
+void
+BootTimelineEnd (BT_SPAN Span);
+
+void
+BootTimelineFail (BT_SPAN Span);
+
+UINT32
+BootTimelineGetSpan (UINT32 Index, CHAR8 *Buf, UINT32 BufLen);
 #endif
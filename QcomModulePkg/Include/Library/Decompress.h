@@ -39,4 +39,15 @@ decompress (unsigned char *,
             unsigned int,
             unsigned int *,
             unsigned int *);
+
+int
+is_lz4_package (unsigned char *, unsigned int);
+
+int
+lz4_decompress (unsigned char *,
+                unsigned int,
+                unsigned char *,
+                unsigned int,
+                unsigned int *,
+                unsigned int *);
 #endif /* __PLATFORM_MSM_SHARED_DECOMPRESS_H */
@@ -165,6 +165,7 @@ EFI_STATUS
 DrawMenu (MENU_MSG_INFO *TargetMenu, UINT32 *Height);
 EFI_STATUS
 UpdateMsgBackground (MENU_MSG_INFO *MenuMsgInfo, UINT32 NewBgColor);
+VOID StartBootLogoBackUp (VOID);
 EFI_STATUS BackUpBootLogoBltBuffer (VOID);
 VOID RestoreBootLogoBitBuffer (VOID);
 VOID FreeBootLogoBltBuffer (VOID);
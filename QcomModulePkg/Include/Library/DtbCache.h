@@ -0,0 +1,101 @@
+/* Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * * Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __DTB_CACHE_H__
+#define __DTB_CACHE_H__
+
+#include "BootLinux.h"
+
+/* Optional partition holding the overlaid DTB of the last verified boot */
+#define DTB_CACHE_PARTITION L"dtbcache"
+#define DTB_CACHE_MAGIC "DTBCACHE"
+#define DTB_CACHE_MAGIC_SIZE 8
+#define DTB_CACHE_VERSION 3
+
+/* Everything the overlaid DTB depends on, compared as raw bytes */
+typedef struct DtbCacheKey {
+  UINT32 DtbImgSize;
+  UINT32 DtbImgCrc;
+  UINT32 DtboImgSize;
+  UINT32 DtboImgCrc;
+  UINT32 ChipId;
+  UINT32 ChipVersion;
+  UINT32 FoundryId;
+  UINT32 PlatformType;
+  UINT32 PlatformVersion;
+  UINT32 PlatformSubType;
+  UINT32 PlatformHlosSubType;
+  UINT32 TargetId;
+  UINT32 PmicTarget[PMIC_IDX4];
+  UINT32 BootIntoRecovery;
+} DtbCacheKey;
+
+/* Stored in the first block of the partition, the DTB follows */
+typedef struct DtbCacheHdr {
+  CHAR8 Magic[DTB_CACHE_MAGIC_SIZE];
+  UINT32 Version;
+  UINT32 DtbSize;
+  UINT32 DtbCrc;
+  DtbCacheKey Key;
+  DtbSelection Selection;
+} DtbCacheHdr;
+
+/**
+ * Copies the cached overlaid DTB to DeviceTreeLoadAddr
+ * when it was built from the same DTB table in DtbImg
+ * and the same dtbo image on this board, and restores
+ * the DTB selection it was built with. Only used on
+ * unlocked devices.
+ *
+ * @return EFI_SUCCESS if DTB selection and overlay can
+ *         be skipped
+ */
+EFI_STATUS
+DtbCacheLoad (BootInfo *Info,
+              BootParamlist *BootParamlistPtr,
+              CONST VOID *DtbImg,
+              UINT32 DtbImgSize);
+
+/**
+ * Saves the overlaid DTB at DeviceTreeLoadAddr after a
+ * DtbCacheLoad () miss.
+ *
+ * @return VOID
+ */
+VOID
+DtbCacheStore (BootParamlist *BootParamlistPtr);
+
+/**
+ * Drops the cached DTB, used when one of the images
+ * it was built from gets flashed or erased.
+ *
+ * @return VOID
+ */
+VOID
+DtbCacheInvalidate (VOID);
+#endif /* __DTB_CACHE_H__ */
@@ -173,6 +173,44 @@ typedef struct DtInfo {
   VOID *Dtb;
 } DtInfo;
 
+/* DTB selection cache, persisted across boots. A selection is reused while
+ * the contents of every DTB in the table (Key) and the board and PMICs it
+ * was made for (BoardKey) are unchanged.
+ */
+#define DTB_SELECT_CACHE_VERSION 3
+
+typedef enum {
+  DTB_SELECT_SOC = 0,
+  DTB_SELECT_BOARD,
+  DTB_SELECT_MAX,
+} DTB_SELECT_TYPE;
+
+typedef struct DtbSelectEntry {
+  UINT64 Key;
+  UINT32 DtbCount;
+  INT32 BestIdx;
+  INT32 RticIdx;
+  BOOLEAN DtboNeed;
+  UINT64 DtMatchVal;
+} DtbSelectEntry;
+
+typedef struct DtbSelectCache {
+  UINT32 Version;
+  UINT64 BoardKey;
+  DtbSelectEntry Entry[DTB_SELECT_MAX];
+} DtbSelectCache;
+
+/* Outcome of GetSocDtb () and GetBoardDtb () that a boot reusing their
+ * overlaid DTB has to restore, RticIdx is the appended DTB carrying the
+ * RTIC data.
+ */
+typedef struct DtbSelection {
+  INT32 DtbIdx;
+  INT32 DtboIdx;
+  INT32 RticIdx;
+  UINT32 DtboNeed;
+} DtbSelection;
+
 /*
  * For DTB V1: The DTB entries would be of the format
  * qcom,msm-id = <msm8974, CDP, rev_1>; (3 * sizeof(uint32_t))
@@ -310,6 +348,10 @@ DeviceTreeValidate (UINT8 *DeviceTreeBuff,
                     UINT32 *DeviceTreeSize);
 INT32 GetDtboIdx (VOID);
 INT32 GetDtbIdx (VOID);
+VOID GetDtbSelection (DtbSelection *Selection);
+VOID RestoreDtbSelection (VOID *DtbImg,
+                          UINT32 DtbImgSize,
+                          CONST DtbSelection *Selection);
 VOID DeleteDtList (struct fdt_entry_node** DtList);
 BOOLEAN AppendToDtList (struct fdt_entry_node **DtList,
                 UINT64 Address,
@@ -133,6 +133,8 @@ table in the respective position mentioned below.
 #define MIN_SLOTS 1
 #define MAX_SLOTS 2
 #define MAX_LUNS 8
+/* Buckets of the partition name index, a power of two */
+#define PTN_NAME_INDEX_SIZE 256
 #define NO_LUN -1
 
 #define GET_LWORD_FROM_BYTE(x)                                                 \
@@ -0,0 +1,116 @@
+/* Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * * Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __VB_CACHE_H__
+#define __VB_CACHE_H__
+
+#include "BootLinux.h"
+
+/* Optional partition holding the digests verified on the last boot */
+#define VB_CACHE_PARTITION L"vbcache"
+#define VB_CACHE_MAGIC "VBSTATE1"
+#define VB_CACHE_MAGIC_SIZE 8
+#define VB_CACHE_VERSION 2
+#define VB_CACHE_DIGEST_SIZE 64
+#define VB_CACHE_MAX_ENTRIES 8
+#define VB_CACHE_SAMPLES 16
+#define VB_CACHE_SAMPLE_SIZE SIZE_4KB
+
+typedef struct VbCacheEntry {
+  CHAR8 PartitionName[MAX_GPT_NAME_SIZE];
+  /* Digest of the vbmeta image holding the hash descriptor */
+  UINT8 VbMetaDigest[VB_CACHE_DIGEST_SIZE];
+  UINT8 Digest[VB_CACHE_DIGEST_SIZE];
+  UINT32 DigestLen;
+  UINT32 SampleCrc;
+  UINT64 ImageSize;
+} VbCacheEntry;
+
+/* Stored from the first block of the partition */
+typedef struct VbCacheHdr {
+  CHAR8 Magic[VB_CACHE_MAGIC_SIZE];
+  UINT32 Version;
+  UINT32 Crc;
+  UINT8 VbMetaDigest[VB_CACHE_DIGEST_SIZE];
+  UINT32 NumEntries;
+  VbCacheEntry Entries[VB_CACHE_MAX_ENTRIES];
+} VbCacheHdr;
+
+/**
+ * Checks whether Partition was verified against Digest from
+ * the vbmeta image hashing to VbMetaDigest on an earlier boot
+ * and whether a sampled CRC of the Size bytes just loaded at
+ * Data still matches that boot. With Data set to NULL only
+ * the digests and the size are checked, before anything is
+ * read.
+ *
+ * @return TRUE if hashing the image can be skipped
+ */
+BOOLEAN
+VbCacheLookup (CONST CHAR8 *Partition,
+               CONST UINT8 *VbMetaDigest,
+               UINT32 VbMetaDigestLen,
+               CONST UINT8 *Digest,
+               UINT32 DigestLen,
+               CONST VOID *Data,
+               UINT64 Size);
+
+/**
+ * Records that Partition hashed to Digest from the vbmeta
+ * image hashing to VbMetaDigest on this boot.
+ *
+ * @return VOID
+ */
+VOID
+VbCacheUpdate (CONST CHAR8 *Partition,
+               CONST UINT8 *VbMetaDigest,
+               UINT32 VbMetaDigestLen,
+               CONST UINT8 *Digest,
+               UINT32 DigestLen,
+               CONST VOID *Data,
+               UINT64 Size);
+
+/**
+ * Writes the digests used on this boot back, tagged with
+ * the digest of the vbmeta images they were checked against.
+ * Nothing is written when both are unchanged.
+ *
+ * @return VOID
+ */
+VOID
+VbCacheStore (CONST UINT8 *VbMetaDigest, UINT32 VbMetaDigestLen);
+
+/**
+ * Drops the cached digests, used when fastboot writes
+ * to the device.
+ *
+ * @return VOID
+ */
+VOID
+VbCacheInvalidate (VOID);
+#endif /* __VB_CACHE_H__ */
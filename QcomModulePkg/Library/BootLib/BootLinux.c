@@ -32,6 +32,7 @@
 
 #include <Library/DeviceInfo.h>
 #include <Library/DrawUI.h>
+#include <Library/DtbCache.h>
 #include <Library/PartitionTableUpdate.h>
 #include <Library/ShutdownServices.h>
 #include <Library/VerifiedBootMenu.h>
@@ -209,6 +210,10 @@ UpdateKernelModeAndPkg (BootParamlist *BootParamlistPtr)
                  BootParamlistPtr->PageSize), BootParamlistPtr->KernelSize)) {
       BootParamlistPtr->BootingWithGzipPkgKernel = TRUE;
   }
+  else if (is_lz4_package ((BootParamlistPtr->ImageBuffer +
+                 BootParamlistPtr->PageSize), BootParamlistPtr->KernelSize)) {
+      BootParamlistPtr->BootingWithLz4PkgKernel = TRUE;
+  }
   else {
     if (!AsciiStrnCmp ((CHAR8 *) Kptr, PATCHED_KERNEL_MAGIC,
                        sizeof (PATCHED_KERNEL_MAGIC) - 1)) {
@@ -387,6 +392,7 @@ DTBImgCheckAndAppendDT (BootInfo *Info, BootParamlist *BootParamlistPtr)
   VOID *Dtb;
   BOOLEAN DtboCheckNeeded = FALSE;
   BOOLEAN DtboImgInvalid = FALSE;
+  BOOLEAN DtbCacheNeeded = FALSE;
   struct fdt_entry_node *DtsList = NULL;
   EFI_STATUS Status;
   UINT32 HeaderVersion = 0;
@@ -503,6 +509,19 @@ DTBImgCheckAndAppendDT (BootInfo *Info, BootParamlist *BootParamlistPtr)
       }
     }
   } else {
+    /* Reuse the overlaid DTB of a previous boot from the same images,
+     * a hit skips the SoC and board DTB selection as well.
+     */
+    if (BootParamlistPtr->DtbOffset < ImageSize) {
+      DtbCacheNeeded = TRUE;
+      if (DtbCacheLoad (Info, BootParamlistPtr,
+                        ImageBuffer + BootParamlistPtr->DtbOffset,
+                        ImageSize - BootParamlistPtr->DtbOffset) ==
+          EFI_SUCCESS) {
+        return EFI_SUCCESS;
+      }
+    }
+
     /*It is the case of DTB overlay Get the Soc specific dtb */
     SocDtb = GetSocDtb (ImageBuffer,
          ImageSize,
@@ -576,13 +595,24 @@ DTBImgCheckAndAppendDT (BootInfo *Info, BootParamlist *BootParamlistPtr)
       }
     }
 
+    /* Selection is done, the overlay is timed on its own */
+    BootTimelineEnd (BT_DTB_SELECT);
+    BootTimelineBegin (BT_DTB_OVERLAY);
+    /* Without overlays there is nothing worth caching */
+    DtbCacheNeeded = DtbCacheNeeded && (DtsList != NULL);
     Status = ApplyOverlay (BootParamlistPtr,
                            SocDtb,
                            DtsList);
     if (Status != EFI_SUCCESS) {
       DEBUG ((EFI_D_ERROR, "Error: Dtb overlay failed\n"));
+      BootTimelineFail (BT_DTB_OVERLAY);
       return Status;
     }
+    BootTimelineEnd (BT_DTB_OVERLAY);
+
+    if (DtbCacheNeeded) {
+      DtbCacheStore (BootParamlistPtr);
+    }
   }
   return EFI_SUCCESS;
 }
@@ -601,7 +631,8 @@ GZipPkgCheck (BootParamlist *BootParamlistPtr)
     return EFI_INVALID_PARAMETER;
   }
 
-  if (BootParamlistPtr->BootingWithGzipPkgKernel) {
+  if (BootParamlistPtr->BootingWithGzipPkgKernel ||
+      BootParamlistPtr->BootingWithLz4PkgKernel) {
     OutAvaiLen = BootParamlistPtr->DeviceTreeLoadAddr -
                  BootParamlistPtr->KernelLoadAddr;
 
@@ -613,6 +644,7 @@ GZipPkgCheck (BootParamlist *BootParamlistPtr)
     }
 
     DecompressStartTime = GetTimerCountms ();
+    BootTimelineBegin (BT_KERNEL_DECOMPRESS);
     if (decompress (
         (UINT8 *)(BootParamlistPtr->ImageBuffer +
         BootParamlistPtr->PageSize),               // Read blob using BlockIo
@@ -621,15 +653,18 @@ GZipPkgCheck (BootParamlist *BootParamlistPtr)
         (UINT32)OutAvaiLen,                        // Allocated Size
         &BootParamlistPtr->DtbOffset, &OutLen)) {
           DEBUG ((EFI_D_ERROR, "Decompressing kernel image failed!!!\n"));
+          BootTimelineFail (BT_KERNEL_DECOMPRESS);
           return RETURN_OUT_OF_RESOURCES;
     }
 
     if (OutLen <= sizeof (struct kernel64_hdr *)) {
       DEBUG ((EFI_D_ERROR,
               "Decompress kernel size is smaller than image header size\n"));
+      BootTimelineFail (BT_KERNEL_DECOMPRESS);
       return RETURN_OUT_OF_RESOURCES;
     }
     Kptr = (Kernel64Hdr *) BootParamlistPtr->KernelLoadAddr;
+    BootTimelineEnd (BT_KERNEL_DECOMPRESS);
     DEBUG ((EFI_D_INFO, "Decompressing kernel image total time: %lu ms\n",
                          GetTimerCountms () - DecompressStartTime));
   } else {
@@ -681,29 +716,220 @@ GZipPkgCheck (BootParamlist *BootParamlistPtr)
   return EFI_SUCCESS;
 }
 
+/* The ramdisk is handed to the kernel inside the verified image buffer
+ * instead of being copied to RamdiskLoadAddr. For header v3+ the vendor
+ * ramdisk is moved in front of it, into the kernel section that was
+ * already copied or decompressed. 32-bit kernels still copy the kernel
+ * from the image later and VMs keep the fixed ramdisk region.
+ */
+STATIC BOOLEAN
+GetInPlaceRamdisk (BootInfo *Info,
+                   BootParamlist *BootParamlistPtr,
+                   UINT64 *RamdiskAddr)
+{
+  UINT64 Ramdisk;
+  UINT64 VendorRamdiskSize = 0;
+
+  if (BootParamlistPtr->BootingWith32BitKernel ||
+      IsVmEnabled () ||
+      BootParamlistPtr->RamdiskSize == 0) {
+    return FALSE;
+  }
+
+  if (Info->HeaderVersion >= BOOT_HEADER_VERSION_THREE) {
+    VendorRamdiskSize = BootParamlistPtr->VendorRamdiskSize;
+    if (VendorRamdiskSize > (BootParamlistPtr->RamdiskOffset -
+                             BootParamlistPtr->PageSize)) {
+      return FALSE;
+    }
+  }
+
+  Ramdisk = (UINT64)BootParamlistPtr->ImageBuffer +
+            BootParamlistPtr->RamdiskOffset - VendorRamdiskSize;
+  if (Ramdisk < BootParamlistPtr->KernelEndAddr &&
+      Ramdisk + VendorRamdiskSize + BootParamlistPtr->RamdiskSize >
+        BootParamlistPtr->KernelLoadAddr) {
+    return FALSE;
+  }
+
+  *RamdiskAddr = Ramdisk;
+  return TRUE;
+}
+
+STATIC BOOLEAN
+RangesOverlap (UINT64 Start1, UINT64 Size1, UINT64 Start2, UINT64 Size2)
+{
+  return Size1 &&
+         Size2 &&
+         Start1 < Start2 + Size2 &&
+         Start2 < Start1 + Size1;
+}
+
+STATIC EFI_STATUS
+BootLayoutAdd (BootLayout *Layout,
+               CONST CHAR8 *Name,
+               UINT64 Dest,
+               UINT64 Size,
+               CONST VOID *Src)
+{
+  UINT32 Idx;
+
+  if (Layout->NumRegions >= MAX_BOOT_REGIONS) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  if (CHECK_ADD64 (Dest, Size) ||
+      (Src != NULL &&
+       CHECK_ADD64 ((UINT64)Src, Size))) {
+    DEBUG ((EFI_D_ERROR, "Integer Overflow: %a at 0x%lx, size 0x%lx\n",
+            Name, Dest, Size));
+    return EFI_BAD_BUFFER_SIZE;
+  }
+
+  for (Idx = 0; Idx < Layout->NumRegions; Idx++) {
+    if (RangesOverlap (Dest, Size, Layout->Regions[Idx].Dest,
+                       Layout->Regions[Idx].Size)) {
+      DEBUG ((EFI_D_ERROR, "%a at 0x%lx overlaps %a at 0x%lx\n", Name, Dest,
+              Layout->Regions[Idx].Name, Layout->Regions[Idx].Dest));
+      return EFI_BUFFER_TOO_SMALL;
+    }
+  }
+
+  Layout->Regions[Layout->NumRegions].Name = Name;
+  Layout->Regions[Layout->NumRegions].Dest = Dest;
+  Layout->Regions[Layout->NumRegions].Size = Size;
+  Layout->Regions[Layout->NumRegions].Src = Src;
+  Layout->NumRegions++;
+  return EFI_SUCCESS;
+}
+
+/* Copies every region that is not yet in place exactly once, in layout
+ * order. A copy must not clobber the source of a later one, the layout
+ * is rejected instead of being reordered.
+ */
+STATIC EFI_STATUS
+BootLayoutApply (BootLayout *Layout)
+{
+  BootRegion *Region;
+  UINT32 Idx;
+  UINT32 Next;
+
+  for (Idx = 0; Idx < Layout->NumRegions; Idx++) {
+    Region = &Layout->Regions[Idx];
+    if (Region->Src == NULL ||
+        (UINT64)Region->Src == Region->Dest) {
+      continue;
+    }
+
+    for (Next = Idx + 1; Next < Layout->NumRegions; Next++) {
+      if (Layout->Regions[Next].Src != NULL &&
+          RangesOverlap (Region->Dest, Region->Size,
+                         (UINT64)Layout->Regions[Next].Src,
+                         Layout->Regions[Next].Size)) {
+        DEBUG ((EFI_D_ERROR, "%a at 0x%lx overwrites the source of %a\n",
+                Region->Name, Region->Dest, Layout->Regions[Next].Name));
+        return EFI_INVALID_PARAMETER;
+      }
+    }
+
+    gBS->CopyMem ((VOID *)Region->Dest, (VOID *)Region->Src, Region->Size);
+  }
+
+  return EFI_SUCCESS;
+}
+
+/* Computes where the kernel, the DTB and the ramdisk fragments end up.
+ * For header v3+ the vendor ramdisk goes right in front of the generic
+ * one so that the concatenation overlays for .gzip and .cpio formats.
+ */
+STATIC EFI_STATUS
+PlanBootLayout (BootInfo *Info,
+                BootParamlist *BootParamlistPtr,
+                BootLayout *Layout,
+                UINT64 *RamdiskAddr)
+{
+  EFI_STATUS Status;
+  UINT64 KernelSize;
+  UINT64 VendorRamdiskSize = 0;
+  CONST VOID *KernelSrc = NULL;
+  CONST VOID *VendorRamdiskSrc = NULL;
+  CONST VOID *RamdiskSrc = NULL;
+
+  SetMem (Layout, sizeof (*Layout), 0);
+
+  /* A 64-bit kernel was already decompressed or copied, and may grow up
+   * to the DTB at runtime. A 32-bit one is still in the image buffer.
+   */
+  if (BootParamlistPtr->BootingWith32BitKernel) {
+    KernelSize = BootParamlistPtr->KernelSizeActual;
+    KernelSrc = BootParamlistPtr->ImageBuffer + BootParamlistPtr->PageSize;
+    if (CHECK_ADD64 (BootParamlistPtr->KernelLoadAddr, KernelSize) ||
+        BootParamlistPtr->KernelLoadAddr + KernelSize >
+        BootParamlistPtr->DeviceTreeLoadAddr) {
+      DEBUG ((EFI_D_ERROR, "Kernel size is over the limit\n"));
+      return EFI_INVALID_PARAMETER;
+    }
+  } else {
+    KernelSize = BootParamlistPtr->DeviceTreeLoadAddr -
+                 BootParamlistPtr->KernelLoadAddr;
+  }
+  Status = BootLayoutAdd (Layout, "Kernel", BootParamlistPtr->KernelLoadAddr,
+                          KernelSize, KernelSrc);
+  if (Status != EFI_SUCCESS) {
+    return Status;
+  }
+
+  Status = BootLayoutAdd (Layout, "DTB", BootParamlistPtr->DeviceTreeLoadAddr,
+                          DT_SIZE_2MB, NULL);
+  if (Status != EFI_SUCCESS) {
+    return Status;
+  }
+
+  if (Info->HeaderVersion >= BOOT_HEADER_VERSION_THREE) {
+    VendorRamdiskSize = BootParamlistPtr->VendorRamdiskSize;
+    VendorRamdiskSrc = BootParamlistPtr->VendorImageBuffer +
+                       BootParamlistPtr->PageSize;
+  }
+
+  BootParamlistPtr->RamdiskInPlace =
+      GetInPlaceRamdisk (Info, BootParamlistPtr, RamdiskAddr);
+  if (!BootParamlistPtr->RamdiskInPlace) {
+    *RamdiskAddr = BootParamlistPtr->RamdiskLoadAddr;
+    RamdiskSrc = BootParamlistPtr->ImageBuffer +
+                 BootParamlistPtr->RamdiskOffset;
+    if (*RamdiskAddr + VendorRamdiskSize + BootParamlistPtr->RamdiskSize >
+        BootParamlistPtr->KernelEndAddr) {
+      DEBUG ((EFI_D_ERROR, "Error: Ramdisk size is over the limit\n"));
+      return EFI_BAD_BUFFER_SIZE;
+    }
+  }
+
+  Status = BootLayoutAdd (Layout, "Vendor ramdisk", *RamdiskAddr,
+                          VendorRamdiskSize, VendorRamdiskSrc);
+  if (Status != EFI_SUCCESS) {
+    return Status;
+  }
+
+  return BootLayoutAdd (Layout, "Ramdisk", *RamdiskAddr + VendorRamdiskSize,
+                        BootParamlistPtr->RamdiskSize, RamdiskSrc);
+}
+
 STATIC EFI_STATUS
 LoadAddrAndDTUpdate (BootInfo *Info, BootParamlist *BootParamlistPtr)
 {
   EFI_STATUS Status;
-  UINT64 RamdiskLoadAddr;
-  UINT64 RamdiskEndAddr = 0;
+  UINT64 RamdiskLoadAddr = 0;
   UINT32 TotalRamdiskSize;
+  BootLayout Layout;
 
   if (BootParamlistPtr == NULL) {
     DEBUG ((EFI_D_ERROR, "Invalid input parameters\n"));
     return EFI_INVALID_PARAMETER;
   }
 
-  RamdiskLoadAddr = BootParamlistPtr->RamdiskLoadAddr;
-
   TotalRamdiskSize = BootParamlistPtr->RamdiskSize +
                             BootParamlistPtr->VendorRamdiskSize;
 
-  if (RamdiskEndAddr - RamdiskLoadAddr < TotalRamdiskSize) {
-    DEBUG ((EFI_D_ERROR, "Error: Ramdisk size is over the limit\n"));
-    return EFI_BAD_BUFFER_SIZE;
-  }
-
   if (CHECK_ADD64 ((UINT64)BootParamlistPtr->ImageBuffer,
       BootParamlistPtr->RamdiskOffset)) {
     DEBUG ((EFI_D_ERROR, "Integer Overflow: ImageBuffer=%u, "
@@ -713,6 +939,11 @@ LoadAddrAndDTUpdate (BootInfo *Info, BootParamlist *BootParamlistPtr)
     return EFI_BAD_BUFFER_SIZE;
   }
 
+  Status = PlanBootLayout (Info, BootParamlistPtr, &Layout, &RamdiskLoadAddr);
+  if (Status != EFI_SUCCESS) {
+    return Status;
+  }
+
   Status = UpdateDeviceTree ((VOID *)BootParamlistPtr->DeviceTreeLoadAddr,
                              BootParamlistPtr->FinalCmdLine,
                              (VOID *)RamdiskLoadAddr, TotalRamdiskSize,
@@ -722,43 +953,11 @@ LoadAddrAndDTUpdate (BootInfo *Info, BootParamlist *BootParamlistPtr)
     return Status;
   }
 
-  /* If the boot-image version is greater than 2, place the vendor-ramdisk
-   * first in the memory, and then place ramdisk.
-   * This concatination would result in an overlay for .gzip and .cpio formats.
-   */
-  if (Info->HeaderVersion >= BOOT_HEADER_VERSION_THREE) {
-    gBS->CopyMem ((VOID *)RamdiskLoadAddr,
-                  BootParamlistPtr->VendorImageBuffer +
-                  BootParamlistPtr->PageSize,
-                  BootParamlistPtr->VendorRamdiskSize);
-
-    RamdiskLoadAddr += BootParamlistPtr->VendorRamdiskSize;
-  }
-
-  gBS->CopyMem ((CHAR8 *)RamdiskLoadAddr,
-                BootParamlistPtr->ImageBuffer +
-                BootParamlistPtr->RamdiskOffset,
-                BootParamlistPtr->RamdiskSize);
-
-  if (BootParamlistPtr->BootingWith32BitKernel) {
-    if (CHECK_ADD64 (BootParamlistPtr->KernelLoadAddr,
-        BootParamlistPtr->KernelSizeActual)) {
-      DEBUG ((EFI_D_ERROR, "Integer Overflow: while Kernel image copy\n"));
-      return EFI_BAD_BUFFER_SIZE;
-    }
-    if (BootParamlistPtr->KernelLoadAddr +
-        BootParamlistPtr->KernelSizeActual >
-        BootParamlistPtr->DeviceTreeLoadAddr) {
-      DEBUG ((EFI_D_ERROR, "Kernel size is over the limit\n"));
-      return EFI_INVALID_PARAMETER;
-    }
-    gBS->CopyMem ((CHAR8 *)BootParamlistPtr->KernelLoadAddr,
-                  BootParamlistPtr->ImageBuffer +
-                  BootParamlistPtr->PageSize,
-                  BootParamlistPtr->KernelSizeActual);
+  if (BootParamlistPtr->RamdiskInPlace) {
+    DEBUG ((EFI_D_VERBOSE, "Ramdisk in place at 0x%lx\n", RamdiskLoadAddr));
   }
 
-  return EFI_SUCCESS;
+  return BootLayoutApply (&Layout);
 }
 
 STATIC EFI_STATUS
@@ -982,30 +1181,41 @@ BootLinux (BootInfo *Info)
     BootDevImage = TRUE;
   }
 
+  BootTimelineBegin (BT_DTB_SELECT);
   Status = DTBImgCheckAndAppendDT (Info, &BootParamlistPtr);
   if (Status != EFI_SUCCESS) {
+    BootTimelineFail (BT_DTB_SELECT);
     return Status;
   }
+  BootTimelineEnd (BT_DTB_SELECT);
 
   /* Updates the command line from boot image, appends device serial no.,
    * baseband information, etc.
    * Called before ShutdownUefiBootServices as it uses some boot service
    * functions
    */
+  BootTimelineBegin (BT_CMDLINE_UPDATE);
   Status = UpdateCmdLine (BootParamlistPtr.CmdLine, FfbmStr, Recovery,
                    AlarmBoot, Info->VBCmdLine, &BootParamlistPtr.FinalCmdLine,
                    Info->HeaderVersion);
   if (EFI_ERROR (Status)) {
     DEBUG ((EFI_D_ERROR, "Error updating cmdline. Device Error %r\n", Status));
+    BootTimelineFail (BT_CMDLINE_UPDATE);
     return Status;
   }
+  BootTimelineEnd (BT_CMDLINE_UPDATE);
 
   Status = LoadAddrAndDTUpdate (Info, &BootParamlistPtr);
   if (Status != EFI_SUCCESS) {
        return Status;
   }
 
-  FreeVerifiedBootResource (Info);
+  /* An in place ramdisk still lives in the verified boot image buffer,
+   * which must not go back to the allocator before the kernel starts.
+   */
+  if (!BootParamlistPtr.RamdiskInPlace) {
+    FreeVerifiedBootResource (Info);
+  }
 
   /* Free the boot logo blt buffer before starting kernel */
   FreeBootLogoBltBuffer ();
@@ -31,9 +31,37 @@
 #include "AutoGen.h"
 #include "BootLinux.h"
 #include "Reg.h"
+#include <Library/PrintLib.h>
+#include <Library/TimerLib.h>
 
 #define BS_INFO_OFFSET (0x6B0)
 
+/* Records kept by the boot timeline, the oldest ones get overwritten */
+#define BT_RECORD_COUNT 128
+
+#define BT_RECORD_BEGIN 0
+#define BT_RECORD_END 1
+#define BT_RECORD_FAIL 2
+
+typedef struct {
+  UINT64 TimeUs;
+  UINT8 Span;
+  UINT8 Type;
+} BT_RECORD;
+
+STATIC CONST CHAR8 *BootTimelineNames[BT_MAX] = {
+  "partition-enum",
+  "avb-verify",
+  "dtb-select",
+  "dtb-overlay",
+  "kernel-decompress",
+  "cmdline-update",
+};
+
+STATIC BT_RECORD BootTimeline[BT_RECORD_COUNT];
+STATIC UINT32 BootTimelineCount;
+STATIC BOOLEAN BootTimelineOpen[BT_MAX];
+
 STATIC UINT32 KernelLoadStart;
 STATIC UINT64 SharedImemAddress;
 STATIC UINT64 MpmTimerBase;
@@ -119,3 +147,96 @@ BootStatsSetTimeStamp (BS_ENTRY BootStatId)
     }
   }
 }
+
+STATIC VOID
+BootTimelineRecord (BT_SPAN Span, UINT8 Type)
+{
+  BT_RECORD *Record;
+
+  if (Span >= BT_MAX) {
+    DEBUG ((EFI_D_ERROR, "Bad BootTimeline span: %u, Max: %u\n", Span,
+            BT_MAX));
+    return;
+  }
+
+  /* A span is closed once, by whichever of its end points comes first */
+  if (Type != BT_RECORD_BEGIN &&
+      !BootTimelineOpen[Span]) {
+    return;
+  }
+  BootTimelineOpen[Span] = (Type == BT_RECORD_BEGIN);
+
+  Record = &BootTimeline[BootTimelineCount % BT_RECORD_COUNT];
+  Record->TimeUs = DivU64x32 (GetTimeInNanoSecond (GetPerformanceCounter ()),
+                              1000);
+  Record->Span = Span;
+  Record->Type = Type;
+  BootTimelineCount++;
+}
+
+void
+BootTimelineBegin (BT_SPAN Span)
+{
+  BootTimelineRecord (Span, BT_RECORD_BEGIN);
+}
+
+void
+BootTimelineEnd (BT_SPAN Span)
+{
+  BootTimelineRecord (Span, BT_RECORD_END);
+}
+
+/* Closes a span on an error path, it is reported with a ":failed" suffix */
+void
+BootTimelineFail (BT_SPAN Span)
+{
+  BootTimelineRecord (Span, BT_RECORD_FAIL);
+}
+
+/* Format the Index-th completed span, oldest first, as
+ * "<name>:<start us>:<duration us>[:failed]" into Buf.
+ * Returns the length of the string, 0 if there is no such span.
+ */
+UINT32
+BootTimelineGetSpan (UINT32 Index, CHAR8 *Buf, UINT32 BufLen)
+{
+  UINT64 BeginUs[BT_MAX];
+  BOOLEAN Begun[BT_MAX];
+  BT_RECORD *Record;
+  UINT32 First = 0;
+  UINT32 Found = 0;
+  UINT32 i;
+
+  if (Buf == NULL || BufLen == 0) {
+    return 0;
+  }
+
+  if (BootTimelineCount > BT_RECORD_COUNT) {
+    First = BootTimelineCount - BT_RECORD_COUNT;
+  }
+
+  SetMem (Begun, sizeof (Begun), FALSE);
+  for (i = First; i < BootTimelineCount; i++) {
+    Record = &BootTimeline[i % BT_RECORD_COUNT];
+    if (Record->Type == BT_RECORD_BEGIN) {
+      BeginUs[Record->Span] = Record->TimeUs;
+      Begun[Record->Span] = TRUE;
+      continue;
+    }
+
+    if (!Begun[Record->Span]) {
+      continue;
+    }
+    Begun[Record->Span] = FALSE;
+
+    if (Found++ == Index) {
+      return AsciiSPrint (Buf, BufLen, "%a:%lu:%lu%a",
+                          BootTimelineNames[Record->Span],
+                          BeginUs[Record->Span],
+                          Record->TimeUs - BeginUs[Record->Span],
+                          Record->Type == BT_RECORD_FAIL ? ":failed" : "");
+    }
+  }
+
+  return 0;
+}
@@ -45,12 +45,42 @@
 #include "zlib/inflate.h"
 #include "zlib/inffast.h"
 
+#include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
 #include <Library/MemoryAllocationLib.h>
+#include <Library/ThreadStack.h>
+#include <Library/UefiBootServicesTableLib.h>
 
 #define GZIP_HEADER_LEN 10
 #define GZIP_FILENAME_LIMIT 256
 
+/* LZ4 legacy frame, as produced by "lz4 -l" for kernel images: a magic
+ * followed by independent blocks, each prefixed with its little endian
+ * compressed size and decompressing to 8 MB except for the last one.
+ */
+#define LZ4_LEGACY_MAGIC 0x184C2102
+#define LZ4_LEGACY_BLOCK_SIZE (8 * 1024 * 1024)
+#define LZ4_COMPRESS_BOUND(size) ((size) + ((size) / 255) + 16)
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_THREADS 8
+
+typedef struct {
+  unsigned char *src;
+  unsigned int src_len;
+  unsigned char *dst;
+  unsigned int dst_cap;
+  int out_len;
+} lz4_block;
+
+typedef struct {
+  lz4_block *blocks;
+  unsigned int count;
+  unsigned int first;
+  unsigned int stride;
+} lz4_worker;
+
+STATIC EFI_KERNEL_PROTOCOL *KernIntf = NULL;
+
 static void
 zlib_free (voidpf qpaque, void *addr)
 {
@@ -66,7 +96,8 @@ zlib_alloc (voidpf qpaque, uInt items, uInt size)
 }
 
 /* decompress gzip file "in_buf", return 0 if decompressed successful,
- * return -1 if decompressed failed.
+ * return -1 if decompressed failed. LZ4 legacy files are handed over to
+ * lz4_decompress().
  * in_buf - input gzip file
  * in_len - input the length file
  * out_buf - output the decompressed data
@@ -86,6 +117,10 @@ decompress (unsigned char *in_buf,
   int rc = -1;
   int i;
 
+  if (is_lz4_package (in_buf, in_len)) {
+    return lz4_decompress (in_buf, in_len, out_buf, out_buf_len, pos, out_len);
+  }
+
   if (in_len <= GZIP_HEADER_LEN) {
     DEBUG ((EFI_D_ERROR, "the input data is not a gzip package.\n"));
     return rc;
@@ -162,6 +197,321 @@ gunzip_end:
   return rc; /* returns 0 if decompressed successful */
 }
 
+static unsigned int
+get_le32 (const unsigned char *buf)
+{
+  return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((unsigned int)buf[3] << 24);
+}
+
+/* decode one raw LZ4 block, return the decompressed length or -1 if the
+ * block is malformed or does not fit in dst_cap.
+ */
+static int
+lz4_decode_block (const unsigned char *src,
+                  unsigned int src_len,
+                  unsigned char *dst,
+                  unsigned int dst_cap)
+{
+  const unsigned char *ip = src;
+  const unsigned char *iend = src + src_len;
+  unsigned char *op = dst;
+  unsigned char *oend = dst + dst_cap;
+  const unsigned char *match;
+  unsigned int token;
+  unsigned int offset;
+  UINTN len;
+  unsigned int s;
+
+  for (;;) {
+    if (ip >= iend)
+      return -1;
+    token = *ip++;
+
+    /* literals */
+    len = token >> 4;
+    if (len == 15) {
+      do {
+        if (ip >= iend)
+          return -1;
+        s = *ip++;
+        len += s;
+      } while (s == 255);
+    }
+    if (len > (UINTN)(iend - ip) || len > (UINTN)(oend - op))
+      return -1;
+    CopyMem (op, ip, len);
+    op += len;
+    ip += len;
+
+    /* the last sequence only carries literals */
+    if (ip == iend)
+      break;
+
+    /* match */
+    if (iend - ip < 2)
+      return -1;
+    offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (UINTN)(op - dst))
+      return -1;
+
+    len = token & 15;
+    if (len == 15) {
+      do {
+        if (ip >= iend)
+          return -1;
+        s = *ip++;
+        len += s;
+      } while (s == 255);
+    }
+    len += LZ4_MIN_MATCH;
+    if (len > (UINTN)(oend - op))
+      return -1;
+
+    match = op - offset;
+    if (offset >= len) {
+      CopyMem (op, match, len);
+      op += len;
+    } else {
+      /* overlapping match repeats the last "offset" bytes */
+      while (len--)
+        *op++ = *match++;
+    }
+  }
+
+  return op - dst;
+}
+
+static void
+lz4_decode_blocks (lz4_worker *worker)
+{
+  unsigned int i;
+  lz4_block *block;
+
+  for (i = worker->first; i < worker->count; i += worker->stride) {
+    block = &worker->blocks[i];
+    block->out_len = lz4_decode_block (block->src, block->src_len,
+                                       block->dst, block->dst_cap);
+  }
+}
+
+INT32 __attribute__ ( (no_sanitize ("safe-stack")))
+lz4_decode_thread (VOID *arg)
+{
+  Thread *current_thread = KernIntf->Thread->GetCurrentThread ();
+
+  lz4_decode_blocks ((lz4_worker *)arg);
+
+  ThreadStackNodeRemove (current_thread);
+  KernIntf->Thread->ThreadExit (0);
+
+  return 0;
+}
+
+/* number of CPUs the LZ4 blocks can be spread over, 1 means decode inline */
+static unsigned int
+lz4_max_threads (void)
+{
+  EFI_STATUS status;
+  unsigned int cpus;
+
+  if (KernIntf == NULL) {
+    status = gBS->LocateProtocol (&gEfiKernelProtocolGuid, NULL,
+                                  (VOID **)&KernIntf);
+    if (status != EFI_SUCCESS ||
+        KernIntf == NULL ||
+        KernIntf->Version < EFI_KERNEL_PROTOCOL_VER_UNSAFE_STACK_APIS) {
+      KernIntf = NULL;
+      return 1;
+    }
+  }
+
+  cpus = KernIntf->MpCpu->MpcoreGetAvailCpuCount ();
+  if (cpus < 1)
+    return 1;
+
+  return cpus < LZ4_MAX_THREADS ? cpus : LZ4_MAX_THREADS;
+}
+
+/* decode all blocks, on every available CPU when there is more than one.
+ * Blocks are striped over the workers, the calling thread is worker 0.
+ */
+static void
+lz4_decode_parallel (lz4_block *blocks, unsigned int count)
+{
+  lz4_worker workers[LZ4_MAX_THREADS];
+  Thread *threads[LZ4_MAX_THREADS];
+  unsigned int nthreads;
+  unsigned int i;
+  INT32 ret_code;
+
+  nthreads = lz4_max_threads ();
+  if (nthreads > count)
+    nthreads = count;
+
+  for (i = 0; i < nthreads; i++) {
+    workers[i].blocks = blocks;
+    workers[i].count = count;
+    workers[i].first = i;
+    workers[i].stride = nthreads;
+    threads[i] = NULL;
+  }
+
+  for (i = 1; i < nthreads; i++) {
+    threads[i] = KernIntf->Thread->ThreadCreate ("Lz4DecodeThread",
+                     lz4_decode_thread, (VOID *)&workers[i],
+                     UEFI_THREAD_PRIORITY, DEFAULT_STACK_SIZE);
+    if (threads[i] == NULL)
+      break;
+
+    AllocateUnSafeStackPtr (threads[i]);
+
+    if (KernIntf->Thread->ThreadResume (threads[i]) != 0) {
+      ThreadStackNodeRemove (threads[i]);
+      threads[i] = NULL;
+      break;
+    }
+  }
+
+  /* blocks of workers that could not be started are decoded here */
+  if (i < nthreads)
+    DEBUG ((EFI_D_VERBOSE, "lz4: only %u of %u threads started\n", i,
+            nthreads));
+  for (; i < nthreads; i++)
+    lz4_decode_blocks (&workers[i]);
+
+  lz4_decode_blocks (&workers[0]);
+
+  for (i = 1; i < nthreads; i++) {
+    if (threads[i])
+      KernIntf->Thread->ThreadJoin (threads[i], &ret_code, INFINITE_TIME);
+  }
+}
+
+/* decompress LZ4 legacy file "in_buf", return 0 if decompressed successful,
+ * return -1 if decompressed failed. The arguments are the same as for
+ * decompress(), pos points past the last block and the optional size
+ * trailer that the kernel build appends.
+ */
+int
+lz4_decompress (unsigned char *in_buf,
+                unsigned int in_len,
+                unsigned char *out_buf,
+                unsigned int out_buf_len,
+                unsigned int *pos,
+                unsigned int *out_len)
+{
+  lz4_block *blocks = NULL;
+  unsigned int count = 0;
+  unsigned int max_blocks;
+  unsigned int offset;
+  unsigned int size;
+  unsigned int total = 0;
+  unsigned int i;
+  int rc = -1;
+
+  if (!is_lz4_package (in_buf, in_len)) {
+    DEBUG ((EFI_D_ERROR, "the input data is not a lz4 package.\n"));
+    return rc;
+  }
+
+  max_blocks = out_buf_len / LZ4_LEGACY_BLOCK_SIZE + 1;
+  blocks = AllocateZeroPool (max_blocks * sizeof (*blocks));
+  if (blocks == NULL) {
+    DEBUG ((EFI_D_ERROR, "allocating lz4 blocks failed.\n"));
+    return rc;
+  }
+
+  /* Collect every block header up front so the blocks can be decoded
+   * independently. Scanning stops at the first size that can not be a
+   * block, which is the appended DTB or the decompressed size trailer.
+   */
+  offset = sizeof (UINT32);
+  while (count < max_blocks && in_len - offset >= sizeof (UINT32)) {
+    size = get_le32 (in_buf + offset);
+    if (size == LZ4_LEGACY_MAGIC) {
+      offset += sizeof (UINT32);
+      continue;
+    }
+    if (size == 0 ||
+        size > LZ4_COMPRESS_BOUND (LZ4_LEGACY_BLOCK_SIZE) ||
+        size > in_len - offset - sizeof (UINT32))
+      break;
+
+    blocks[count].src = in_buf + offset + sizeof (UINT32);
+    blocks[count].src_len = size;
+    blocks[count].dst = out_buf + count * LZ4_LEGACY_BLOCK_SIZE;
+    blocks[count].dst_cap = MIN (out_buf_len - count * LZ4_LEGACY_BLOCK_SIZE,
+                                 LZ4_LEGACY_BLOCK_SIZE);
+    offset += sizeof (UINT32) + size;
+    count++;
+  }
+
+  if (count == 0) {
+    DEBUG ((EFI_D_ERROR, "no lz4 block found\n"));
+    goto lz4_end;
+  }
+
+  lz4_decode_parallel (blocks, count);
+
+  /* Only the last block may be short. A header equal to the bytes
+   * decompressed so far is the size trailer, not another block.
+   */
+  offset = sizeof (UINT32);
+  for (i = 0; i < count; i++) {
+    if (i > 0 && blocks[i].src_len == total)
+      break;
+    if (blocks[i].out_len < 0) {
+      DEBUG ((EFI_D_ERROR, "Error in decompression: lz4 block %u is corrupt or too big\n",
+              i));
+      goto lz4_end;
+    }
+    total += blocks[i].out_len;
+    offset = blocks[i].src + blocks[i].src_len - in_buf;
+    if (blocks[i].out_len != LZ4_LEGACY_BLOCK_SIZE) {
+      i++;
+      break;
+    }
+  }
+
+  if (in_len - offset >= sizeof (UINT32)) {
+    size = get_le32 (in_buf + offset);
+    if (size == total) {
+      offset += sizeof (UINT32);
+    } else if (i == count && count == max_blocks &&
+               size <= LZ4_COMPRESS_BOUND (LZ4_LEGACY_BLOCK_SIZE)) {
+      DEBUG ((EFI_D_ERROR, "Error in decompression: Output buffer full\n"));
+      goto lz4_end;
+    }
+  }
+
+  if (pos)
+    *pos = offset;
+
+  if (out_len)
+    *out_len = total;
+
+  rc = 0;
+
+lz4_end:
+  FreePool (blocks);
+  blocks = NULL;
+  return rc; /* returns 0 if decompressed successful */
+}
+
+/* check if the input "buf" file was a LZ4 legacy package.
+ * Return true if the input "buf" is a LZ4 legacy package.
+ */
+int
+is_lz4_package (unsigned char *buf, unsigned int len)
+{
+  if (len < 8 || !buf || get_le32 (buf) != LZ4_LEGACY_MAGIC) {
+    return false;
+  }
+
+  return true;
+}
+
 /* check if the input "buf" file was a gzip package.
  * Return true if the input "buf" is a gzip package.
  */
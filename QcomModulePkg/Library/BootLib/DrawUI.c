@@ -32,6 +32,7 @@
 #include <Library/DrawUI.h>
 #include <Library/Fonts.h>
 #include <Library/MemoryAllocationLib.h>
+#include <Library/ThreadStack.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/UpdateDeviceTree.h>
 #include <Protocol/GraphicsOutput.h>
@@ -41,6 +42,38 @@
 STATIC EFI_GRAPHICS_OUTPUT_PROTOCOL *GraphicsOutputProtocol;
 STATIC EFI_GRAPHICS_OUTPUT_BLT_PIXEL *LogoBlt;
 STATIC EFI_HII_FONT_PROTOCOL  *gHiiFont = NULL;
+STATIC EFI_KERNEL_PROTOCOL *KernIntf = NULL;
+
+/* The boot logo is read back from the framebuffer on a worker thread
+ * while the images are loaded, see StartBootLogoBackUp.
+ */
+STATIC Thread *LogoBackUpThread;
+STATIC EFI_STATUS LogoBackUpStatus;
+
+/* Rows of the backed up logo that are not blank, and rows drawn over
+ * since then. Only these have to be written back on restore.
+ */
+STATIC UINT32 LogoTop;
+STATIC UINT32 LogoBottom;
+STATIC UINT32 DirtyTop;
+STATIC UINT32 DirtyBottom;
+
+/* Option lines are drawn again with another background on every key
+ * press, keep the rendered rows instead of going through HII again.
+ */
+#define MENU_LINE_CACHE_SIZE 16
+
+typedef struct {
+  CHAR8 Msg[MAX_MSG_SIZE];
+  UINT32 ScaleFactorType;
+  UINT32 FgColor;
+  UINT32 BgColor;
+  UINT32 Height;
+  EFI_GRAPHICS_OUTPUT_BLT_PIXEL *Bitmap;
+} MENU_LINE_CACHE;
+
+STATIC MENU_LINE_CACHE mLineCache[MENU_LINE_CACHE_SIZE];
+STATIC UINT32 mLineCacheNext;
 
 STATIC CHAR16 *mFactorName[] = {
         [1] = (CHAR16 *)L"",        [2] = (CHAR16 *)SYSFONT_2x,
@@ -126,24 +159,42 @@ STATIC UINT32 GetResolutionHeight (VOID)
   return Height;
 }
 
-EFI_STATUS BackUpBootLogoBltBuffer (VOID)
+STATIC BOOLEAN
+IsBlankRow (EFI_GRAPHICS_OUTPUT_BLT_PIXEL *Row, UINT32 Width)
 {
-  EFI_STATUS Status;
-  UINT32 Width;
-  UINT32 Height;
-  UINT64 BufferSize;
+  UINT32 Idx;
 
-  /* Return directly if it's already backed up the boot logo blt buffer */
-  if (LogoBlt)
-    return EFI_SUCCESS;
+  for (Idx = 0; Idx < Width; Idx++) {
+    if (Row[Idx].Blue || Row[Idx].Green || Row[Idx].Red) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
 
-  Width = GetResolutionWidth ();
-  Height = GetResolutionHeight ();
-  if (!Width || !Height) {
-    DEBUG ((EFI_D_ERROR, "Failed to get width or height\n"));
-    return EFI_UNSUPPORTED;
+STATIC VOID
+MarkRowsDirty (UINT32 Top, UINT32 Rows)
+{
+  if (!Rows) {
+    return;
   }
 
+  if (DirtyBottom == DirtyTop) {
+    DirtyTop = Top;
+    DirtyBottom = Top + Rows;
+    return;
+  }
+
+  DirtyTop = MIN (DirtyTop, Top);
+  DirtyBottom = MAX (DirtyBottom, Top + Rows);
+}
+
+STATIC EFI_STATUS
+SaveBootLogo (UINT32 Width, UINT32 Height)
+{
+  EFI_STATUS Status;
+  UINT64 BufferSize;
+
   /* Ensure the Height * Width doesn't overflow */
   if (Height > DivU64x64Remainder ((UINTN)~0, Width, NULL)) {
     DEBUG ((EFI_D_ERROR, "Height * Width overflow\n"));
@@ -173,9 +224,129 @@ EFI_STATUS BackUpBootLogoBltBuffer (VOID)
   if (Status != EFI_SUCCESS) {
     FreePool (LogoBlt);
     LogoBlt = NULL;
+    return Status;
   }
 
-  return Status;
+  /* The splash is usually a small image on a black screen, the blank
+   * rows around it look the same once the screen has been cleared.
+   */
+  LogoTop = 0;
+  LogoBottom = Height;
+  while (LogoTop < LogoBottom &&
+         IsBlankRow (&LogoBlt[(UINTN)LogoTop * Width], Width)) {
+    LogoTop++;
+  }
+  while (LogoBottom > LogoTop &&
+         IsBlankRow (&LogoBlt[(UINTN)(LogoBottom - 1) * Width], Width)) {
+    LogoBottom--;
+  }
+
+  DirtyTop = 0;
+  DirtyBottom = 0;
+
+  return EFI_SUCCESS;
+}
+
+STATIC INT32 __attribute__ ( (no_sanitize ("safe-stack")))
+BackUpBootLogoThread (VOID *Arg)
+{
+  Thread *CurrentThread = KernIntf->Thread->GetCurrentThread ();
+
+  LogoBackUpStatus = SaveBootLogo (GetResolutionWidth (),
+                                   GetResolutionHeight ());
+
+  ThreadStackNodeRemove (CurrentThread);
+  KernIntf->Thread->ThreadExit (0);
+
+  return 0;
+}
+
+/* Wait for a backup started by StartBootLogoBackUp, the framebuffer and
+ * LogoBlt must not be touched before it is done.
+ */
+STATIC VOID
+WaitForBootLogoBackUp (VOID)
+{
+  INT32 RetCode;
+
+  if (LogoBackUpThread == NULL) {
+    return;
+  }
+
+  KernIntf->Thread->ThreadJoin (LogoBackUpThread, &RetCode, INFINITE_TIME);
+  LogoBackUpThread = NULL;
+
+  if (LogoBackUpStatus != EFI_SUCCESS) {
+    DEBUG ((EFI_D_VERBOSE, "Boot logo backup on thread failed: %r\n",
+            LogoBackUpStatus));
+  }
+}
+
+/* Start reading the boot logo back on a worker thread, so that it does
+ * not delay loading and verifying the images. Nothing else may draw to
+ * the screen until one of the DrawUI functions has been called. Falls
+ * back to a synchronous backup in DrawMenuInit if no thread is started.
+ */
+VOID StartBootLogoBackUp (VOID)
+{
+  EFI_STATUS Status;
+
+  if (LogoBlt ||
+      LogoBackUpThread) {
+    return;
+  }
+
+  /* Look up the graphics output protocol here, not on the thread */
+  if (!GetResolutionWidth () ||
+      !GetResolutionHeight ()) {
+    return;
+  }
+
+  if (KernIntf == NULL) {
+    Status = gBS->LocateProtocol (&gEfiKernelProtocolGuid, NULL,
+                                  (VOID **)&KernIntf);
+    if (Status != EFI_SUCCESS ||
+        KernIntf == NULL ||
+        KernIntf->Version < EFI_KERNEL_PROTOCOL_VER_UNSAFE_STACK_APIS) {
+      KernIntf = NULL;
+      return;
+    }
+  }
+
+  LogoBackUpThread = KernIntf->Thread->ThreadCreate ("BootLogoBackUp",
+                         BackUpBootLogoThread, NULL, UEFI_THREAD_PRIORITY,
+                         DEFAULT_STACK_SIZE);
+  if (LogoBackUpThread == NULL) {
+    return;
+  }
+
+  AllocateUnSafeStackPtr (LogoBackUpThread);
+
+  if (KernIntf->Thread->ThreadResume (LogoBackUpThread) != 0) {
+    ThreadStackNodeRemove (LogoBackUpThread);
+    LogoBackUpThread = NULL;
+  }
+}
+
+EFI_STATUS BackUpBootLogoBltBuffer (VOID)
+{
+  UINT32 Width;
+  UINT32 Height;
+
+  WaitForBootLogoBackUp ();
+
+  /* Return directly if it's already backed up the boot logo blt buffer */
+  if (LogoBlt)
+    return EFI_SUCCESS;
+
+  Width = GetResolutionWidth ();
+  Height = GetResolutionHeight ();
+  if (!Width || !Height) {
+    DEBUG ((EFI_D_ERROR, "Failed to get width or height\n"));
+    return EFI_UNSUPPORTED;
+  }
+
+  return SaveBootLogo (Width, Height);
 }
 
 // This function would restore the boot logo if the display on the screen is
@@ -185,6 +356,10 @@ VOID RestoreBootLogoBitBuffer (VOID)
   EFI_STATUS Status;
   UINT32 Width;
   UINT32 Height;
+  UINT32 Top;
+  UINT32 Bottom;
+
+  WaitForBootLogoBackUp ();
 
   /* Return directly if the boot logo bit buffer is null */
   if (!LogoBlt) {
@@ -204,22 +379,57 @@ VOID RestoreBootLogoBitBuffer (VOID)
     return;
   }
 
+  /* The logo rows may have been cleared, the menu rows drawn over.
+   * Everything else is blank both on the screen and in the logo.
+   */
+  Top = LogoTop;
+  Bottom = LogoBottom;
+  if (DirtyBottom > DirtyTop) {
+    Top = (Bottom > Top) ? MIN (Top, DirtyTop) : DirtyTop;
+    Bottom = MAX (Bottom, DirtyBottom);
+  }
+  Bottom = MIN (Bottom, Height);
+  if (Bottom <= Top) {
+    return;
+  }
+
   Status = GraphicsOutputProtocol->Blt (
-      GraphicsOutputProtocol, LogoBlt, EfiBltBufferToVideo, 0, 0, 0, 0, Width,
-      Height, Width * sizeof (EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+      GraphicsOutputProtocol, LogoBlt, EfiBltBufferToVideo, 0, Top, 0, Top,
+      Width, Bottom - Top, Width * sizeof (EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
 
   if (Status != EFI_SUCCESS) {
     FreePool (LogoBlt);
     LogoBlt = NULL;
+    return;
+  }
+
+  DirtyTop = 0;
+  DirtyBottom = 0;
+}
+
+STATIC VOID
+FreeMenuLineCache (VOID)
+{
+  UINT32 Idx;
+
+  for (Idx = 0; Idx < MENU_LINE_CACHE_SIZE; Idx++) {
+    if (mLineCache[Idx].Bitmap) {
+      FreePool (mLineCache[Idx].Bitmap);
+    }
   }
+  SetMem (mLineCache, sizeof (mLineCache), 0);
+  mLineCacheNext = 0;
 }
 
 VOID FreeBootLogoBltBuffer (VOID)
 {
+  WaitForBootLogoBackUp ();
+
   if (LogoBlt) {
     FreePool (LogoBlt);
     LogoBlt = NULL;
   }
+  FreeMenuLineCache ();
 }
 
 STATIC UINT32 GetDisplayMode  (VOID)
@@ -231,51 +441,68 @@ STATIC UINT32 GetDisplayMode  (VOID)
   return HORIZONTAL_MODE;
 }
 
-/* Get max row */
-STATIC UINT32 GetMaxRow (VOID)
+/* Size of the base glyph, queried once since every menu line needs it */
+STATIC VOID
+GetFontBaseSize (UINT32 *FontBaseWidth, UINT32 *FontBaseHeight)
 {
+  STATIC UINT32 BaseWidth;
+  STATIC UINT32 BaseHeight;
   EFI_STATUS Status;
-  UINT32 FontBaseHeight = EFI_GLYPH_HEIGHT;
-  UINT32 MaxRow = 0;
   EFI_IMAGE_OUTPUT *Blt = NULL;
 
-  Status = gBS->LocateProtocol (&gEfiHiiFontProtocolGuid, NULL,
-                               (VOID **) &gHiiFont);
-  if (EFI_ERROR (Status)) {
-    return MaxRow;
-  }
+  if (!BaseWidth) {
+    Status = gBS->LocateProtocol (&gEfiHiiFontProtocolGuid, NULL,
+                                 (VOID **) &gHiiFont);
+    if (EFI_ERROR (Status)) {
+      *FontBaseWidth = 0;
+      *FontBaseHeight = 0;
+      return;
+    }
 
-  Status = gHiiFont->GetGlyph (gHiiFont, 'a', NULL, &Blt, NULL);
-  if (!EFI_ERROR (Status)) {
+    BaseWidth = EFI_GLYPH_WIDTH;
+    BaseHeight = EFI_GLYPH_HEIGHT;
+    Status = gHiiFont->GetGlyph (gHiiFont, 'a', NULL, &Blt, NULL);
+    if (!EFI_ERROR (Status) &&
+        Blt) {
+      BaseWidth = Blt->Width;
+      BaseHeight = Blt->Height;
+    }
     if (Blt) {
-      FontBaseHeight = Blt->Height;
+      if (Blt->Image.Bitmap) {
+        FreePool (Blt->Image.Bitmap);
+      }
+      FreePool (Blt);
     }
   }
-  MaxRow = GetResolutionHeight() / FontBaseHeight;
-  return MaxRow;
+
+  *FontBaseWidth = BaseWidth;
+  *FontBaseHeight = BaseHeight;
 }
 
-/* Get Max font count per row */
-STATIC UINT32 GetMaxFontCount (VOID)
+/* Get max row */
+STATIC UINT32 GetMaxRow (VOID)
 {
-  EFI_STATUS Status;
-  UINT32 FontBaseWidth = EFI_GLYPH_WIDTH;
-  UINT32 max_count = 0;
-  EFI_IMAGE_OUTPUT *Blt = NULL;
+  UINT32 FontBaseWidth;
+  UINT32 FontBaseHeight;
 
-  Status = gBS->LocateProtocol (&gEfiHiiFontProtocolGuid, NULL,
-                               (VOID **) &gHiiFont);
-  if (EFI_ERROR (Status)) {
-    return max_count;
+  GetFontBaseSize (&FontBaseWidth, &FontBaseHeight);
+  if (!FontBaseHeight) {
+    return 0;
   }
+  return GetResolutionHeight () / FontBaseHeight;
+}
 
-  Status = gHiiFont->GetGlyph (gHiiFont, 'a', NULL, &Blt, NULL);
-  if (!EFI_ERROR (Status)) {
-    if (Blt)
-      FontBaseWidth = Blt->Width;
+/* Get Max font count per row */
+STATIC UINT32 GetMaxFontCount (VOID)
+{
+  UINT32 FontBaseWidth;
+  UINT32 FontBaseHeight;
+
+  GetFontBaseSize (&FontBaseWidth, &FontBaseHeight);
+  if (!FontBaseWidth) {
+    return 0;
   }
-  max_count = GetResolutionWidth () / FontBaseWidth;
-  return max_count;
+  return GetResolutionWidth () / FontBaseWidth;
 }
 
 /**
@@ -287,12 +514,18 @@ STATIC UINT32 GetMaxFontCount (VOID)
 STATIC UINT32
 GetFontScaleFactor (UINT32 ScaleFactorType)
 {
+  STATIC UINT32 CachedScaleFactor;
   UINT32 NumPerRow = 0;
   UINT32 ScaleFactor = 0;
   UINT32 ScaleFactor1 = 0;
   UINT32 ScaleFactor2 = 0;
   UINT32 MaxRow = 0;
 
+  /* The resolution doesn't change, neither does the base factor */
+  if (CachedScaleFactor) {
+    return CachedScaleFactor * ScaleFactorType;
+  }
+
   NumPerRow = CHAR_NUM_PERROW_POR;
   MaxRow = MAX_ROW_FOR_POR;
   if (GetDisplayMode () ==  HORIZONTAL_MODE) {
@@ -309,6 +542,11 @@ GetFontScaleFactor (UINT32 ScaleFactorType)
     ScaleFactor = (ARRAY_SIZE (mFactorName) - 1) / MAX_FACTORTYPE;
   }
 
+  if (ScaleFactor1 &&
+      ScaleFactor2) {
+    CachedScaleFactor = ScaleFactor;
+  }
+
   return ScaleFactor * ScaleFactorType;
 }
 
@@ -437,6 +675,58 @@ ManipulateMenuMsg (MENU_MSG_INFO *TargetMenu)
   }
 }
 
+STATIC MENU_LINE_CACHE *
+FindMenuLine (MENU_MSG_INFO *TargetMenu)
+{
+  UINT32 Idx;
+
+  for (Idx = 0; Idx < MENU_LINE_CACHE_SIZE; Idx++) {
+    if (mLineCache[Idx].Bitmap &&
+        mLineCache[Idx].ScaleFactorType == TargetMenu->ScaleFactorType &&
+        mLineCache[Idx].FgColor == TargetMenu->FgColor &&
+        mLineCache[Idx].BgColor == TargetMenu->BgColor &&
+        !AsciiStrCmp (mLineCache[Idx].Msg, TargetMenu->Msg)) {
+      return &mLineCache[Idx];
+    }
+  }
+  return NULL;
+}
+
+/* Reads the rows just drawn by HII back from the screen */
+STATIC VOID
+CacheMenuLine (MENU_MSG_INFO *TargetMenu, UINT32 Width, UINT32 Height)
+{
+  MENU_LINE_CACHE *Line = &mLineCache[mLineCacheNext];
+  EFI_GRAPHICS_OUTPUT_BLT_PIXEL *Bitmap;
+  EFI_STATUS Status;
+
+  Bitmap = AllocatePool ((UINTN)Width * Height *
+                         sizeof (EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+  if (Bitmap == NULL) {
+    return;
+  }
+
+  Status = GraphicsOutputProtocol->Blt (
+      GraphicsOutputProtocol, Bitmap, EfiBltVideoToBltBuffer, 0,
+      TargetMenu->Location, 0, 0, Width, Height,
+      Width * sizeof (EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+  if (Status != EFI_SUCCESS) {
+    FreePool (Bitmap);
+    return;
+  }
+
+  if (Line->Bitmap) {
+    FreePool (Line->Bitmap);
+  }
+  AsciiStrCpyS (Line->Msg, sizeof (Line->Msg), TargetMenu->Msg);
+  Line->ScaleFactorType = TargetMenu->ScaleFactorType;
+  Line->FgColor = TargetMenu->FgColor;
+  Line->BgColor = TargetMenu->BgColor;
+  Line->Height = Height;
+  Line->Bitmap = Bitmap;
+  mLineCacheNext = (mLineCacheNext + 1) % MENU_LINE_CACHE_SIZE;
+}
+
 /**
   Draw menu on the screen
   @param[in] TargetMenu    The message info.
@@ -455,6 +745,8 @@ DrawMenu (MENU_MSG_INFO *TargetMenu, UINT32 *pHeight)
   CHAR16 FontMessage[MAX_MSG_SIZE];
   UINT32 Height = GetResolutionHeight ();
   UINT32 Width = GetResolutionWidth ();
+  UINT32 DrawnHeight = 0;
+  MENU_LINE_CACHE *CachedLine;
 
   if (!Height || !Width) {
     Status = EFI_OUT_OF_RESOURCES;
@@ -469,6 +761,29 @@ DrawMenu (MENU_MSG_INFO *TargetMenu, UINT32 *pHeight)
     goto Exit;
   }
 
+  WaitForBootLogoBackUp ();
+
+  ManipulateMenuMsg (TargetMenu);
+
+  /* Only the rows of this line change, blt them from the cache */
+  if (TargetMenu->Attribute == OPTION_ITEM) {
+    CachedLine = FindMenuLine (TargetMenu);
+    if (CachedLine &&
+        CachedLine->Height <= Height - TargetMenu->Location) {
+      Status = GraphicsOutputProtocol->Blt (
+          GraphicsOutputProtocol, CachedLine->Bitmap, EfiBltBufferToVideo, 0,
+          0, 0, TargetMenu->Location, Width, CachedLine->Height,
+          Width * sizeof (EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+      if (Status == EFI_SUCCESS) {
+        MarkRowsDirty (TargetMenu->Location, CachedLine->Height);
+        if (pHeight) {
+          *pHeight = CachedLine->Height;
+        }
+        goto Exit;
+      }
+    }
+  }
+
   BltBuffer = AllocateZeroPool (sizeof (EFI_IMAGE_OUTPUT));
   if (BltBuffer == NULL) {
     DEBUG ((EFI_D_ERROR, "Failed to allocate zero pool for BltBuffer.\n"));
@@ -486,7 +801,6 @@ DrawMenu (MENU_MSG_INFO *TargetMenu, UINT32 *pHeight)
   }
   SetDisplayInfo (TargetMenu, FontDisplayInfo);
 
-  ManipulateMenuMsg (TargetMenu);
   AsciiStrToUnicodeStr (TargetMenu->Msg, FontMessage);
 
   Status = gBS->LocateProtocol (&gEfiHiiFontProtocolGuid, NULL,
@@ -508,19 +822,25 @@ DrawMenu (MENU_MSG_INFO *TargetMenu, UINT32 *pHeight)
     goto Exit;
   }
 
-  if (pHeight && RowInfoArraySize && RowInfoArray) {
-    *pHeight = RowInfoArraySize * RowInfoArray[0].LineHeight;
+  if (RowInfoArraySize && RowInfoArray) {
+    DrawnHeight = RowInfoArraySize * RowInfoArray[0].LineHeight;
+    if (pHeight) {
+      *pHeight = DrawnHeight;
+    }
+    if (DrawnHeight > Height - TargetMenu->Location) {
+      DrawnHeight = Height - TargetMenu->Location;
+    }
   }
 
-  /* For Bitmap mode, use EfiBltBufferToVideo, and set DestX,DestY as needed */
-  GraphicsOutputProtocol->Blt (GraphicsOutputProtocol, BltBuffer->Image.Bitmap,
-                               EfiBltVideoToVideo, 0, /* SrcX */
-                               0,                     /* SrcY */
-                               0,                     /* DestX */
-                               0,                     /* DestY */
-                               BltBuffer->Width, BltBuffer->Height,
-                               BltBuffer->Width *
-                                   sizeof (EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+  /* Without the row info the drawn height is unknown */
+  MarkRowsDirty (TargetMenu->Location, DrawnHeight ? DrawnHeight :
+                 Height - TargetMenu->Location);
+
+  /* HII already drew to the screen, nothing left to blt */
+  if (DrawnHeight &&
+      TargetMenu->Attribute == OPTION_ITEM) {
+    CacheMenuLine (TargetMenu, Width, DrawnHeight);
+  }
 
 Exit:
   if (RowInfoArray) {
@@ -610,6 +930,9 @@ VOID DrawMenuInit (VOID)
     DEBUG ((EFI_D_VERBOSE, "Backup the boot logo blt buffer failed: %r\n",
             Status));
 
+  /* Lines of the previous menu are not going to be drawn again */
+  FreeMenuLineCache ();
+
   /* Clear the screen before start drawing menu */
   gST->ConOut->ClearScreen (gST->ConOut);
 }
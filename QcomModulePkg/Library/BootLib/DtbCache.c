@@ -0,0 +1,332 @@
+/* Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * * Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <Library/DebugLib.h>
+#include <Library/DeviceInfo.h>
+#include <Library/DtbCache.h>
+#include <Library/HypervisorMvCalls.h>
+#include <Library/MemoryAllocationLib.h>
+#include "libfdt.h"
+
+STATIC DtbCacheKey mDtbCacheKey;
+STATIC BOOLEAN mDtbCacheKeyValid;
+
+STATIC EFI_STATUS
+GetDtbCachePartition (EFI_BLOCK_IO_PROTOCOL **BlockIo, EFI_HANDLE **Handle)
+{
+  EFI_STATUS Status;
+  UINT32 BlkIOAttrib = 0;
+  PartiSelectFilter HandleFilter;
+  UINT32 MaxHandles = 1;
+  HandleInfo HandleInfoList[1];
+  CHAR16 PtnName[MAX_GPT_NAME_SIZE] = DTB_CACHE_PARTITION;
+
+  BlkIOAttrib |= BLK_IO_SEL_PARTITIONED_MBR;
+  BlkIOAttrib |= BLK_IO_SEL_PARTITIONED_GPT;
+  BlkIOAttrib |= BLK_IO_SEL_MEDIA_TYPE_NON_REMOVABLE;
+  BlkIOAttrib |= BLK_IO_SEL_MATCH_PARTITION_LABEL;
+
+  HandleFilter.RootDeviceType = NULL;
+  HandleFilter.VolumeName = NULL;
+  HandleFilter.PartitionLabel = PtnName;
+
+  Status =
+     GetBlkIOHandles (BlkIOAttrib, &HandleFilter, HandleInfoList, &MaxHandles);
+  if (Status != EFI_SUCCESS ||
+      MaxHandles != 1) {
+    return EFI_NOT_FOUND;
+  }
+
+  *BlockIo = HandleInfoList[0].BlkIo;
+  *Handle = HandleInfoList[0].Handle;
+  if ((*BlockIo)->Media->BlockSize < sizeof (DtbCacheHdr)) {
+    return EFI_UNSUPPORTED;
+  }
+  return EFI_SUCCESS;
+}
+
+/* Nothing read back from a writable partition is trusted on a locked
+ * device, its DTB always comes from the verified images. An unlocked one
+ * already boots whatever was flashed, the cache only has to notice that
+ * the images changed, so it is keyed on CRCs of the loaded DTB table and
+ * dtbo rather than on vbmeta digests, which do not bind them when
+ * verification errors are allowed.
+ */
+STATIC EFI_STATUS
+GetDtbCacheKey (BootInfo *Info,
+                BootParamlist *BootParamlistPtr,
+                CONST VOID *DtbImg,
+                UINT32 DtbImgSize,
+                DtbCacheKey *Key)
+{
+  EFI_STATUS Status;
+  struct DtboTableHdr *DtboTableHdr;
+  VOID *DtboImg = NULL;
+  UINTN DtboImgSize = 0;
+  UINT32 Idx;
+
+  /* Hypervisor and override dtbos are not part of the key */
+  if (!IsUnlocked () ||
+      IsVmEnabled () ||
+      !TargetBuildVariantUser ()) {
+    return EFI_UNSUPPORTED;
+  }
+
+  /* The recovery dtbo inside a boot image is not covered either */
+  Status = GetImage (Info, &DtboImg, &DtboImgSize, "dtbo");
+  if (Status != EFI_SUCCESS ||
+      DtboImg != BootParamlistPtr->DtboImgBuffer) {
+    return EFI_UNSUPPORTED;
+  }
+
+  DtboTableHdr = DtboImg;
+  if (fdt32_to_cpu (DtboTableHdr->TotalSize) > DtboImgSize) {
+    return EFI_BAD_BUFFER_SIZE;
+  }
+
+  SetMem (Key, sizeof (*Key), 0);
+
+  Key->DtbImgSize = DtbImgSize;
+  gBS->CalculateCrc32 ((VOID *)DtbImg, DtbImgSize, &Key->DtbImgCrc);
+  Key->DtboImgSize = fdt32_to_cpu (DtboTableHdr->TotalSize);
+  gBS->CalculateCrc32 (DtboImg, Key->DtboImgSize, &Key->DtboImgCrc);
+
+  Key->ChipId = BoardPlatformRawChipId ();
+  Key->ChipVersion = BoardPlatformChipVersion ();
+  Key->FoundryId = BoardPlatformFoundryId ();
+  Key->PlatformType = BoardPlatformType ();
+  Key->PlatformVersion = BoardPlatformVersion ();
+  Key->PlatformSubType = BoardPlatformSubType ();
+  Key->PlatformHlosSubType = BoardPlatformHlosSubType ();
+  Key->TargetId = BoardTargetId ();
+  for (Idx = 0; Idx < PMIC_IDX4; Idx++) {
+    Key->PmicTarget[Idx] = BoardPmicTarget (Idx);
+  }
+  Key->BootIntoRecovery = Info->BootIntoRecovery;
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+DtbCacheLoad (BootInfo *Info,
+              BootParamlist *BootParamlistPtr,
+              CONST VOID *DtbImg,
+              UINT32 DtbImgSize)
+{
+  EFI_STATUS Status;
+  EFI_BLOCK_IO_PROTOCOL *BlockIo = NULL;
+  EFI_HANDLE *Handle = NULL;
+  DtbCacheHdr *Hdr = NULL;
+  VOID *Dtb = NULL;
+  UINT32 BlockSize;
+  UINT64 ReadSize;
+  UINT64 PartitionSize;
+  UINT32 Crc = 0;
+
+  mDtbCacheKeyValid = FALSE;
+
+  if (Info == NULL ||
+      BootParamlistPtr == NULL ||
+      DtbImg == NULL) {
+    DEBUG ((EFI_D_ERROR, "DtbCacheLoad: Invalid input parameters\n"));
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Status = GetDtbCacheKey (Info, BootParamlistPtr, DtbImg, DtbImgSize,
+                           &mDtbCacheKey);
+  if (Status != EFI_SUCCESS) {
+    DEBUG ((EFI_D_VERBOSE, "DtbCache: Not used for this boot: %r\n", Status));
+    return Status;
+  }
+
+  Status = GetDtbCachePartition (&BlockIo, &Handle);
+  if (Status != EFI_SUCCESS) {
+    return Status;
+  }
+  mDtbCacheKeyValid = TRUE;
+
+  BlockSize = BlockIo->Media->BlockSize;
+  PartitionSize = GetPartitionSize (BlockIo);
+
+  Hdr = AllocateZeroPool (BlockSize);
+  if (Hdr == NULL) {
+    DEBUG ((EFI_D_ERROR, "DtbCache: Failed to allocate header\n"));
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = BlockIo->ReadBlocks (BlockIo, BlockIo->Media->MediaId, 0,
+                                BlockSize, Hdr);
+  if (Status != EFI_SUCCESS) {
+    DEBUG ((EFI_D_ERROR, "DtbCache: Failed to read header: %r\n", Status));
+    goto out;
+  }
+
+  if (CompareMem (Hdr->Magic, DTB_CACHE_MAGIC, DTB_CACHE_MAGIC_SIZE) ||
+      Hdr->Version != DTB_CACHE_VERSION ||
+      CompareMem (&Hdr->Key, &mDtbCacheKey, sizeof (mDtbCacheKey))) {
+    DEBUG ((EFI_D_INFO, "DtbCache: Miss\n"));
+    Status = EFI_NOT_FOUND;
+    goto out;
+  }
+
+  ReadSize = ALIGN_VALUE ((UINT64)Hdr->DtbSize, BlockSize);
+  if (Hdr->DtbSize < sizeof (struct fdt_header) ||
+      ReadSize + BlockSize > PartitionSize ||
+      Hdr->DtbSize > (BootParamlistPtr->RamdiskLoadAddr -
+                      BootParamlistPtr->DeviceTreeLoadAddr)) {
+    DEBUG ((EFI_D_ERROR, "DtbCache: Invalid size %u\n", Hdr->DtbSize));
+    Status = EFI_BAD_BUFFER_SIZE;
+    goto out;
+  }
+
+  /* Only a checked blob may land at DeviceTreeLoadAddr */
+  Dtb = AllocatePool (ReadSize);
+  if (Dtb == NULL) {
+    DEBUG ((EFI_D_ERROR, "DtbCache: Failed to allocate DTB buffer\n"));
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out;
+  }
+
+  Status = BlockIo->ReadBlocks (BlockIo, BlockIo->Media->MediaId, 1,
+                                ReadSize, Dtb);
+  if (Status != EFI_SUCCESS) {
+    DEBUG ((EFI_D_ERROR, "DtbCache: Failed to read DTB: %r\n", Status));
+    goto out;
+  }
+
+  gBS->CalculateCrc32 (Dtb, Hdr->DtbSize, &Crc);
+  if (Crc != Hdr->DtbCrc ||
+      fdt_check_header (Dtb) ||
+      fdt_totalsize (Dtb) != Hdr->DtbSize) {
+    DEBUG ((EFI_D_ERROR, "DtbCache: Corrupted DTB\n"));
+    Status = EFI_CRC_ERROR;
+    goto out;
+  }
+
+  gBS->CopyMem ((VOID *)BootParamlistPtr->DeviceTreeLoadAddr, Dtb,
+                Hdr->DtbSize);
+  /* The dtb/dtbo indices and the RTIC notification of the skipped
+   * selection are still needed for this boot.
+   */
+  RestoreDtbSelection ((VOID *)DtbImg, DtbImgSize, &Hdr->Selection);
+  /* Nothing to store again */
+  mDtbCacheKeyValid = FALSE;
+  DEBUG ((EFI_D_INFO, "DtbCache: Hit, %u bytes\n", Hdr->DtbSize));
+
+out:
+  if (Dtb != NULL) {
+    FreePool (Dtb);
+  }
+  FreePool (Hdr);
+  return Status;
+}
+
+VOID
+DtbCacheStore (BootParamlist *BootParamlistPtr)
+{
+  EFI_STATUS Status;
+  EFI_BLOCK_IO_PROTOCOL *BlockIo = NULL;
+  EFI_HANDLE *Handle = NULL;
+  DtbCacheHdr *Hdr = NULL;
+  VOID *Dtb = NULL;
+  UINT32 DtbSize;
+  UINT32 BlockSize;
+  UINT64 WriteSize;
+
+  if (!mDtbCacheKeyValid ||
+      BootParamlistPtr == NULL) {
+    return;
+  }
+  mDtbCacheKeyValid = FALSE;
+
+  Dtb = (VOID *)BootParamlistPtr->DeviceTreeLoadAddr;
+  if (fdt_check_header (Dtb)) {
+    return;
+  }
+  DtbSize = fdt_totalsize (Dtb);
+
+  Status = GetDtbCachePartition (&BlockIo, &Handle);
+  if (Status != EFI_SUCCESS) {
+    return;
+  }
+
+  BlockSize = BlockIo->Media->BlockSize;
+  WriteSize = BlockSize + ALIGN_VALUE ((UINT64)DtbSize, BlockSize);
+  if (WriteSize > GetPartitionSize (BlockIo)) {
+    DEBUG ((EFI_D_INFO, "DtbCache: DTB of %u bytes does not fit\n", DtbSize));
+    return;
+  }
+
+  /* Header and DTB go out in one write, the CRC catches a torn one */
+  Hdr = AllocateZeroPool (WriteSize);
+  if (Hdr == NULL) {
+    DEBUG ((EFI_D_ERROR, "DtbCache: Failed to allocate buffer\n"));
+    return;
+  }
+
+  CopyMem (Hdr->Magic, DTB_CACHE_MAGIC, DTB_CACHE_MAGIC_SIZE);
+  Hdr->Version = DTB_CACHE_VERSION;
+  Hdr->DtbSize = DtbSize;
+  CopyMem (&Hdr->Key, &mDtbCacheKey, sizeof (mDtbCacheKey));
+  GetDtbSelection (&Hdr->Selection);
+  CopyMem ((UINT8 *)Hdr + BlockSize, Dtb, DtbSize);
+  gBS->CalculateCrc32 ((UINT8 *)Hdr + BlockSize, DtbSize, &Hdr->DtbCrc);
+
+  Status = WriteBlockToPartition (BlockIo, Handle, 0, WriteSize, Hdr);
+  if (Status != EFI_SUCCESS) {
+    DEBUG ((EFI_D_ERROR, "DtbCache: Failed to store DTB: %r\n", Status));
+  }
+  FreePool (Hdr);
+}
+
+VOID
+DtbCacheInvalidate (VOID)
+{
+  EFI_STATUS Status;
+  EFI_BLOCK_IO_PROTOCOL *BlockIo = NULL;
+  EFI_HANDLE *Handle = NULL;
+  VOID *Block = NULL;
+
+  Status = GetDtbCachePartition (&BlockIo, &Handle);
+  if (Status != EFI_SUCCESS) {
+    return;
+  }
+
+  Block = AllocateZeroPool (BlockIo->Media->BlockSize);
+  if (Block == NULL) {
+    DEBUG ((EFI_D_ERROR, "DtbCache: Failed to allocate buffer\n"));
+    return;
+  }
+
+  Status = WriteBlockToPartition (BlockIo, Handle, 0,
+                                  BlockIo->Media->BlockSize, Block);
+  if (Status != EFI_SUCCESS) {
+    DEBUG ((EFI_D_ERROR, "DtbCache: Failed to invalidate: %r\n", Status));
+  }
+  FreePool (Block);
+}
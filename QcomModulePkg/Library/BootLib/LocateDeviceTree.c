@@ -58,6 +58,14 @@ BOOLEAN GetDtboNeeded (VOID)
 {
   return DtboNeed;
 }
+
+STATIC INT32 RticIdx = INVALID_PTN;
+
+#define FNV64_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV64_PRIME 0x100000001b3ULL
+
+STATIC DtbSelectCache SelectCache;
+STATIC BOOLEAN SelectCacheLoaded = FALSE;
 /* Add function to allocate dt entry list, used for recording
  *  the entry which conform to platform_dt_absolute_match()
  */
@@ -940,6 +948,130 @@ cleanup:
 
   return FindBestMatch;
 }
+
+STATIC UINT64
+DtbSelectHash (UINT64 Hash, CONST VOID *Data, UINT32 Len)
+{
+  CONST UINT8 *Byte = Data;
+
+  while (Len--) {
+    Hash ^= *Byte++;
+    Hash *= FNV64_PRIME;
+  }
+
+  return Hash;
+}
+
+/* Mix a CRC of the whole Dtb into Hash. An edited property keeps the
+ * header as it is, so the contents are covered; the CRC is much cheaper
+ * than parsing the properties, which is the part the cache avoids.
+ */
+STATIC UINT64
+DtbSelectHashDtb (UINT64 Hash, VOID *Dtb, UINT32 DtbSize)
+{
+  UINT32 Crc = 0;
+
+  gBS->CalculateCrc32 (Dtb, DtbSize, &Crc);
+  Hash = DtbSelectHash (Hash, &DtbSize, sizeof (DtbSize));
+  return DtbSelectHash (Hash, &Crc, sizeof (Crc));
+}
+
+/* A PMIC change can make another DTB the better match, so the PMICs are
+ * part of the board identity.
+ */
+STATIC UINT64
+DtbSelectBoardKey (VOID)
+{
+  UINT32 BoardId[] = {
+    BoardPlatformRawChipId (),
+    BoardPlatformChipVersion (),
+    BoardPlatformFoundryId (),
+    BoardPlatformType (),
+    BoardPlatformSubType (),
+    BoardTargetId (),
+    BoardPlatformHlosSubType (),
+    BoardPmicTarget (PMIC_IDX0),
+    BoardPmicTarget (PMIC_IDX1),
+    BoardPmicTarget (PMIC_IDX2),
+    BoardPmicTarget (PMIC_IDX3),
+  };
+
+  return DtbSelectHash (FNV64_OFFSET_BASIS, BoardId, sizeof (BoardId));
+}
+
+STATIC DtbSelectEntry *
+GetDtbSelectEntry (DTB_SELECT_TYPE Type)
+{
+  EFI_STATUS Status;
+  UINTN DataSize = sizeof (SelectCache);
+  UINT64 BoardKey;
+
+  if (!SelectCacheLoaded) {
+    SelectCacheLoaded = TRUE;
+    BoardKey = DtbSelectBoardKey ();
+    Status = gRT->GetVariable ((CHAR16 *)L"DtbSelectCache",
+                               &gQcomTokenSpaceGuid, NULL, &DataSize,
+                               &SelectCache);
+    if (Status != EFI_SUCCESS ||
+        DataSize != sizeof (SelectCache) ||
+        SelectCache.Version != DTB_SELECT_CACHE_VERSION ||
+        SelectCache.BoardKey != BoardKey) {
+      DEBUG ((EFI_D_VERBOSE, "DTB selection cache is empty or stale\n"));
+      SetMem (&SelectCache, sizeof (SelectCache), 0);
+      SelectCache.Version = DTB_SELECT_CACHE_VERSION;
+      SelectCache.BoardKey = BoardKey;
+    }
+  }
+
+  return &SelectCache.Entry[Type];
+}
+
+STATIC VOID
+SetDtbSelectEntry (DTB_SELECT_TYPE Type, DtbSelectEntry *Entry)
+{
+  EFI_STATUS Status;
+
+  if (!CompareMem (&SelectCache.Entry[Type], Entry, sizeof (*Entry))) {
+    return;
+  }
+
+  gBS->CopyMem (&SelectCache.Entry[Type], Entry, sizeof (*Entry));
+  Status = gRT->SetVariable ((CHAR16 *)L"DtbSelectCache",
+                             &gQcomTokenSpaceGuid,
+                             EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                             EFI_VARIABLE_NON_VOLATILE,
+                             sizeof (SelectCache), &SelectCache);
+  if (Status != EFI_SUCCESS) {
+    DEBUG ((EFI_D_VERBOSE, "Failed to save DTB selection cache: %r\n",
+            Status));
+  }
+}
+
+/* Size of the appended DTB at Dtb, 0 once there is no valid DTB left */
+STATIC UINT32
+GetAppendedDtbSize (VOID *Dtb, uintptr_t KernelEnd)
+{
+  struct fdt_header DtbHdr;
+  UINT32 DtbSize;
+
+  if (((uintptr_t)Dtb + sizeof (struct fdt_header)) >= KernelEnd) {
+    return 0;
+  }
+
+  /* the DTB could be unaligned, so extract the header,
+   * and operate on it separately */
+  gBS->CopyMem (&DtbHdr, Dtb, sizeof (struct fdt_header));
+  DtbSize = fdt_totalsize ((const VOID *)&DtbHdr);
+  if (fdt_check_header ((const VOID *)&DtbHdr) != 0 ||
+      fdt_check_header_ext ((VOID *)&DtbHdr) != 0 ||
+      ((uintptr_t)Dtb + DtbSize < (uintptr_t)Dtb) ||
+      ((uintptr_t)Dtb + DtbSize > KernelEnd)) {
+    return 0;
+  }
+
+  return DtbSize;
+}
+
 /*
  * For Header Version 2, the arguments Kernel and KernelSize will be
  * the entire bootimage and the bootimage size.
@@ -951,11 +1083,16 @@ GetSocDtb (VOID *Kernel, UINT32 KernelSize, UINT32 DtbOffset, VOID *DtbLoadAddr)
 {
   uintptr_t KernelEnd = (uintptr_t)Kernel + KernelSize;
   VOID *Dtb = NULL;
-  struct fdt_header DtbHdr;
   UINT32 DtbSize = 0;
   INT32 DtbCount = 0;
   DtInfo CurDtbInfo = {0};
   DtInfo BestDtbInfo = {0};
+  DtbSelectEntry *Cached;
+  DtbSelectEntry NewEntry;
+  VOID *CachedDtb = NULL;
+  VOID *RticDtb = NULL;
+  UINT64 Key = FNV64_OFFSET_BASIS;
+
   if (!DtbOffset) {
     DEBUG ((EFI_D_ERROR, "DTB offset is NULL\n"));
     return NULL;
@@ -964,18 +1101,52 @@ GetSocDtb (VOID *Kernel, UINT32 KernelSize, UINT32 DtbOffset, VOID *DtbLoadAddr)
   if (((uintptr_t)Kernel + (uintptr_t)DtbOffset) < (uintptr_t)Kernel) {
     return NULL;
   }
+  /* Fingerprint the DTB contents, a cached selection for the same table
+   * only needs its own DTB to be matched again.
+   */
+  Cached = GetDtbSelectEntry (DTB_SELECT_SOC);
   Dtb = Kernel + DtbOffset;
-  while (((uintptr_t)Dtb + sizeof (struct fdt_header)) < (uintptr_t)KernelEnd) {
-    /* the DTB could be unaligned, so extract the header,
-     * and operate on it separately */
-    gBS->CopyMem (&DtbHdr, Dtb, sizeof (struct fdt_header));
-    DtbSize = fdt_totalsize ((const VOID *)&DtbHdr);
-    if (fdt_check_header ((const VOID *)&DtbHdr) != 0 ||
-        fdt_check_header_ext ((VOID *)&DtbHdr) != 0 ||
-        ((uintptr_t)Dtb + DtbSize < (uintptr_t)Dtb) ||
-        ((uintptr_t)Dtb + DtbSize > (uintptr_t)KernelEnd))
-      break;
+  while ((DtbSize = GetAppendedDtbSize (Dtb, KernelEnd)) != 0) {
+    if (DtbCount == Cached->BestIdx) {
+      CachedDtb = Dtb;
+    }
+    if (DtbCount == Cached->RticIdx) {
+      RticDtb = Dtb;
+    }
+    Key = DtbSelectHashDtb (Key, Dtb, DtbSize);
+    Dtb += DtbSize;
+    DtbCount++;
+  }
 
+  if (CachedDtb &&
+      Cached->Key == Key &&
+      Cached->DtbCount == DtbCount) {
+    CurDtbInfo.Dtb = CachedDtb;
+    if (ReadDtbFindMatch (&CurDtbInfo, &BestDtbInfo, SOC_MATCH) &&
+        BestDtbInfo.DtMatchVal == Cached->DtMatchVal) {
+      DEBUG ((EFI_D_VERBOSE, "Soc Dtb %d selected from cache\n",
+              Cached->BestIdx));
+      DtbIdx = Cached->BestIdx;
+      DtboNeed = Cached->DtboNeed;
+      if (RticDtb) {
+        GetRticDtb (RticDtb);
+        RticIdx = Cached->RticIdx;
+      }
+      return BestDtbInfo.Dtb;
+    }
+    SetMem (&CurDtbInfo, sizeof (CurDtbInfo), 0);
+    SetMem (&BestDtbInfo, sizeof (BestDtbInfo), 0);
+  }
+
+  SetMem (&NewEntry, sizeof (NewEntry), 0);
+  NewEntry.Key = Key;
+  NewEntry.DtbCount = DtbCount;
+  NewEntry.BestIdx = INVALID_PTN;
+  NewEntry.RticIdx = INVALID_PTN;
+
+  DtbCount = 0;
+  Dtb = Kernel + DtbOffset;
+  while ((DtbSize = GetAppendedDtbSize (Dtb, KernelEnd)) != 0) {
     CurDtbInfo.Dtb = Dtb;
     if (ReadDtbFindMatch (&CurDtbInfo, &BestDtbInfo, SOC_MATCH)) {
         DtbIdx = DtbCount;
@@ -994,6 +1165,8 @@ GetSocDtb (VOID *Kernel, UINT32 KernelSize, UINT32 DtbOffset, VOID *DtbLoadAddr)
       if (!GetRticDtb (Dtb)) {
         DEBUG ((EFI_D_VERBOSE, "Error while DTB parsing"
                                " RTIC prop continue with next DTB\n"));
+      } else {
+        NewEntry.RticIdx = DtbCount;
       }
     }
 
@@ -1007,9 +1180,58 @@ GetSocDtb (VOID *Kernel, UINT32 KernelSize, UINT32 DtbOffset, VOID *DtbLoadAddr)
     return NULL;
   }
 
+  NewEntry.BestIdx = DtbIdx;
+  NewEntry.DtboNeed = DtboNeed;
+  NewEntry.DtMatchVal = BestDtbInfo.DtMatchVal;
+  SetDtbSelectEntry (DTB_SELECT_SOC, &NewEntry);
+  RticIdx = NewEntry.RticIdx;
+
   return BestDtbInfo.Dtb;
 }
 
+VOID
+GetDtbSelection (DtbSelection *Selection)
+{
+  Selection->DtbIdx = DtbIdx;
+  Selection->DtboIdx = DtboIdx;
+  Selection->RticIdx = RticIdx;
+  Selection->DtboNeed = DtboNeed;
+}
+
+/* Applies a selection saved by GetDtbSelection () without running it
+ * again, DtbImg is the DTB table GetSocDtb () selected from.
+ */
+VOID
+RestoreDtbSelection (VOID *DtbImg,
+                     UINT32 DtbImgSize,
+                     CONST DtbSelection *Selection)
+{
+  uintptr_t DtbImgEnd = (uintptr_t)DtbImg + DtbImgSize;
+  VOID *Dtb = DtbImg;
+  UINT32 DtbSize = 0;
+  INT32 DtbCount = 0;
+
+  DtbIdx = Selection->DtbIdx;
+  DtboIdx = Selection->DtboIdx;
+  DtboNeed = Selection->DtboNeed ? TRUE : FALSE;
+  RticIdx = INVALID_PTN;
+
+  if (Selection->RticIdx == INVALID_PTN) {
+    return;
+  }
+
+  while ((DtbSize = GetAppendedDtbSize (Dtb, DtbImgEnd)) != 0) {
+    if (DtbCount == Selection->RticIdx) {
+      if (GetRticDtb (Dtb)) {
+        RticIdx = DtbCount;
+      }
+      return;
+    }
+    Dtb += DtbSize;
+    DtbCount++;
+  }
+}
+
 /*
   Function to extract Dtb from user dtbo partition.
 */
@@ -1132,6 +1354,11 @@ GetBoardDtb (BootInfo *Info, VOID *DtboImgBuffer)
   DtInfo CurDtbInfo = {0};
   DtInfo BestDtbInfo = {0};
   BOOLEAN FindBestDtb = FALSE;
+  DtbSelectEntry *Cached;
+  DtbSelectEntry NewEntry;
+  VOID *CachedDtb = NULL;
+  UINT64 Key = FNV64_OFFSET_BASIS;
+  UINT32 ValidCount = 0;
 
   if (!DtboImgBuffer) {
     DEBUG ((EFI_D_ERROR, "Dtbo Img buffer is NULL\n"));
@@ -1152,6 +1379,51 @@ GetBoardDtb (BootInfo *Info, VOID *DtboImgBuffer)
   }
 
   DtboTableEntriesCount = fdt32_to_cpu (DtboTableHdr->DtEntryCount);
+
+  /* Fingerprint the table header, its entries and the DTB contents up
+   * to the first invalid entry.
+   */
+  Cached = GetDtbSelectEntry (DTB_SELECT_BOARD);
+  Key = DtbSelectHash (Key, DtboTableHdr, sizeof (*DtboTableHdr));
+  for (DtboCount = 0; DtboCount < DtboTableEntriesCount; DtboCount++) {
+    if (CHECK_ADD64 ((UINT64)DtboImgBuffer,
+                     fdt32_to_cpu (DtboTableEntry[DtboCount].DtOffset))) {
+      break;
+    }
+    BoardDtb = DtboImgBuffer +
+               fdt32_to_cpu (DtboTableEntry[DtboCount].DtOffset);
+    if (fdt_check_header (BoardDtb) || fdt_check_header_ext (BoardDtb)) {
+      break;
+    }
+    if ((INT32)DtboCount == Cached->BestIdx) {
+      CachedDtb = BoardDtb;
+    }
+    Key = DtbSelectHash (Key, &DtboTableEntry[DtboCount],
+                         sizeof (DtboTableEntry[DtboCount]));
+    Key = DtbSelectHashDtb (Key, BoardDtb, fdt_totalsize (BoardDtb));
+  }
+  ValidCount = DtboCount;
+
+  if (CachedDtb &&
+      Cached->Key == Key &&
+      Cached->DtbCount == ValidCount) {
+    CurDtbInfo.Dtb = CachedDtb;
+    if (ReadDtbFindMatch (&CurDtbInfo, &BestDtbInfo, VARIANT_MATCH) &&
+        BestDtbInfo.DtMatchVal == Cached->DtMatchVal) {
+      DEBUG ((EFI_D_VERBOSE, "Board Dtb %d selected from cache\n",
+              Cached->BestIdx));
+      DtboIdx = Cached->BestIdx;
+      return BestDtbInfo.Dtb;
+    }
+    SetMem (&CurDtbInfo, sizeof (CurDtbInfo), 0);
+    SetMem (&BestDtbInfo, sizeof (BestDtbInfo), 0);
+  }
+
+  SetMem (&NewEntry, sizeof (NewEntry), 0);
+  NewEntry.Key = Key;
+  NewEntry.DtbCount = ValidCount;
+  NewEntry.RticIdx = INVALID_PTN;
+
   for (DtboCount = 0; DtboCount < DtboTableEntriesCount; DtboCount++) {
     if (CHECK_ADD64 ((UINT64)DtboImgBuffer,
                      fdt32_to_cpu (DtboTableEntry->DtOffset))) {
@@ -1182,6 +1454,10 @@ GetBoardDtb (BootInfo *Info, VOID *DtboImgBuffer)
     return NULL;
   }
 
+  NewEntry.BestIdx = DtboIdx;
+  NewEntry.DtMatchVal = BestDtbInfo.DtMatchVal;
+  SetDtbSelectEntry (DTB_SELECT_BOARD, &NewEntry);
+
   return BestDtbInfo.Dtb;
 }
 
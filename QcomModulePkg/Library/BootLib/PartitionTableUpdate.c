@@ -32,6 +32,7 @@
 #include <Library/Board.h>
 #include <Library/BootLinux.h>
 #include <Library/LinuxLoaderLib.h>
+#include <Library/ThreadStack.h>
 #include <Library/UefiLib.h>
 #include <Library/DebugLib.h>
 #include <Uefi.h>
@@ -46,6 +47,9 @@ STATIC UINT32 MaxLuns;
 STATIC UINT32 PartitionCount;
 STATIC BOOLEAN FirstBoot;
 STATIC struct PartitionEntry PtnEntriesBak[MAX_NUM_PARTITIONS];
+STATIC INT16 PtnNameIndex[PTN_NAME_INDEX_SIZE];
+STATIC BOOLEAN PtnNameIndexValid;
+STATIC EFI_KERNEL_PROTOCOL *KernIntf = NULL;
 
 STATIC struct BootPartsLinkedList *HeadNode;
 STATIC EFI_STATUS
@@ -100,6 +104,50 @@ GetPartitionIdxInLun (CHAR16 *Pname, UINT32 Lun)
   return INVALID_PTN;
 }
 
+/* FNV-1a over the UTF-16 partition name */
+STATIC UINT32
+PartitionNameHash (CONST CHAR16 *Pname)
+{
+  UINT32 Hash = 2166136261U;
+  UINT32 i;
+
+  for (i = 0; i < MAX_GPT_NAME_SIZE && Pname[i] != L'\0'; i++) {
+    Hash ^= Pname[i];
+    Hash *= 16777619U;
+  }
+  return Hash;
+}
+
+/* Open addressed name -> PtnEntries index table, rebuilt whenever the
+ * entries are re-read. The first entry of a duplicated name wins, like
+ * the linear lookup it replaces.
+ */
+STATIC VOID
+BuildPartitionNameIndex (VOID)
+{
+  UINT32 i;
+  UINT32 Slot;
+  CONST CHAR16 *Pname;
+
+  gBS->SetMem ((VOID *)PtnNameIndex, sizeof (PtnNameIndex), 0xff);
+
+  for (i = 0; i < PartitionCount; i++) {
+    Pname = PtnEntries[i].PartEntry.PartitionName;
+    Slot = PartitionNameHash (Pname) & (PTN_NAME_INDEX_SIZE - 1);
+    while (PtnNameIndex[Slot] != INVALID_PTN) {
+      if (!StrnCmp (PtnEntries[PtnNameIndex[Slot]].PartEntry.PartitionName,
+                    Pname, ARRAY_SIZE (PtnEntries[i].PartEntry.PartitionName)))
+        break;
+      Slot = (Slot + 1) & (PTN_NAME_INDEX_SIZE - 1);
+    }
+
+    if (PtnNameIndex[Slot] == INVALID_PTN) {
+      PtnNameIndex[Slot] = i;
+    }
+  }
+  PtnNameIndexValid = TRUE;
+}
+
 VOID UpdatePartitionEntries (VOID)
 {
   UINT32 i;
@@ -132,6 +180,7 @@ VOID UpdatePartitionEntries (VOID)
       PtnEntries[Index].lun = i;
     }
   }
+  BuildPartitionNameIndex ();
   if (NAND == CheckRootDeviceType ()) {
     NandABUpdatePartition (PTN_ENTRIES_FROM_MISC);
   }
@@ -143,6 +192,20 @@ INT32
 GetPartitionIndex (CHAR16 *Pname)
 {
   INT32 i;
+  UINT32 Slot;
+
+  if (PtnNameIndexValid) {
+    Slot = PartitionNameHash (Pname) & (PTN_NAME_INDEX_SIZE - 1);
+    while (PtnNameIndex[Slot] != INVALID_PTN) {
+      i = PtnNameIndex[Slot];
+      if (!StrnCmp (PtnEntries[i].PartEntry.PartitionName, Pname,
+                    ARRAY_SIZE (PtnEntries[i].PartEntry.PartitionName))) {
+        return i;
+      }
+      Slot = (Slot + 1) & (PTN_NAME_INDEX_SIZE - 1);
+    }
+    return INVALID_PTN;
+  }
 
   for (i = 0; i < PartitionCount; i++) {
     if (!StrnCmp (PtnEntries[i].PartEntry.PartitionName, Pname,
@@ -640,19 +703,143 @@ SwitchPtnSlots (CONST CHAR16 *SetActive)
   UpdatePartitionAttributes (PARTITION_GUID);
 }
 
-EFI_STATUS
-EnumeratePartitions (VOID)
+typedef struct LunEnumWorker {
+  UINT32 First;
+  UINT32 Stride;
+  UINT32 Attribs;
+  EFI_STATUS Status[MAX_LUNS];
+} LunEnumWorker;
+
+STATIC VOID
+EnumerateLunRange (LunEnumWorker *Worker)
 {
-  EFI_STATUS Status;
-  PartiSelectFilter HandleFilter;
-  UINT32 Attribs = 0;
   UINT32 i;
+  PartiSelectFilter HandleFilter;
   // UFS LUN GUIDs
   EFI_GUID LunGuids[] = {
       gEfiUfsLU0Guid, gEfiUfsLU1Guid, gEfiUfsLU2Guid, gEfiUfsLU3Guid,
       gEfiUfsLU4Guid, gEfiUfsLU5Guid, gEfiUfsLU6Guid, gEfiUfsLU7Guid,
   };
 
+  for (i = Worker->First; i < MAX_LUNS; i += Worker->Stride) {
+    Ptable[i].MaxHandles = ARRAY_SIZE (Ptable[i].HandleInfoList);
+    HandleFilter.PartitionType = NULL;
+    HandleFilter.VolumeName = NULL;
+    HandleFilter.RootDeviceType = &LunGuids[i];
+
+    Worker->Status[i] =
+        GetBlkIOHandles (Worker->Attribs, &HandleFilter,
+                         &Ptable[i].HandleInfoList[0], &Ptable[i].MaxHandles);
+    /* If we fail to get block for a lun that means the lun is not configured
+     * and unsed, ignore the error
+     * and continue with the next Lun */
+    if (EFI_ERROR (Worker->Status[i])) {
+      DEBUG ((EFI_D_ERROR,
+              "Error getting block IO handle for %d lun, Lun may be unused\n",
+              i));
+    }
+  }
+}
+
+INT32 __attribute__ ( (no_sanitize ("safe-stack")))
+EnumerateLunThread (VOID *Arg)
+{
+  Thread *CurrentThread = KernIntf->Thread->GetCurrentThread ();
+
+  EnumerateLunRange ((LunEnumWorker *)Arg);
+
+  ThreadStackNodeRemove (CurrentThread);
+  KernIntf->Thread->ThreadExit (0);
+
+  return 0;
+}
+
+STATIC UINT32
+GetLunEnumThreads (VOID)
+{
+  EFI_STATUS Status;
+  UINT32 Cpus;
+
+  if (KernIntf == NULL) {
+    Status = gBS->LocateProtocol (&gEfiKernelProtocolGuid, NULL,
+                                  (VOID **)&KernIntf);
+    if (Status != EFI_SUCCESS ||
+        KernIntf == NULL ||
+        KernIntf->Version < EFI_KERNEL_PROTOCOL_VER_UNSAFE_STACK_APIS) {
+      KernIntf = NULL;
+      return 1;
+    }
+  }
+
+  Cpus = KernIntf->MpCpu->MpcoreGetAvailCpuCount ();
+  if (Cpus < 1) {
+    return 1;
+  }
+  return Cpus < MAX_LUNS ? Cpus : MAX_LUNS;
+}
+
+/* Each UFS LUN needs its own walk over all block IO handles, spread the
+ * walks over the available CPUs. LUNs are striped over the workers, the
+ * calling thread is worker 0. Returns the status of the last LUN.
+ */
+STATIC EFI_STATUS
+EnumerateLuns (UINT32 Attribs)
+{
+  LunEnumWorker Workers[MAX_LUNS];
+  Thread *Threads[MAX_LUNS];
+  UINT32 NumThreads;
+  UINT32 i;
+  UINT32 Lun;
+  INT32 RetCode;
+
+  NumThreads = GetLunEnumThreads ();
+  for (i = 0; i < NumThreads; i++) {
+    Workers[i].First = i;
+    Workers[i].Stride = NumThreads;
+    Workers[i].Attribs = Attribs;
+    Threads[i] = NULL;
+  }
+
+  for (i = 1; i < NumThreads; i++) {
+    Threads[i] = KernIntf->Thread->ThreadCreate ("LunEnumThread",
+                     EnumerateLunThread, (VOID *)&Workers[i],
+                     UEFI_THREAD_PRIORITY, DEFAULT_STACK_SIZE);
+    if (Threads[i] == NULL) {
+      break;
+    }
+
+    AllocateUnSafeStackPtr (Threads[i]);
+
+    if (KernIntf->Thread->ThreadResume (Threads[i]) != 0) {
+      ThreadStackNodeRemove (Threads[i]);
+      Threads[i] = NULL;
+      break;
+    }
+  }
+
+  /* LUNs of workers that could not be started are enumerated here */
+  for (; i < NumThreads; i++) {
+    EnumerateLunRange (&Workers[i]);
+  }
+  EnumerateLunRange (&Workers[0]);
+
+  for (i = 1; i < NumThreads; i++) {
+    if (Threads[i]) {
+      KernIntf->Thread->ThreadJoin (Threads[i], &RetCode, INFINITE_TIME);
+    }
+  }
+
+  Lun = MAX_LUNS - 1;
+  return Workers[Lun % NumThreads].Status[Lun];
+}
+
+EFI_STATUS
+EnumeratePartitions (VOID)
+{
+  EFI_STATUS Status;
+  PartiSelectFilter HandleFilter;
+  UINT32 Attribs = 0;
+
   gBS->SetMem ((VOID *)Ptable, (sizeof (struct StoragePartInfo) * MAX_LUNS), 0);
 
   /* By default look for emmc partitions if not found look for UFS */
@@ -692,26 +879,8 @@ EnumeratePartitions (VOID)
      * only few of them or all of them
      * Based on the information read update the MaxLuns to reflect the max
      * supported luns */
-    for (i = 0; i < MAX_LUNS; i++) {
-      Ptable[i].MaxHandles = ARRAY_SIZE (Ptable[i].HandleInfoList);
-      HandleFilter.PartitionType = NULL;
-      HandleFilter.VolumeName = NULL;
-      HandleFilter.RootDeviceType = &LunGuids[i];
-
-      Status =
-          GetBlkIOHandles (Attribs, &HandleFilter, &Ptable[i].HandleInfoList[0],
-                           &Ptable[i].MaxHandles);
-      /* If we fail to get block for a lun that means the lun is not configured
-       * and unsed, ignore the error
-       * and continue with the next Lun */
-      if (EFI_ERROR (Status)) {
-        DEBUG ((EFI_D_ERROR,
-                "Error getting block IO handle for %d lun, Lun may be unused\n",
-                i));
-        continue;
-      }
-    }
-    MaxLuns = i;
+    Status = EnumerateLuns (Attribs);
+    MaxLuns = MAX_LUNS;
   } else {
     DEBUG ((EFI_D_ERROR, "Error populating block IO handles\n"));
     return EFI_NOT_FOUND;
@@ -41,6 +41,7 @@
 #include <Protocol/EFIRng.h>
 #include <Library/PartialGoods.h>
 #include <Library/FdtRw.h>
+#include "BootStats.h"
 
 #define NUM_SPLASHMEM_PROP_ELEM 4
 #define DEFAULT_CELL_SIZE 2
@@ -639,6 +640,44 @@ dev_tree_add_mem_infoV64 (VOID *fdt, UINT32 offset, UINT64 addr, UINT64 size)
   return ret;
 }
 
+/* Size of the boot-timeline string list in the chosen node */
+STATIC UINT32
+GetBootTimelineSize (VOID)
+{
+  CHAR8 Span[BT_SPAN_STR_LEN];
+  UINT32 Size = 0;
+  UINT32 Len;
+  UINT32 Index;
+
+  for (Index = 0;
+       (Len = BootTimelineGetSpan (Index, Span, sizeof (Span))) != 0;
+       Index++) {
+    Size += Len + 1;
+  }
+
+  return Size;
+}
+
+/* Publish the completed boot timeline spans in the chosen node */
+STATIC VOID
+UpdateBootTimeline (VOID *fdt, UINT32 offset)
+{
+  CHAR8 Span[BT_SPAN_STR_LEN];
+  UINT32 Index;
+  INT32 ret = 0;
+
+  for (Index = 0; BootTimelineGetSpan (Index, Span, sizeof (Span)); Index++) {
+    FdtPropUpdateFunc (fdt, offset, (CONST CHAR8 *)"boot-timeline",
+                      (CONST VOID *)Span, fdt_appendprop_string, ret);
+    if (ret) {
+      DEBUG ((EFI_D_ERROR,
+              "ERROR: Cannot update chosen node [boot-timeline] - 0x%x\n",
+              ret));
+      return;
+    }
+  }
+}
+
 /* Top level function that updates the device tree. */
 EFI_STATUS
 UpdateDeviceTree (VOID *fdt,
@@ -671,7 +710,8 @@ UpdateDeviceTree (VOID *fdt,
 
   /* Add padding to make space for new nodes and properties. */
   PaddSize = ADD_OF (fdt_totalsize (fdt),
-                    DTB_PAD_SIZE + AsciiStrLen (cmdline));
+                    DTB_PAD_SIZE + AsciiStrLen (cmdline) +
+                    GetBootTimelineSize ());
   if (!PaddSize) {
     DEBUG ((EFI_D_ERROR, "ERROR: Integer Overflow: fdt size = %u\n",
             fdt_totalsize (fdt)));
@@ -824,6 +864,8 @@ OutofUpdateRankChannel:
     DEBUG ((EFI_D_INFO, "ERROR: Cannot generate Kaslr Seed - %r\n", Status));
   }
 
+  UpdateBootTimeline (fdt, offset);
+
   if (RamDiskSize) {
     /* Adding the initrd-start to the chosen node */
     FdtPropUpdateFunc (fdt, offset, (CONST CHAR8 *)"linux,initrd-start",
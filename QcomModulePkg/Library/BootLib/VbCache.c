@@ -0,0 +1,382 @@
+/* Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * * Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <Library/DebugLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/VbCache.h>
+
+/* Digests found in the partition at the start of this boot */
+STATIC VbCacheHdr mVbCache;
+STATIC BOOLEAN mVbCacheLoaded;
+/* Digests that were hit or freshly verified on this boot */
+STATIC VbCacheEntry mVbCacheUsed[VB_CACHE_MAX_ENTRIES];
+STATIC UINT32 mVbCacheNumUsed;
+STATIC BOOLEAN mVbCacheDirty;
+
+STATIC EFI_STATUS
+GetVbCachePartition (EFI_BLOCK_IO_PROTOCOL **BlockIo, EFI_HANDLE **Handle)
+{
+  EFI_STATUS Status;
+  UINT32 BlkIOAttrib = 0;
+  PartiSelectFilter HandleFilter;
+  UINT32 MaxHandles = 1;
+  HandleInfo HandleInfoList[1];
+  CHAR16 PtnName[MAX_GPT_NAME_SIZE] = VB_CACHE_PARTITION;
+
+  BlkIOAttrib |= BLK_IO_SEL_PARTITIONED_MBR;
+  BlkIOAttrib |= BLK_IO_SEL_PARTITIONED_GPT;
+  BlkIOAttrib |= BLK_IO_SEL_MEDIA_TYPE_NON_REMOVABLE;
+  BlkIOAttrib |= BLK_IO_SEL_MATCH_PARTITION_LABEL;
+
+  HandleFilter.RootDeviceType = NULL;
+  HandleFilter.VolumeName = NULL;
+  HandleFilter.PartitionLabel = PtnName;
+
+  Status =
+     GetBlkIOHandles (BlkIOAttrib, &HandleFilter, HandleInfoList, &MaxHandles);
+  if (Status != EFI_SUCCESS ||
+      MaxHandles != 1) {
+    return EFI_NOT_FOUND;
+  }
+
+  *BlockIo = HandleInfoList[0].BlkIo;
+  *Handle = HandleInfoList[0].Handle;
+  if (ALIGN_VALUE (sizeof (VbCacheHdr), (*BlockIo)->Media->BlockSize) >
+      GetPartitionSize (*BlockIo)) {
+    return EFI_UNSUPPORTED;
+  }
+  return EFI_SUCCESS;
+}
+
+STATIC UINT32
+VbCacheCrc (VbCacheHdr *Hdr)
+{
+  UINT32 SavedCrc = Hdr->Crc;
+  UINT32 Crc = 0;
+
+  Hdr->Crc = 0;
+  gBS->CalculateCrc32 (Hdr, sizeof (*Hdr), &Crc);
+  Hdr->Crc = SavedCrc;
+  return Crc;
+}
+
+/* CRC over evenly spaced windows of the image, including the first and
+ * the last one, cheap enough to run on every boot.
+ */
+STATIC UINT32
+VbCacheSampleCrc (CONST VOID *Data, UINT64 Size)
+{
+  UINT32 Crcs[VB_CACHE_SAMPLES];
+  UINT64 Stride = 0;
+  UINT64 Len = Size;
+  UINT32 Crc = 0;
+  UINT32 Idx;
+
+  if (Size == 0) {
+    return 0;
+  }
+
+  if (Size > VB_CACHE_SAMPLE_SIZE) {
+    Len = VB_CACHE_SAMPLE_SIZE;
+    Stride = (Size - VB_CACHE_SAMPLE_SIZE) / (VB_CACHE_SAMPLES - 1);
+  }
+
+  for (Idx = 0; Idx < VB_CACHE_SAMPLES; Idx++) {
+    Crcs[Idx] = 0;
+    gBS->CalculateCrc32 ((UINT8 *)Data + Stride * Idx, Len, &Crcs[Idx]);
+  }
+  gBS->CalculateCrc32 (Crcs, sizeof (Crcs), &Crc);
+  return Crc;
+}
+
+STATIC VOID
+VbCacheLoad (VOID)
+{
+  EFI_STATUS Status;
+  EFI_BLOCK_IO_PROTOCOL *BlockIo = NULL;
+  EFI_HANDLE *Handle = NULL;
+  VbCacheHdr *Hdr = NULL;
+  UINT64 ReadSize;
+
+  if (mVbCacheLoaded) {
+    return;
+  }
+  mVbCacheLoaded = TRUE;
+  SetMem (&mVbCache, sizeof (mVbCache), 0);
+
+  Status = GetVbCachePartition (&BlockIo, &Handle);
+  if (Status != EFI_SUCCESS) {
+    return;
+  }
+
+  ReadSize = ALIGN_VALUE (sizeof (VbCacheHdr), BlockIo->Media->BlockSize);
+  Hdr = AllocateZeroPool (ReadSize);
+  if (Hdr == NULL) {
+    DEBUG ((EFI_D_ERROR, "VbCache: Failed to allocate header\n"));
+    return;
+  }
+
+  Status = BlockIo->ReadBlocks (BlockIo, BlockIo->Media->MediaId, 0,
+                                ReadSize, Hdr);
+  if (Status != EFI_SUCCESS) {
+    DEBUG ((EFI_D_ERROR, "VbCache: Failed to read header: %r\n", Status));
+    goto out;
+  }
+
+  if (CompareMem (Hdr->Magic, VB_CACHE_MAGIC, VB_CACHE_MAGIC_SIZE) ||
+      Hdr->Version != VB_CACHE_VERSION ||
+      Hdr->NumEntries > VB_CACHE_MAX_ENTRIES ||
+      Hdr->Crc != VbCacheCrc (Hdr)) {
+    DEBUG ((EFI_D_VERBOSE, "VbCache: No valid digests\n"));
+    goto out;
+  }
+
+  CopyMem (&mVbCache, Hdr, sizeof (mVbCache));
+
+out:
+  FreePool (Hdr);
+}
+
+STATIC VbCacheEntry *
+VbCacheFind (VbCacheEntry *Entries, UINT32 NumEntries, CONST CHAR8 *Partition)
+{
+  UINT32 Idx;
+
+  for (Idx = 0; Idx < NumEntries; Idx++) {
+    if (!AsciiStrnCmp (Entries[Idx].PartitionName, Partition,
+                       MAX_GPT_NAME_SIZE)) {
+      return &Entries[Idx];
+    }
+  }
+  return NULL;
+}
+
+STATIC VOID
+VbCacheRecord (CONST CHAR8 *Partition,
+               CONST UINT8 *VbMetaDigest,
+               UINT32 VbMetaDigestLen,
+               CONST UINT8 *Digest,
+               UINT32 DigestLen,
+               UINT32 SampleCrc,
+               UINT64 Size)
+{
+  VbCacheEntry *Entry;
+
+  Entry = VbCacheFind (mVbCacheUsed, mVbCacheNumUsed, Partition);
+  if (Entry == NULL) {
+    if (mVbCacheNumUsed >= VB_CACHE_MAX_ENTRIES) {
+      return;
+    }
+    Entry = &mVbCacheUsed[mVbCacheNumUsed++];
+  }
+
+  SetMem (Entry, sizeof (*Entry), 0);
+  AsciiStrnCpyS (Entry->PartitionName, MAX_GPT_NAME_SIZE, Partition,
+                 MAX_GPT_NAME_SIZE - 1);
+  CopyMem (Entry->VbMetaDigest, VbMetaDigest, VbMetaDigestLen);
+  CopyMem (Entry->Digest, Digest, DigestLen);
+  Entry->DigestLen = DigestLen;
+  Entry->SampleCrc = SampleCrc;
+  Entry->ImageSize = Size;
+}
+
+/* A locked device never trusts anything kept in a writable partition,
+ * only unlocked ones use the cache to shorten the boot.
+ */
+BOOLEAN
+VbCacheLookup (CONST CHAR8 *Partition,
+               CONST UINT8 *VbMetaDigest,
+               UINT32 VbMetaDigestLen,
+               CONST UINT8 *Digest,
+               UINT32 DigestLen,
+               CONST VOID *Data,
+               UINT64 Size)
+{
+  VbCacheEntry *Entry;
+  UINT8 Tag[VB_CACHE_DIGEST_SIZE] = {0};
+  UINT32 SampleCrc;
+
+  if (!IsUnlocked () ||
+      Partition == NULL ||
+      VbMetaDigest == NULL ||
+      Digest == NULL ||
+      VbMetaDigestLen > VB_CACHE_DIGEST_SIZE ||
+      DigestLen > VB_CACHE_DIGEST_SIZE) {
+    return FALSE;
+  }
+  CopyMem (Tag, VbMetaDigest, VbMetaDigestLen);
+
+  VbCacheLoad ();
+  Entry = VbCacheFind (mVbCache.Entries, mVbCache.NumEntries, Partition);
+  if (Entry == NULL ||
+      Entry->DigestLen != DigestLen ||
+      Entry->ImageSize != Size ||
+      CompareMem (Entry->VbMetaDigest, Tag, sizeof (Tag)) ||
+      CompareMem (Entry->Digest, Digest, DigestLen)) {
+    return FALSE;
+  }
+
+  /* The caller reads the image only when it may be a hit */
+  if (Data == NULL) {
+    return TRUE;
+  }
+
+  SampleCrc = VbCacheSampleCrc (Data, Size);
+  if (SampleCrc != Entry->SampleCrc) {
+    DEBUG ((EFI_D_INFO, "VbCache: %a changed since last boot\n", Partition));
+    return FALSE;
+  }
+
+  VbCacheRecord (Partition, VbMetaDigest, VbMetaDigestLen, Digest, DigestLen,
+                 SampleCrc, Size);
+  DEBUG ((EFI_D_INFO, "VbCache: Hit for %a\n", Partition));
+  return TRUE;
+}
+
+VOID
+VbCacheUpdate (CONST CHAR8 *Partition,
+               CONST UINT8 *VbMetaDigest,
+               UINT32 VbMetaDigestLen,
+               CONST UINT8 *Digest,
+               UINT32 DigestLen,
+               CONST VOID *Data,
+               UINT64 Size)
+{
+  if (!IsUnlocked () ||
+      Partition == NULL ||
+      VbMetaDigest == NULL ||
+      Digest == NULL ||
+      Data == NULL ||
+      VbMetaDigestLen > VB_CACHE_DIGEST_SIZE ||
+      DigestLen > VB_CACHE_DIGEST_SIZE) {
+    return;
+  }
+
+  VbCacheLoad ();
+  VbCacheRecord (Partition, VbMetaDigest, VbMetaDigestLen, Digest, DigestLen,
+                 VbCacheSampleCrc (Data, Size), Size);
+  mVbCacheDirty = TRUE;
+}
+
+VOID
+VbCacheStore (CONST UINT8 *VbMetaDigest, UINT32 VbMetaDigestLen)
+{
+  EFI_STATUS Status;
+  EFI_BLOCK_IO_PROTOCOL *BlockIo = NULL;
+  EFI_HANDLE *Handle = NULL;
+  VbCacheHdr *Hdr = NULL;
+  UINT8 Tag[VB_CACHE_DIGEST_SIZE] = {0};
+  UINT64 WriteSize;
+  UINT32 Idx;
+
+  /* Nothing was looked up, the cache is not in use on this boot */
+  if (!mVbCacheLoaded ||
+      VbMetaDigest == NULL ||
+      VbMetaDigestLen > VB_CACHE_DIGEST_SIZE) {
+    return;
+  }
+  CopyMem (Tag, VbMetaDigest, VbMetaDigestLen);
+
+  if (!mVbCacheDirty &&
+      !CompareMem (mVbCache.VbMetaDigest, Tag, sizeof (Tag))) {
+    return;
+  }
+  mVbCacheDirty = FALSE;
+
+  Status = GetVbCachePartition (&BlockIo, &Handle);
+  if (Status != EFI_SUCCESS) {
+    return;
+  }
+
+  WriteSize = ALIGN_VALUE (sizeof (VbCacheHdr), BlockIo->Media->BlockSize);
+  Hdr = AllocateZeroPool (WriteSize);
+  if (Hdr == NULL) {
+    DEBUG ((EFI_D_ERROR, "VbCache: Failed to allocate buffer\n"));
+    return;
+  }
+
+  CopyMem (Hdr->Magic, VB_CACHE_MAGIC, VB_CACHE_MAGIC_SIZE);
+  Hdr->Version = VB_CACHE_VERSION;
+  CopyMem (Hdr->VbMetaDigest, Tag, sizeof (Tag));
+  CopyMem (Hdr->Entries, mVbCacheUsed,
+           mVbCacheNumUsed * sizeof (VbCacheEntry));
+  Hdr->NumEntries = mVbCacheNumUsed;
+
+  /* Keep the images of the other boot mode (e.g. recovery) as long as
+   * they were verified against the same vbmeta.
+   */
+  if (!CompareMem (mVbCache.VbMetaDigest, Tag, sizeof (Tag))) {
+    for (Idx = 0; Idx < mVbCache.NumEntries &&
+                  Hdr->NumEntries < VB_CACHE_MAX_ENTRIES; Idx++) {
+      if (VbCacheFind (mVbCacheUsed, mVbCacheNumUsed,
+                       mVbCache.Entries[Idx].PartitionName) == NULL) {
+        CopyMem (&Hdr->Entries[Hdr->NumEntries++], &mVbCache.Entries[Idx],
+                 sizeof (VbCacheEntry));
+      }
+    }
+  }
+  Hdr->Crc = VbCacheCrc (Hdr);
+
+  Status = WriteBlockToPartition (BlockIo, Handle, 0, WriteSize, Hdr);
+  if (Status != EFI_SUCCESS) {
+    DEBUG ((EFI_D_ERROR, "VbCache: Failed to store digests: %r\n", Status));
+  } else {
+    CopyMem (&mVbCache, Hdr, sizeof (mVbCache));
+  }
+  FreePool (Hdr);
+}
+
+VOID
+VbCacheInvalidate (VOID)
+{
+  EFI_STATUS Status;
+  EFI_BLOCK_IO_PROTOCOL *BlockIo = NULL;
+  EFI_HANDLE *Handle = NULL;
+  VOID *Block = NULL;
+
+  Status = GetVbCachePartition (&BlockIo, &Handle);
+  if (Status != EFI_SUCCESS) {
+    return;
+  }
+
+  Block = AllocateZeroPool (BlockIo->Media->BlockSize);
+  if (Block == NULL) {
+    DEBUG ((EFI_D_ERROR, "VbCache: Failed to allocate buffer\n"));
+    return;
+  }
+
+  Status = WriteBlockToPartition (BlockIo, Handle, 0,
+                                  BlockIo->Media->BlockSize, Block);
+  if (Status != EFI_SUCCESS) {
+    DEBUG ((EFI_D_ERROR, "VbCache: Failed to invalidate: %r\n", Status));
+  }
+  FreePool (Block);
+  mVbCacheLoaded = FALSE;
+  mVbCacheNumUsed = 0;
+  mVbCacheDirty = FALSE;
+}
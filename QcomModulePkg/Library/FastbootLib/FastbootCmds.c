@@ -83,6 +83,7 @@ found at
 #include <Library/DebugLib.h>
 #include <Library/DeviceInfo.h>
 #include <Library/DevicePathLib.h>
+#include <Library/DtbCache.h>
 #include <Library/MemoryAllocationLib.h>
 #include <Library/MenuKeysDetection.h>
 #include <Library/PartitionTableUpdate.h>
@@ -94,6 +95,7 @@ found at
 #include <Library/UefiLib.h>
 #include <Library/UefiRuntimeServicesTableLib.h>
 #include <Library/UnlockMenu.h>
+#include <Library/VbCache.h>
 #include <Library/BootLinux.h>
 #include <Uefi.h>
 
@@ -127,6 +129,9 @@ STATIC struct GetVarPartitionInfo part_info[] = {
 
 STATIC struct GetVarPartitionInfo PublishedPartInfo[MAX_NUM_PARTITIONS];
 
+STATIC VOID
+RefreshGetVarPartitionInfo (struct GetVarPartitionInfo *PartInfo);
+
 #ifdef ENABLE_UPDATE_PARTITIONS_CMDS
 STATIC CONST CHAR16 *CriticalPartitions[] = {
     L"abl",  L"rpm",        L"tz",      L"sdi",       L"xbl",       L"hyp",
@@ -145,6 +150,7 @@ CheckVirtualAbCriticalPartition (CHAR16 *PartitionName);
 #endif
 
 STATIC FASTBOOT_VAR *Varlist;
+STATIC FASTBOOT_VAR *VarHash[FASTBOOT_VAR_HASH_SIZE];
 STATIC BOOLEAN Finished = FALSE;
 STATIC CHAR8 StrSerialNum[MAX_RSP_SIZE];
 STATIC CHAR8 FullProduct[MAX_RSP_SIZE];
@@ -218,6 +224,15 @@ STATIC EFI_EVENT UsbTimerEvent;
 
 STATIC UINT64 MaxDownLoadSize = 0;
 
+/* Compressed payloads are inflated here as a whole rather than streamed
+ * into the flash path: decompress () only works buffer to buffer and the
+ * sparse, meta and UBI handlers expect the complete image. That costs up
+ * to max-download-size of extra pages, kept for the next compressed flash
+ * and freed when fastboot exits.
+ */
+STATIC UINT8 *InflateBuffer;
+STATIC UINT64 InflateBufferSize;
+
 STATIC INT32 Lun = NO_LUN;
 STATIC BOOLEAN LunSet;
 
@@ -230,6 +245,8 @@ STATIC VOID
 AcceptCmd (IN UINT64 Size, IN CHAR8 *Data);
 STATIC VOID
 AcceptCmdHandler (IN EFI_EVENT Event, IN VOID *Context);
+STATIC VOID
+WaitForTransferComplete (VOID);
 
 #define NAND_PAGES_PER_BLOCK 64
 
@@ -251,6 +268,67 @@ typedef struct {
   UINT64 FlashNumDataBytes;
 } FlashInfo;
 
+/* Download ring for the threaded flash: the fastboot buffer is carved into
+ * FlashRingDepth slots of MaxDownLoadSize. Downloads fill the slots in order
+ * and a single flash worker drains the queued images oldest first, so a
+ * "flash" only stalls the host once every slot is waiting for the disk.
+ */
+typedef struct {
+  UINT8 *Buffer;
+  UINT64 NumDataBytes;
+  BOOLEAN Sparse;
+  CHAR16 PartitionName[MAX_GPT_NAME_SIZE];
+} FlashRingSlot;
+
+STATIC FlashRingSlot FlashRing[FLASH_RING_MAX_DEPTH];
+/* Zero when the legacy flash/usb buffer swap is used */
+STATIC UINT32 FlashRingDepth;
+/* Oldest queued slot, number of queued slots and the slot usb fills next */
+STATIC UINT32 FlashRingHead;
+STATIC UINT32 FlashRingPending;
+STATIC UINT32 FlashRingUsb;
+STATIC BOOLEAN FlashRingWorkerRunning;
+STATIC LockHandle *LockRing;
+
+/* Streaming sparse flash: chunks of a sparse image are committed to the
+ * armed partition while the rest of the download is still in flight.
+ */
+typedef enum {
+  StreamFlashIdle = 0,
+  StreamFlashHeader,
+  StreamFlashChunkHeader,
+  StreamFlashChunkData,
+  StreamFlashDone,
+  StreamFlashBypass,
+  StreamFlashError
+} StreamFlashState;
+
+typedef struct {
+  BOOLEAN Armed;
+  CHAR16 PartitionName[MAX_GPT_NAME_SIZE];
+  StreamFlashState State;
+  EFI_STATUS Status;
+  UINT8 *Base;
+  UINT64 Size;
+  UINT64 Consumed;
+  UINT64 ChunkDataLeft;
+  sparse_header_t SparseHeader;
+  chunk_header_t ChunkHeader;
+  SparseImgParam SparseImgData;
+} StreamFlashInfo;
+
+#ifdef ENABLE_UPDATE_PARTITIONS_CMDS
+STATIC StreamFlashInfo StreamFlash;
+
+/* Replicated pattern buffer for sparse FILL chunks */
+#define ZERO_ERASE_UNKNOWN 0xFF
+STATIC UINT32 *FillBuf;
+STATIC UINT64 FillBufSize;
+STATIC UINT32 FillBufVal;
+STATIC BOOLEAN FillBufValid;
+STATIC UINT8 EraseReadsZero = ZERO_ERASE_UNKNOWN;
+#endif
+
 STATIC BOOLEAN FlashSplitNeeded;
 STATIC BOOLEAN UsbTimerStarted;
 
@@ -301,23 +379,88 @@ STATIC EFI_STATUS FastbootUnInit (VOID)
     FreePool (Var);
     Var = NULL;
   }
+  gBS->SetMem (VarHash, sizeof (VarHash), 0);
 
   return EFI_SUCCESS;
 }
 
-/* Publish a variable readable by the built-in getvar command
- * These Variables must not be temporary, shallow copies are used.
- */
+/* FNV-1a hash of a getvar name */
+STATIC UINT32
+FastbootVarHash (IN CONST CHAR8 *Name)
+{
+  UINT32 Hash = 2166136261U;
+
+  while (*Name) {
+    Hash ^= (UINT8)*Name++;
+    Hash *= 16777619U;
+  }
+
+  return Hash % FASTBOOT_VAR_HASH_SIZE;
+}
+
 STATIC VOID
-FastbootPublishVar (IN CONST CHAR8 *Name, IN CONST CHAR8 *Value)
+FastbootVarUnhash (IN FASTBOOT_VAR *Var)
+{
+  FASTBOOT_VAR **Link = &VarHash[FastbootVarHash (Var->name)];
+
+  for (; *Link; Link = &(*Link)->hash_next) {
+    if (*Link == Var) {
+      *Link = Var->hash_next;
+      return;
+    }
+  }
+}
+
+/* Latest published variable of that name, NULL if there is none */
+STATIC FASTBOOT_VAR *
+FastbootFindVar (IN CONST CHAR8 *Name)
+{
+  FASTBOOT_VAR *Var;
+
+  for (Var = VarHash[FastbootVarHash (Name)]; Var; Var = Var->hash_next) {
+    if (!AsciiStrCmp (Var->name, Name)) {
+      return Var;
+    }
+  }
+
+  return NULL;
+}
+
+/* Value of a variable, NULL for partition info that couldn't be read */
+STATIC CONST CHAR8 *
+FastbootVarValue (IN FASTBOOT_VAR *Var)
+{
+  if (!Var->part_info) {
+    return Var->value;
+  }
+
+  RefreshGetVarPartitionInfo (Var->part_info);
+  if (Var->value[0] == '\0') {
+    return NULL;
+  }
+
+  return Var->value;
+}
+
+STATIC VOID
+FastbootPublishVarInfo (IN CONST CHAR8 *Name,
+                        IN CONST CHAR8 *Value,
+                        IN struct GetVarPartitionInfo *PartInfo)
 {
   FASTBOOT_VAR *Var;
+  UINT32 Bucket;
+
   Var = AllocateZeroPool (sizeof (*Var));
   if (Var) {
     Var->next = Varlist;
     Varlist = Var;
     Var->name = Name;
     Var->value = Value;
+    Var->part_info = PartInfo;
+
+    Bucket = FastbootVarHash (Name);
+    Var->hash_next = VarHash[Bucket];
+    VarHash[Bucket] = Var;
   } else {
     DEBUG ((EFI_D_VERBOSE,
             "Failed to publish a variable readable(%a): malloc error!\n",
@@ -325,6 +468,15 @@ FastbootPublishVar (IN CONST CHAR8 *Name, IN CONST CHAR8 *Value)
   }
 }
 
+/* Publish a variable readable by the built-in getvar command
+ * These Variables must not be temporary, shallow copies are used.
+ */
+STATIC VOID
+FastbootPublishVar (IN CONST CHAR8 *Name, IN CONST CHAR8 *Value)
+{
+  FastbootPublishVarInfo (Name, Value, NULL);
+}
+
 /* Returns the Remaining amount of bytes expected
  * This lets us bypass ZLT issues
  */
@@ -686,16 +838,145 @@ HandleChunkTypeRaw (sparse_header_t *sparse_header,
   return EFI_SUCCESS;
 }
 
+/* Write a run of fill pattern, reusing the pattern buffer for each write */
+STATIC EFI_STATUS
+WriteFillPattern (SparseImgParam *SparseImgData,
+                  UINT64 Offset,
+                  UINT64 Size)
+{
+  EFI_STATUS Status;
+  UINT64 WriteSize;
+
+  while (Size) {
+    WriteSize = MIN (Size, FillBufSize);
+    Status = WriteToDisk (SparseImgData->BlockIo, SparseImgData->Handle,
+                          (VOID *)FillBuf, WriteSize,
+                          Offset / SparseImgData->BlockIo->Media->BlockSize);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    Offset += WriteSize;
+    Size -= WriteSize;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/* Zero a range with a storage erase instead of writing zeros.
+ * The first erase is read back to learn whether erased blocks read as
+ * zero on this storage, if not zeros are written as before.
+ */
+STATIC EFI_STATUS
+EraseFillZero (SparseImgParam *SparseImgData,
+               UINT64 Offset,
+               UINT64 Size,
+               BOOLEAN *Erased)
+{
+  EFI_STATUS Status;
+  EFI_ERASE_BLOCK_PROTOCOL *EraseProt = NULL;
+  EFI_ERASE_BLOCK_TOKEN EraseToken;
+  EFI_BLOCK_IO_PROTOCOL *BlockIo = SparseImgData->BlockIo;
+  UINT64 Granularity;
+  UINT64 EraseStart;
+  UINT64 EraseEnd;
+  UINTN TokenIndex;
+  UINT8 *ReadBuf;
+  UINT32 Index;
+
+  *Erased = FALSE;
+
+  if (EraseReadsZero == FALSE ||
+      CheckRootDeviceType () == NAND) {
+    return EFI_SUCCESS;
+  }
+
+  Status = gBS->HandleProtocol (SparseImgData->Handle,
+                                &gEfiEraseBlockProtocolGuid,
+                                (VOID **)&EraseProt);
+  if (Status != EFI_SUCCESS ||
+      !EraseProt) {
+    return EFI_SUCCESS;
+  }
+
+  Granularity = MAX (EraseProt->EraseLengthGranularity,
+                     BlockIo->Media->BlockSize);
+  EraseStart = ((Offset + Granularity - 1) / Granularity) * Granularity;
+  EraseEnd = ((Offset + Size) / Granularity) * Granularity;
+  if ((EraseEnd <= EraseStart) ||
+      (EraseEnd - EraseStart) < MAX_FILL_BUFFER_SIZE) {
+    return EFI_SUCCESS;
+  }
+
+  gBS->SetMem ((VOID *)&EraseToken, sizeof (EraseToken), 0);
+  Status = EraseProt->EraseBlocks (BlockIo, BlockIo->Media->MediaId,
+                                   EraseStart / BlockIo->Media->BlockSize,
+                                   &EraseToken, EraseEnd - EraseStart);
+  if (Status == EFI_SUCCESS &&
+      EraseToken.Event != NULL) {
+    gBS->WaitForEvent (1, &EraseToken.Event, &TokenIndex);
+    Status = EraseToken.TransactionStatus;
+  }
+
+  if (Status != EFI_SUCCESS) {
+    /* Not fatal, the range is written with zeros instead */
+    DEBUG ((EFI_D_VERBOSE, "Erase for FILL chunk failed: %r\n", Status));
+    EraseReadsZero = FALSE;
+    return EFI_SUCCESS;
+  }
+
+  if (EraseReadsZero == ZERO_ERASE_UNKNOWN) {
+    ReadBuf = AllocatePool (BlockIo->Media->BlockSize);
+    if (!ReadBuf) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    Status = BlockIo->ReadBlocks (BlockIo, BlockIo->Media->MediaId,
+                                  EraseStart / BlockIo->Media->BlockSize,
+                                  BlockIo->Media->BlockSize, ReadBuf);
+    EraseReadsZero = (Status == EFI_SUCCESS);
+    for (Index = 0; EraseReadsZero && Index < BlockIo->Media->BlockSize;
+         Index++) {
+      if (ReadBuf[Index]) {
+        EraseReadsZero = FALSE;
+      }
+    }
+    FreePool (ReadBuf);
+    ReadBuf = NULL;
+
+    DEBUG ((EFI_D_VERBOSE, "Erased blocks read as zero: %a\n",
+            EraseReadsZero ? "yes" : "no"));
+    if (!EraseReadsZero) {
+      return EFI_SUCCESS;
+    }
+  }
+
+  Status = WriteFillPattern (SparseImgData, Offset, EraseStart - Offset);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = WriteFillPattern (SparseImgData, EraseEnd,
+                             Offset + Size - EraseEnd);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  *Erased = TRUE;
+  return EFI_SUCCESS;
+}
+
 STATIC EFI_STATUS
 HandleChunkTypeFill (sparse_header_t *sparse_header,
         chunk_header_t *chunk_header,
         VOID **Image,
         SparseImgParam *SparseImgData)
 {
-  UINT32 *FillBuf = NULL;
   UINT32 FillVal;
   EFI_STATUS Status = EFI_SUCCESS;
-  UINT32 Temp;
+  UINT64 Temp;
+  UINT64 Offset;
+  BOOLEAN Erased = FALSE;
 
   if (sparse_header == NULL ||
       chunk_header == NULL ||
@@ -711,70 +992,88 @@ HandleChunkTypeFill (sparse_header_t *sparse_header,
     return EFI_INVALID_PARAMETER;
   }
 
-  FillBuf = AllocateZeroPool (sparse_header->blk_sz);
-  if (!FillBuf) {
-    DEBUG ((EFI_D_ERROR, "Malloc failed for: CHUNK_TYPE_FILL\n"));
-    return EFI_OUT_OF_RESOURCES;
-  }
-
   if (CHECK_ADD64 ((UINT64)*Image, sizeof (UINT32))) {
     DEBUG ((EFI_D_ERROR,
               "Integer overflow while adding Image and uint32\n"));
-    Status = EFI_INVALID_PARAMETER;
-    goto out;
+    return EFI_INVALID_PARAMETER;
   }
 
   if (SparseImgData->ImageEnd < (UINT64)*Image + sizeof (UINT32)) {
     DEBUG ((EFI_D_ERROR,
             "Buffer overread occured due to invalid sparse header\n"));
-   Status = EFI_INVALID_PARAMETER;
-   goto out;
+    return EFI_INVALID_PARAMETER;
   }
 
   FillVal = *(UINT32 *)*Image;
   *Image = (CHAR8 *)*Image + sizeof (UINT32);
 
-  for (Temp = 0;
-       Temp < (sparse_header->blk_sz / sizeof (FillVal));
-       Temp++) {
-    FillBuf[Temp] = FillVal;
-  }
-
-  for (Temp = 0; Temp < chunk_header->chunk_sz; Temp++) {
-    /* Make sure the data does not exceed the partition size */
-    if ((UINT64)SparseImgData->TotalBlocks *
-         (UINT64)sparse_header->blk_sz +
-         sparse_header->blk_sz >
-         SparseImgData->PartitionSize) {
-      DEBUG ((EFI_D_ERROR, "Chunk data size for fill type "
-                            "exceeds partition size\n"));
-      Status = EFI_VOLUME_FULL;
-      goto out;
+  /* Make sure the data does not exceed the partition size */
+  Offset = (UINT64)SparseImgData->TotalBlocks * (UINT64)sparse_header->blk_sz;
+  if (Offset + SparseImgData->ChunkDataSz > SparseImgData->PartitionSize) {
+    DEBUG ((EFI_D_ERROR, "Chunk data size for fill type "
+                          "exceeds partition size\n"));
+    return EFI_VOLUME_FULL;
+  }
+
+  if (SparseImgData->TotalBlocks >
+       (MAX_UINT32 - chunk_header->chunk_sz)) {
+    DEBUG ((EFI_D_ERROR, "Bogus size for FILL chunk Type\n"));
+    return EFI_INVALID_PARAMETER;
+  }
+
+  /* The pattern buffer is kept across chunks and images, so it only has
+   * to be allocated once and refilled when the fill value changes.
+   */
+  if (!FillBuf) {
+    FillBuf = AllocatePool (MAX_FILL_BUFFER_SIZE);
+    if (!FillBuf) {
+      DEBUG ((EFI_D_ERROR, "Malloc failed for: CHUNK_TYPE_FILL\n"));
+      return EFI_OUT_OF_RESOURCES;
+    }
+    FillBufValid = FALSE;
+  }
+
+  if (!FillBufValid ||
+      FillBufVal != FillVal) {
+    for (Temp = 0; Temp < (MAX_FILL_BUFFER_SIZE / sizeof (FillVal)); Temp++) {
+      FillBuf[Temp] = FillVal;
     }
+    FillBufVal = FillVal;
+    FillBufValid = TRUE;
+  }
+
+  /* Write whole sparse blocks per Block I/O request */
+  FillBufSize = (MAX_FILL_BUFFER_SIZE / sparse_header->blk_sz) *
+                sparse_header->blk_sz;
+  if (!FillBufSize) {
+    DEBUG ((EFI_D_ERROR, "Unsupported sparse block size %x\n",
+            sparse_header->blk_sz));
+    return EFI_INVALID_PARAMETER;
+  }
 
-    SparseImgData->WrittenBlockCount =
-      SparseImgData->TotalBlocks *
-        SparseImgData->BlockCountFactor;
-    Status = WriteToDisk (SparseImgData->BlockIo,
-                          SparseImgData->Handle,
-                          (VOID *)FillBuf,
-                          sparse_header->blk_sz,
-                          SparseImgData->WrittenBlockCount);
+  if (!FillVal) {
+    Status = EraseFillZero (SparseImgData, Offset,
+                            SparseImgData->ChunkDataSz, &Erased);
     if (EFI_ERROR (Status)) {
       DEBUG ((EFI_D_ERROR, "Flash write failure for FILL Chunk\n"));
-
-    goto out;
+      return Status;
     }
-
-    SparseImgData->TotalBlocks++;
   }
 
-  out:
-    if (FillBuf) {
-    FreePool (FillBuf);
-    FillBuf = NULL;
+  if (!Erased) {
+    Status = WriteFillPattern (SparseImgData, Offset,
+                               SparseImgData->ChunkDataSz);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((EFI_D_ERROR, "Flash write failure for FILL Chunk\n"));
+      return Status;
     }
-    return Status;
+  }
+
+  SparseImgData->TotalBlocks += chunk_header->chunk_sz;
+  SparseImgData->WrittenBlockCount =
+    SparseImgData->TotalBlocks * SparseImgData->BlockCountFactor;
+
+  return Status;
 }
 
 STATIC EFI_STATUS
@@ -1201,6 +1500,149 @@ HandleUbiImgFlash (
   return Status;
 }
 
+/* Sub-images of a meta image usually go to different partitions, often on
+ * different UFS LUNs. Each LUN gets one worker that writes its images in
+ * order, so every LUN sees at most one outstanding write while the LUNs
+ * are written in parallel. Images that touch the slot attributes in the
+ * GPT ("boot") are written by the caller once the workers are done.
+ */
+typedef struct MetaImgFlashJob {
+  CHAR16 PartitionName[MAX_GPT_NAME_SIZE];
+  VOID *Image;
+  UINT64 Size;
+  UINT32 Lun;
+  BOOLEAN Serial;
+  EFI_STATUS Status;
+} MetaImgFlashJob;
+
+typedef struct MetaImgFlashWorker {
+  MetaImgFlashJob *Jobs;
+  UINT32 NumJobs;
+  UINT32 Lun;
+} MetaImgFlashWorker;
+
+STATIC VOID
+MetaImgFlashLun (MetaImgFlashWorker *Worker)
+{
+  UINT32 i;
+  MetaImgFlashJob *Job;
+
+  for (i = 0; i < Worker->NumJobs; i++) {
+    Job = &Worker->Jobs[i];
+    if (Job->Serial ||
+        Job->Lun != Worker->Lun) {
+      continue;
+    }
+
+    Job->Status = HandleRawImgFlash (Job->PartitionName,
+                                     ARRAY_SIZE (Job->PartitionName),
+                                     Job->Image, Job->Size);
+  }
+}
+
+INT32 __attribute__ ( (no_sanitize ("safe-stack")))
+MetaImgFlashThread (VOID *Arg)
+{
+  Thread *CurrentThread = KernIntf->Thread->GetCurrentThread ();
+
+  MetaImgFlashLun ((MetaImgFlashWorker *)Arg);
+
+  ThreadStackNodeRemove (CurrentThread);
+  KernIntf->Thread->ThreadExit (0);
+
+  return 0;
+}
+
+STATIC UINT32
+GetPartitionLunByName (CONST CHAR16 *PartitionName)
+{
+  CHAR16 Pname[MAX_GPT_NAME_SIZE];
+  CHAR16 SlotSuffix[MAX_SLOT_SUFFIX_SZ];
+  INT32 Index;
+
+  StrnCpyS (Pname, ARRAY_SIZE (Pname), PartitionName,
+            StrLen (PartitionName));
+  if (PartitionHasMultiSlot ((CONST CHAR16 *)L"boot")) {
+    GetPartitionHasSlot (Pname, ARRAY_SIZE (Pname), SlotSuffix,
+                         MAX_SLOT_SUFFIX_SZ);
+  }
+
+  Index = GetPartitionIndex (Pname);
+  if (Index == INVALID_PTN ||
+      GetPartitionLunFromIndex (Index) >= MAX_LUNS) {
+    return 0;
+  }
+  return GetPartitionLunFromIndex (Index);
+}
+
+STATIC VOID
+MetaImgFlashJobs (MetaImgFlashJob *Jobs, UINT32 NumJobs)
+{
+  MetaImgFlashWorker Workers[MAX_LUNS];
+  Thread *Threads[MAX_LUNS] = {NULL};
+  BOOLEAN LunUsed[MAX_LUNS] = {FALSE};
+  UINT32 NumLuns = 0;
+  UINT32 Lun;
+  UINT32 i;
+  INT32 RetCode;
+
+  for (i = 0; i < NumJobs; i++) {
+    if (!Jobs[i].Serial &&
+        !LunUsed[Jobs[i].Lun]) {
+      LunUsed[Jobs[i].Lun] = TRUE;
+      NumLuns++;
+    }
+  }
+
+  for (Lun = 0; Lun < MAX_LUNS; Lun++) {
+    Workers[Lun].Jobs = Jobs;
+    Workers[Lun].NumJobs = NumJobs;
+    Workers[Lun].Lun = Lun;
+
+    if (!LunUsed[Lun] ||
+        NumLuns < 2 ||
+        !IsUseMThreadParallel ()) {
+      continue;
+    }
+
+    Threads[Lun] = KernIntf->Thread->ThreadCreate ("MetaImgFlashThread",
+                       MetaImgFlashThread, (VOID *)&Workers[Lun],
+                       UEFI_THREAD_PRIORITY, DEFAULT_STACK_SIZE);
+    if (Threads[Lun] == NULL) {
+      continue;
+    }
+
+    AllocateUnSafeStackPtr (Threads[Lun]);
+
+    if (KernIntf->Thread->ThreadResume (Threads[Lun]) != 0) {
+      ThreadStackNodeRemove (Threads[Lun]);
+      Threads[Lun] = NULL;
+    }
+  }
+
+  /* LUNs without a worker thread are flashed here */
+  for (Lun = 0; Lun < MAX_LUNS; Lun++) {
+    if (LunUsed[Lun] &&
+        Threads[Lun] == NULL) {
+      MetaImgFlashLun (&Workers[Lun]);
+    }
+  }
+
+  for (Lun = 0; Lun < MAX_LUNS; Lun++) {
+    if (Threads[Lun]) {
+      KernIntf->Thread->ThreadJoin (Threads[Lun], &RetCode, INFINITE_TIME);
+    }
+  }
+
+  for (i = 0; i < NumJobs; i++) {
+    if (Jobs[i].Serial) {
+      Jobs[i].Status = HandleRawImgFlash (Jobs[i].PartitionName,
+                                          ARRAY_SIZE (Jobs[i].PartitionName),
+                                          Jobs[i].Image, Jobs[i].Size);
+    }
+  }
+}
+
 /* Meta Image flashing */
 STATIC
 EFI_STATUS
@@ -1218,6 +1660,8 @@ HandleMetaImgFlash (IN CHAR16 *PartitionName,
   UINT64 ImageEnd = 0;
   BOOLEAN PnameTerminated = FALSE;
   UINT32 j;
+  MetaImgFlashJob *Jobs = NULL;
+  UINT32 NumJobs = 0;
 
   if (Size < sizeof (meta_header_t)) {
     DEBUG ((EFI_D_ERROR,
@@ -1250,6 +1694,13 @@ HandleMetaImgFlash (IN CHAR16 *PartitionName,
   }
   ImageEnd = (UINT64)Image + Size;
 
+  Jobs = AllocateZeroPool (sizeof (*Jobs) * MAX_IMAGES_IN_METAIMG);
+  if (Jobs == NULL) {
+    DEBUG ((EFI_D_ERROR, "Failed to allocate meta image flash jobs\n"));
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  /* Validate every entry before the first write */
   for (i = 0; i < images; i++) {
     PnameTerminated = FALSE;
 
@@ -1260,18 +1711,21 @@ HandleMetaImgFlash (IN CHAR16 *PartitionName,
     if (CHECK_ADD64 ((UINT64)Image, img_header_entry[i].start_offset)) {
       DEBUG ((EFI_D_ERROR, "Integer overflow detected in %d, %a\n", __LINE__,
               __FUNCTION__));
-      return EFI_BAD_BUFFER_SIZE;
+      Status = EFI_BAD_BUFFER_SIZE;
+      goto out;
     }
     if (CHECK_ADD64 ((UINT64) (Image + img_header_entry[i].start_offset),
                      img_header_entry[i].size)) {
       DEBUG ((EFI_D_ERROR, "Integer overflow detected in %d, %a\n", __LINE__,
               __FUNCTION__));
-      return EFI_BAD_BUFFER_SIZE;
+      Status = EFI_BAD_BUFFER_SIZE;
+      goto out;
     }
     if (ImageEnd < ((UINT64)Image + img_header_entry[i].start_offset +
                     img_header_entry[i].size)) {
       DEBUG ((EFI_D_ERROR, "Image size mismatch\n"));
-      return EFI_INVALID_PARAMETER;
+      Status = EFI_INVALID_PARAMETER;
+      goto out;
     }
 
     for (j = 0; j < MAX_GPT_NAME_SIZE; j++) {
@@ -1282,23 +1736,39 @@ HandleMetaImgFlash (IN CHAR16 *PartitionName,
     }
     if (!PnameTerminated) {
       DEBUG ((EFI_D_ERROR, "ptn_name string not terminated properly\n"));
-      return EFI_INVALID_PARAMETER;
+      Status = EFI_INVALID_PARAMETER;
+      goto out;
     }
     AsciiStrToUnicodeStr (img_header_entry[i].ptn_name, PartitionNameFromMeta);
 
     if (!IsUnlockCritical () &&
         IsCriticalPartition (PartitionNameFromMeta)) {
       FastbootFail ("Flashing is not allowed for Critical Partitions\n");
-      return EFI_INVALID_PARAMETER;
+      Status = EFI_INVALID_PARAMETER;
+      goto out;
     }
 
-    Status = HandleRawImgFlash (
-        PartitionNameFromMeta, ARRAY_SIZE (PartitionNameFromMeta),
-        (void *)Image + img_header_entry[i].start_offset,
-        img_header_entry[i].size);
-    if (Status != EFI_SUCCESS) {
-      DEBUG ((EFI_D_ERROR, "Meta Image Write Failure\n"));
-      return Status;
+    StrnCpyS (Jobs[NumJobs].PartitionName,
+              ARRAY_SIZE (Jobs[NumJobs].PartitionName),
+              PartitionNameFromMeta, StrLen (PartitionNameFromMeta));
+    Jobs[NumJobs].Image = (VOID *)Image + img_header_entry[i].start_offset;
+    Jobs[NumJobs].Size = img_header_entry[i].size;
+    Jobs[NumJobs].Lun = GetPartitionLunByName (PartitionNameFromMeta);
+    Jobs[NumJobs].Serial =
+        !StrnCmp (PartitionNameFromMeta, (CONST CHAR16 *)L"boot",
+                  StrLen ((CONST CHAR16 *)L"boot"));
+    NumJobs++;
+  }
+
+  MetaImgFlashJobs (Jobs, NumJobs);
+
+  /* Report the first failing image in meta image order */
+  for (i = 0; i < NumJobs; i++) {
+    if (Jobs[i].Status != EFI_SUCCESS) {
+      DEBUG ((EFI_D_ERROR, "Meta Image Write Failure: %s: %r\n",
+              Jobs[i].PartitionName, Jobs[i].Status));
+      Status = Jobs[i].Status;
+      goto out;
     }
   }
 
@@ -1306,17 +1776,22 @@ HandleMetaImgFlash (IN CHAR16 *PartitionName,
   if (Status != EFI_SUCCESS) {
     DEBUG ((EFI_D_ERROR, "Unable to Update DevInfo\n"));
   }
+
+out:
+  FreePool (Jobs);
   return Status;
 }
 
 /* Erase partition */
 STATIC EFI_STATUS
-FastbootErasePartition (IN CHAR16 *PartitionName)
+FastbootErasePartition (IN CHAR16 *PartitionName, OUT UINT64 *ErasedSize)
 {
   EFI_STATUS Status;
   EFI_BLOCK_IO_PROTOCOL *BlockIo = NULL;
   EFI_HANDLE *Handle = NULL;
 
+  *ErasedSize = 0;
+
   Status = PartitionGetInfo (PartitionName, &BlockIo, &Handle);
   if (Status != EFI_SUCCESS)
     return Status;
@@ -1334,6 +1809,7 @@ FastbootErasePartition (IN CHAR16 *PartitionName)
     DEBUG ((EFI_D_ERROR, "Partition Erase failed: %r\n", Status));
     return Status;
   }
+  *ErasedSize = GetPartitionSize (BlockIo);
 
   if (!(StrCmp (L"userdata", PartitionName)))
     Status = ResetDeviceState ();
@@ -1341,26 +1817,154 @@ FastbootErasePartition (IN CHAR16 *PartitionName)
   return Status;
 }
 
-INT32 __attribute__ ( (no_sanitize ("safe-stack")))
-SparseImgFlashThread (VOID* Arg)
-{
-  Thread* CurrentThread = KernIntf->Thread->GetCurrentThread ();
-  FlashInfo* ThreadFlashInfo = (FlashInfo*) Arg;
+/* Partitions of one erase list are erased by one worker per LUN, so the
+ * erase commands of different LUNs are in flight at the same time. Erases
+ * that also touch devinfo or the GPT ("userdata", "boot") run afterwards
+ * from the caller, like the serial meta image entries.
+ */
+typedef struct EraseJob {
+  CHAR8 Name[MAX_GPT_NAME_SIZE];
+  CHAR16 PartitionName[MAX_GPT_NAME_SIZE];
+  CHAR16 SlotSuffix[MAX_SLOT_SUFFIX_SZ];
+  BOOLEAN HasSlot;
+  UINT32 Lun;
+  BOOLEAN Serial;
+  UINT64 Size;
+  UINT64 TimeMs;
+  EFI_STATUS Status;
+} EraseJob;
 
-  if (!ThreadFlashInfo || !ThreadFlashInfo->FlashDataBuffer) {
-    return 0;
-  }
+typedef struct EraseWorker {
+  EraseJob *Jobs;
+  UINT32 NumJobs;
+  UINT32 Lun;
+} EraseWorker;
 
-  KernIntf->Lock->AcquireLock (LockFlash);
-  IsFlashComplete = FALSE;
-  FlashSplitNeeded = TRUE;
+STATIC VOID
+EraseJobRun (EraseJob *Job)
+{
+  UINT64 StartTime = GetTimerCountms ();
 
-  HandleSparseImgFlash (ThreadFlashInfo->PartitionName,
-          ThreadFlashInfo->PartitionSize,
-          ThreadFlashInfo->FlashDataBuffer,
-          ThreadFlashInfo->FlashNumDataBytes);
+  Job->Status = FastbootErasePartition (Job->PartitionName, &Job->Size);
+  Job->TimeMs = GetTimerCountms () - StartTime;
+}
 
-  FlashSplitNeeded = FALSE;
+STATIC VOID
+EraseLun (EraseWorker *Worker)
+{
+  UINT32 i;
+  EraseJob *Job;
+
+  for (i = 0; i < Worker->NumJobs; i++) {
+    Job = &Worker->Jobs[i];
+    if (Job->Serial ||
+        Job->Lun != Worker->Lun) {
+      continue;
+    }
+
+    EraseJobRun (Job);
+  }
+}
+
+INT32 __attribute__ ( (no_sanitize ("safe-stack")))
+EraseThread (VOID *Arg)
+{
+  Thread *CurrentThread = KernIntf->Thread->GetCurrentThread ();
+
+  EraseLun ((EraseWorker *)Arg);
+
+  ThreadStackNodeRemove (CurrentThread);
+  KernIntf->Thread->ThreadExit (0);
+
+  return 0;
+}
+
+STATIC VOID
+EraseJobs (EraseJob *Jobs, UINT32 NumJobs)
+{
+  EraseWorker Workers[MAX_LUNS];
+  Thread *Threads[MAX_LUNS] = {NULL};
+  BOOLEAN LunUsed[MAX_LUNS] = {FALSE};
+  UINT32 NumLuns = 0;
+  UINT32 Lun;
+  UINT32 i;
+  INT32 RetCode;
+
+  for (i = 0; i < NumJobs; i++) {
+    if (!Jobs[i].Serial &&
+        !LunUsed[Jobs[i].Lun]) {
+      LunUsed[Jobs[i].Lun] = TRUE;
+      NumLuns++;
+    }
+  }
+
+  for (Lun = 0; Lun < MAX_LUNS; Lun++) {
+    Workers[Lun].Jobs = Jobs;
+    Workers[Lun].NumJobs = NumJobs;
+    Workers[Lun].Lun = Lun;
+
+    if (!LunUsed[Lun] ||
+        NumLuns < 2 ||
+        !IsUseMThreadParallel ()) {
+      continue;
+    }
+
+    Threads[Lun] = KernIntf->Thread->ThreadCreate ("EraseThread",
+                       EraseThread, (VOID *)&Workers[Lun],
+                       UEFI_THREAD_PRIORITY, DEFAULT_STACK_SIZE);
+    if (Threads[Lun] == NULL) {
+      continue;
+    }
+
+    AllocateUnSafeStackPtr (Threads[Lun]);
+
+    if (KernIntf->Thread->ThreadResume (Threads[Lun]) != 0) {
+      ThreadStackNodeRemove (Threads[Lun]);
+      Threads[Lun] = NULL;
+    }
+  }
+
+  /* LUNs without a worker thread are erased here */
+  for (Lun = 0; Lun < MAX_LUNS; Lun++) {
+    if (LunUsed[Lun] &&
+        Threads[Lun] == NULL) {
+      EraseLun (&Workers[Lun]);
+    }
+  }
+
+  for (Lun = 0; Lun < MAX_LUNS; Lun++) {
+    if (Threads[Lun]) {
+      KernIntf->Thread->ThreadJoin (Threads[Lun], &RetCode, INFINITE_TIME);
+    }
+  }
+
+  for (i = 0; i < NumJobs; i++) {
+    if (Jobs[i].Serial) {
+      EraseJobRun (&Jobs[i]);
+    }
+  }
+}
+
+INT32 __attribute__ ( (no_sanitize ("safe-stack")))
+SparseImgFlashThread (VOID* Arg)
+{
+  Thread* CurrentThread = KernIntf->Thread->GetCurrentThread ();
+  FlashInfo* ThreadFlashInfo = (FlashInfo*) Arg;
+
+  if (!ThreadFlashInfo || !ThreadFlashInfo->FlashDataBuffer) {
+    return 0;
+  }
+
+  KernIntf->Lock->AcquireLock (LockFlash);
+  IsFlashComplete = FALSE;
+  FlashSplitNeeded = TRUE;
+
+  HandleSparseImgFlash (ThreadFlashInfo->PartitionName,
+          ThreadFlashInfo->PartitionSize,
+          ThreadFlashInfo->FlashDataBuffer,
+          ThreadFlashInfo->FlashNumDataBytes);
+
+  FlashSplitNeeded = FALSE;
   IsFlashComplete = TRUE;
   KernIntf->Lock->ReleaseLock (LockFlash);
 
@@ -1393,6 +1997,612 @@ EFI_STATUS CreateSparseImgFlashThread (IN FlashInfo* ThreadFlashInfo)
   return Status;
 }
 
+/* Flash every queued slot in order, the slot is handed back to usb once
+ * its image is on the disk. A failure is reported on the next flash or
+ * download command like the other deferred flash results.
+ */
+STATIC VOID
+FlashRingDrain (VOID)
+{
+  FlashRingSlot *Slot;
+  EFI_STATUS Status;
+
+  while (TRUE) {
+    KernIntf->Lock->AcquireLock (LockRing);
+    if (!FlashRingPending) {
+      FlashRingWorkerRunning = FALSE;
+      IsFlashComplete = TRUE;
+      KernIntf->Lock->ReleaseLock (LockRing);
+      break;
+    }
+    Slot = &FlashRing[FlashRingHead];
+    KernIntf->Lock->ReleaseLock (LockRing);
+
+    KernIntf->Lock->AcquireLock (LockFlash);
+    FlashSplitNeeded = TRUE;
+    if (Slot->Sparse) {
+      Status = HandleSparseImgFlash (Slot->PartitionName,
+                                     ARRAY_SIZE (Slot->PartitionName),
+                                     Slot->Buffer, Slot->NumDataBytes);
+    } else {
+      Status = HandleRawImgFlash (Slot->PartitionName,
+                                  ARRAY_SIZE (Slot->PartitionName),
+                                  Slot->Buffer, Slot->NumDataBytes);
+    }
+    FlashSplitNeeded = FALSE;
+    KernIntf->Lock->ReleaseLock (LockFlash);
+
+    if (EFI_ERROR (Status)) {
+      DEBUG ((EFI_D_ERROR, "Flashing queued %s failed: %r\n",
+              Slot->PartitionName, Status));
+      if (FlashResult == EFI_SUCCESS) {
+        FlashResult = Status;
+      }
+    }
+
+    KernIntf->Lock->AcquireLock (LockRing);
+    FlashRingHead = (FlashRingHead + 1) % FlashRingDepth;
+    FlashRingPending--;
+    KernIntf->Lock->ReleaseLock (LockRing);
+  }
+}
+
+INT32 __attribute__ ( (no_sanitize ("safe-stack")))
+FlashRingThread (VOID *Arg)
+{
+  Thread *CurrentThread = KernIntf->Thread->GetCurrentThread ();
+
+  FlashRingDrain ();
+
+  ThreadStackNodeRemove (CurrentThread);
+  KernIntf->Thread->ThreadExit (0);
+
+  return 0;
+}
+
+STATIC EFI_STATUS
+CreateFlashRingThread (VOID)
+{
+  EFI_STATUS Status;
+  Thread *FlashRingTD = NULL;
+
+  FlashRingTD = KernIntf->Thread->ThreadCreate ("FlashRingThread",
+      FlashRingThread, NULL, UEFI_THREAD_PRIORITY, DEFAULT_STACK_SIZE);
+  if (FlashRingTD == NULL) {
+    return EFI_NOT_READY;
+  }
+
+  AllocateUnSafeStackPtr (FlashRingTD);
+
+  Status = KernIntf->Thread->ThreadResume (FlashRingTD);
+  if (Status != EFI_SUCCESS) {
+    ThreadStackNodeRemove (FlashRingTD);
+  }
+
+  return Status;
+}
+
+/* Block until the slot usb fills next is no longer queued for flashing */
+STATIC VOID
+FlashRingWaitSlot (VOID)
+{
+  BOOLEAN Full;
+
+  while (TRUE) {
+    KernIntf->Lock->AcquireLock (LockRing);
+    Full = (FlashRingPending == FlashRingDepth);
+    KernIntf->Lock->ReleaseLock (LockRing);
+    if (!Full) {
+      break;
+    }
+
+    /* The worker holds LockFlash while an image is being written */
+    KernIntf->Lock->AcquireLock (LockFlash);
+    KernIntf->Lock->ReleaseLock (LockFlash);
+  }
+}
+
+/* Hand the just downloaded slot to the flash worker and move usb on to the
+ * next slot. The image is flashed inline if the worker can't be started.
+ */
+STATIC EFI_STATUS
+FlashRingQueue (CHAR16 *PartitionName, BOOLEAN Sparse)
+{
+  FlashRingSlot *Slot;
+  BOOLEAN StartWorker;
+  EFI_STATUS Status;
+
+  KernIntf->Lock->AcquireLock (LockRing);
+  Slot = &FlashRing[FlashRingUsb];
+  Slot->NumDataBytes = mFlashNumDataBytes;
+  Slot->Sparse = Sparse;
+  StrnCpyS (Slot->PartitionName, ARRAY_SIZE (Slot->PartitionName),
+            PartitionName, StrLen (PartitionName));
+
+  FlashRingPending++;
+  FlashRingUsb = (FlashRingUsb + 1) % FlashRingDepth;
+  mUsbDataBuffer = FlashRing[FlashRingUsb].Buffer;
+  IsFlashComplete = FALSE;
+
+  StartWorker = !FlashRingWorkerRunning;
+  FlashRingWorkerRunning = TRUE;
+  KernIntf->Lock->ReleaseLock (LockRing);
+
+  if (!StartWorker) {
+    return EFI_SUCCESS;
+  }
+
+  Status = CreateFlashRingThread ();
+  if (Status != EFI_SUCCESS) {
+    DEBUG ((EFI_D_ERROR, "Failed to start flash ring thread: %r\n", Status));
+    FlashRingDrain ();
+  }
+
+  return EFI_SUCCESS;
+}
+
+/* Streaming sparse image flashing.
+ * Once a partition is armed with "oem stream-flash <partition>", the one
+ * download that follows is parsed as a sparse image while it is received.
+ * The chunks that already arrived are written right after the next USB
+ * transfer is queued, so the storage writes overlap with the download and
+ * the "flash:" command only has to commit the tail of the image.
+ * Until that image is flashed only the commands completing it are accepted,
+ * see StreamFlashCmdAllowed.
+ */
+STATIC EFI_STATUS
+StreamFlashAllowed (CHAR16 *PartitionName)
+{
+  VirtualAbMergeStatus SnapshotMergeStatus;
+
+  if (CheckRootDeviceType () == NAND) {
+    return EFI_UNSUPPORTED;
+  }
+
+  if ((GetAVBVersion () == AVB_LE) ||
+      ((GetAVBVersion () != AVB_LE) &&
+      (TargetBuildVariantUser ()))) {
+    if (!IsUnlocked ()) {
+      return EFI_ACCESS_DENIED;
+    }
+
+    if (!IsUnlockCritical () && IsCriticalPartition (PartitionName)) {
+      return EFI_ACCESS_DENIED;
+    }
+  }
+
+  if (IsVirtualAbOtaSupported ()) {
+    if (CheckVirtualAbCriticalPartition (PartitionName)) {
+      return EFI_ACCESS_DENIED;
+    }
+
+    /* The snapshot merge must be cancelled before super is written,
+     * leave that to the regular flash path.
+     */
+    SnapshotMergeStatus = GetSnapshotMergeStatus ();
+    if (((SnapshotMergeStatus == MERGING) ||
+          (SnapshotMergeStatus == SNAPSHOTTED)) &&
+          !StrnCmp (PartitionName, L"super", StrLen (L"super"))) {
+      return EFI_UNSUPPORTED;
+    }
+  }
+
+  /* Partition tables, lun addressing and virtual partitions have their
+   * own flash handling
+   */
+  if (!StrnCmp (PartitionName, L"partition", StrLen (L"partition")) ||
+      !StrnCmp (PartitionName, L"avb_custom_key",
+                StrLen (L"avb_custom_key")) ||
+      StrStr (PartitionName, L":")) {
+    return EFI_UNSUPPORTED;
+  }
+
+  return EFI_SUCCESS;
+}
+
+STATIC VOID
+StreamFlashBegin (UINT8 *Base, UINT64 Size)
+{
+  EFI_STATUS Status;
+  SparseImgParam *SparseImgData = &StreamFlash.SparseImgData;
+
+  if (!StreamFlash.Armed) {
+    StreamFlash.State = StreamFlashIdle;
+    return;
+  }
+
+  /* The arm covers exactly this one download */
+  StreamFlash.Armed = FALSE;
+
+  gBS->SetMem ((VOID *)SparseImgData, sizeof (SparseImgParam), 0);
+  StreamFlash.Base = Base;
+  StreamFlash.Size = Size;
+  StreamFlash.Consumed = 0;
+  StreamFlash.ChunkDataLeft = 0;
+  StreamFlash.Status = EFI_SUCCESS;
+  StreamFlash.State = StreamFlashHeader;
+
+  /* Lock state or partition table may have changed since arming */
+  Status = StreamFlashAllowed (StreamFlash.PartitionName);
+  if (!EFI_ERROR (Status)) {
+    Status = PartitionGetInfo (StreamFlash.PartitionName,
+                               &SparseImgData->BlockIo,
+                               &SparseImgData->Handle);
+  }
+
+  if (!EFI_ERROR (Status) &&
+      (!SparseImgData->BlockIo || !SparseImgData->Handle)) {
+    Status = EFI_VOLUME_CORRUPTED;
+  }
+
+  if (!EFI_ERROR (Status)) {
+    SparseImgData->PartitionSize = GetPartitionSize (SparseImgData->BlockIo);
+    if (!SparseImgData->PartitionSize) {
+      Status = EFI_BAD_BUFFER_SIZE;
+    }
+  }
+
+  if (!EFI_ERROR (Status) &&
+      CHECK_ADD64 ((UINT64)Base, Size)) {
+    Status = EFI_BAD_BUFFER_SIZE;
+  }
+
+  if (EFI_ERROR (Status)) {
+    /* Let the flash command handle and report it */
+    DEBUG ((EFI_D_VERBOSE, "Stream flash of %s bypassed: %r\n",
+            StreamFlash.PartitionName, Status));
+    StreamFlash.State = StreamFlashBypass;
+    return;
+  }
+
+  SparseImgData->ImageEnd = (UINT64)Base + Size;
+}
+
+STATIC EFI_STATUS
+StreamFlashStartImage (VOID)
+{
+  sparse_header_t *SparseHeader = &StreamFlash.SparseHeader;
+  SparseImgParam *SparseImgData = &StreamFlash.SparseImgData;
+
+  gBS->CopyMem ((VOID *)SparseHeader, StreamFlash.Base,
+                sizeof (sparse_header_t));
+
+  if (SparseHeader->magic != SPARSE_HEADER_MAGIC) {
+    StreamFlash.State = StreamFlashBypass;
+    return EFI_SUCCESS;
+  }
+
+  if (((UINT64)SparseHeader->total_blks * (UINT64)SparseHeader->blk_sz) >
+      SparseImgData->PartitionSize) {
+    DEBUG ((EFI_D_ERROR, "Image is too large for the partition\n"));
+    return EFI_VOLUME_FULL;
+  }
+
+  if (SparseHeader->file_hdr_sz != sizeof (sparse_header_t)) {
+    DEBUG ((EFI_D_ERROR, "Sparse header size mismatch\n"));
+    return EFI_BAD_BUFFER_SIZE;
+  }
+
+  if (SparseHeader->chunk_hdr_sz != sizeof (chunk_header_t)) {
+    DEBUG ((EFI_D_ERROR, "chunk header size mismatch\n"));
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (!SparseHeader->blk_sz ||
+      (SparseHeader->blk_sz % SparseImgData->BlockIo->Media->BlockSize)) {
+    DEBUG ((EFI_D_ERROR, "Unsupported sparse block size %x\n",
+            SparseHeader->blk_sz));
+    return EFI_INVALID_PARAMETER;
+  }
+
+  SparseImgData->BlockCountFactor = SparseHeader->blk_sz /
+                                    SparseImgData->BlockIo->Media->BlockSize;
+
+  StreamFlash.Consumed = sizeof (sparse_header_t);
+  StreamFlash.State = StreamFlashChunkHeader;
+  return EFI_SUCCESS;
+}
+
+STATIC EFI_STATUS
+StreamFlashNextChunk (UINT64 Available)
+{
+  sparse_header_t *SparseHeader = &StreamFlash.SparseHeader;
+  chunk_header_t *ChunkHeader = &StreamFlash.ChunkHeader;
+  SparseImgParam *SparseImgData = &StreamFlash.SparseImgData;
+  UINT64 PayloadSz;
+  VOID *Image;
+  EFI_STATUS Status;
+
+  if (SparseImgData->Chunk >= SparseHeader->total_chunks) {
+    StreamFlash.State = StreamFlashDone;
+    return EFI_SUCCESS;
+  }
+
+  if (((UINT64)SparseImgData->TotalBlocks * (UINT64)SparseHeader->blk_sz) >=
+      SparseImgData->PartitionSize) {
+    DEBUG ((EFI_D_ERROR, "Size of image is too large for the partition\n"));
+    return EFI_VOLUME_FULL;
+  }
+
+  if ((Available - StreamFlash.Consumed) < sizeof (chunk_header_t)) {
+    return EFI_NOT_READY;
+  }
+
+  gBS->CopyMem ((VOID *)ChunkHeader, StreamFlash.Base + StreamFlash.Consumed,
+                sizeof (chunk_header_t));
+
+  SparseImgData->ChunkDataSz = (UINT64)SparseHeader->blk_sz *
+                               ChunkHeader->chunk_sz;
+  if ((UINT64)SparseImgData->TotalBlocks *
+      (UINT64)SparseHeader->blk_sz +
+      SparseImgData->ChunkDataSz >
+      SparseImgData->PartitionSize) {
+    DEBUG ((EFI_D_ERROR, "Chunk data size exceeds partition size\n"));
+    return EFI_VOLUME_FULL;
+  }
+
+  switch (ChunkHeader->chunk_type) {
+    case CHUNK_TYPE_RAW:
+      if ((UINT64)ChunkHeader->total_sz !=
+          ((UINT64)SparseHeader->chunk_hdr_sz + SparseImgData->ChunkDataSz)) {
+        DEBUG ((EFI_D_ERROR, "Bogus chunk size for chunk type Raw\n"));
+        return EFI_INVALID_PARAMETER;
+      }
+
+      if (SparseImgData->TotalBlocks >
+           (MAX_UINT32 - ChunkHeader->chunk_sz)) {
+        DEBUG ((EFI_D_ERROR, "Bogus size for RAW chunk Type\n"));
+        return EFI_INVALID_PARAMETER;
+      }
+
+      if ((StreamFlash.Size - StreamFlash.Consumed - sizeof (chunk_header_t)) <
+          SparseImgData->ChunkDataSz) {
+        DEBUG ((EFI_D_ERROR,
+                "buffer overreads occured due to invalid sparse header\n"));
+        return EFI_INVALID_PARAMETER;
+      }
+
+      StreamFlash.Consumed += sizeof (chunk_header_t);
+      StreamFlash.ChunkDataLeft = SparseImgData->ChunkDataSz;
+      SparseImgData->WrittenBlockCount =
+        SparseImgData->TotalBlocks * SparseImgData->BlockCountFactor;
+      StreamFlash.State = StreamFlashChunkData;
+      return EFI_SUCCESS;
+
+    case CHUNK_TYPE_FILL:
+      PayloadSz = sizeof (UINT32);
+      break;
+
+    case CHUNK_TYPE_CRC:
+      PayloadSz = SparseImgData->ChunkDataSz;
+      break;
+
+    default:
+      PayloadSz = 0;
+      break;
+  }
+
+  /* The other chunk types are handled in one go once their payload arrived */
+  if ((Available - StreamFlash.Consumed - sizeof (chunk_header_t)) <
+      PayloadSz) {
+    return EFI_NOT_READY;
+  }
+
+  Image = StreamFlash.Base + StreamFlash.Consumed + sizeof (chunk_header_t);
+  Status = ValidateChunkDataAndFlash (SparseHeader,
+                                      ChunkHeader,
+                                      &Image,
+                                      SparseImgData);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  StreamFlash.Consumed = (UINT8 *)Image - StreamFlash.Base;
+  SparseImgData->Chunk++;
+  return EFI_SUCCESS;
+}
+
+STATIC EFI_STATUS
+StreamFlashWriteChunkData (UINT64 Available)
+{
+  SparseImgParam *SparseImgData = &StreamFlash.SparseImgData;
+  UINT64 Ready;
+  EFI_STATUS Status;
+
+  Ready = Available - StreamFlash.Consumed;
+  if (Ready >= StreamFlash.ChunkDataLeft) {
+    Ready = StreamFlash.ChunkDataLeft;
+  } else {
+    /* Only commit whole sparse blocks and skip small writes while
+     * the rest of the chunk is still on its way
+     */
+    Ready -= Ready % StreamFlash.SparseHeader.blk_sz;
+    if (Ready < MAX_WRITE_SIZE) {
+      return EFI_NOT_READY;
+    }
+  }
+
+  Status = WriteToDisk (SparseImgData->BlockIo, SparseImgData->Handle,
+                        StreamFlash.Base + StreamFlash.Consumed,
+                        Ready,
+                        SparseImgData->WrittenBlockCount);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((EFI_D_ERROR, "Flash Write Failure\n"));
+    return Status;
+  }
+
+  SparseImgData->WrittenBlockCount +=
+    Ready / SparseImgData->BlockIo->Media->BlockSize;
+  StreamFlash.Consumed += Ready;
+  StreamFlash.ChunkDataLeft -= Ready;
+
+  if (!StreamFlash.ChunkDataLeft) {
+    SparseImgData->TotalBlocks += StreamFlash.ChunkHeader.chunk_sz;
+    SparseImgData->Chunk++;
+    StreamFlash.State = StreamFlashChunkHeader;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/* Commit everything of the streamed image that is available so far */
+STATIC VOID
+StreamFlashFeed (UINT64 Available)
+{
+  EFI_STATUS Status = EFI_SUCCESS;
+
+  /* Never write concurrently with a flash that is still in progress,
+   * the data is picked up on the next call.
+   */
+  if (!IsFlashComplete) {
+    return;
+  }
+
+  if (Available > StreamFlash.Size) {
+    Available = StreamFlash.Size;
+  }
+
+  while (!EFI_ERROR (Status)) {
+    switch (StreamFlash.State) {
+      case StreamFlashHeader:
+        if (Available < sizeof (sparse_header_t)) {
+          Status = EFI_NOT_READY;
+          break;
+        }
+        Status = StreamFlashStartImage ();
+        break;
+
+      case StreamFlashChunkHeader:
+        Status = StreamFlashNextChunk (Available);
+        break;
+
+      case StreamFlashChunkData:
+        Status = StreamFlashWriteChunkData (Available);
+        break;
+
+      default:
+        return;
+    }
+  }
+
+  if (Status != EFI_NOT_READY) {
+    DEBUG ((EFI_D_ERROR, "Stream flash of %s failed: %r\n",
+            StreamFlash.PartitionName, Status));
+    StreamFlash.Status = Status;
+    StreamFlash.State = StreamFlashError;
+  }
+}
+
+/* Finish the streamed flash of the downloaded image.
+ * Returns EFI_UNSUPPORTED if the image has to go through the regular
+ * flash path instead.
+ */
+STATIC EFI_STATUS
+StreamFlashComplete (CHAR16 *PartitionName)
+{
+  CHAR16 FlashPartName[MAX_GPT_NAME_SIZE];
+  CHAR16 SlotSuffix[MAX_SLOT_SUFFIX_SZ];
+  SparseImgParam *SparseImgData = &StreamFlash.SparseImgData;
+  StreamFlashState State = StreamFlash.State;
+
+  if ((State == StreamFlashIdle) ||
+      (State == StreamFlashBypass)) {
+    StreamFlash.State = StreamFlashIdle;
+    return EFI_UNSUPPORTED;
+  }
+
+  StrnCpyS (FlashPartName, ARRAY_SIZE (FlashPartName), PartitionName,
+            StrLen (PartitionName));
+  if (PartitionHasMultiSlot ((CONST CHAR16 *)L"boot")) {
+    GetPartitionHasSlot (FlashPartName, ARRAY_SIZE (FlashPartName),
+                         SlotSuffix, MAX_SLOT_SUFFIX_SZ);
+  }
+
+  if (StrCmp (FlashPartName, StreamFlash.PartitionName)) {
+    StreamFlash.State = StreamFlashIdle;
+    if (State == StreamFlashHeader) {
+      /* Nothing has been written yet */
+      return EFI_UNSUPPORTED;
+    }
+
+    DEBUG ((EFI_D_ERROR, "Image was streamed to %s, not to %s\n",
+            StreamFlash.PartitionName, FlashPartName));
+    return EFI_ABORTED;
+  }
+
+  StreamFlashFeed (StreamFlash.Size);
+  State = StreamFlash.State;
+  StreamFlash.State = StreamFlashIdle;
+
+  if (State == StreamFlashBypass) {
+    return EFI_UNSUPPORTED;
+  } else if (State == StreamFlashError) {
+    return StreamFlash.Status;
+  } else if (State != StreamFlashDone) {
+    DEBUG ((EFI_D_ERROR, "Sparse image is truncated\n"));
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  DEBUG ((EFI_D_INFO, "Wrote %d blocks, expected to write %d blocks\n",
+          SparseImgData->TotalBlocks, StreamFlash.SparseHeader.total_blks));
+
+  if (SparseImgData->TotalBlocks != StreamFlash.SparseHeader.total_blks) {
+    DEBUG ((EFI_D_ERROR, "Sparse Image Write Failure\n"));
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/* While a partition is armed or its streamed image waits for "flash:",
+ * only getvar, the one download and the flash of the armed partition are
+ * accepted. Any other command drops the stream and fails, so data is never
+ * streamed into a partition that the host does not flash right after.
+ */
+STATIC BOOLEAN
+StreamFlashCmdAllowed (CONST CHAR8 *Cmd)
+{
+  CHAR16 PartitionName[MAX_GPT_NAME_SIZE];
+  CHAR16 SlotSuffix[MAX_SLOT_SUFFIX_SZ];
+  CONST CHAR8 *Arg;
+
+  if (!StreamFlash.Armed &&
+      (StreamFlash.State == StreamFlashIdle)) {
+    return TRUE;
+  }
+
+  if (!AsciiStrnCmp (Cmd, "getvar:", AsciiStrLen ("getvar:")) ||
+      !AsciiStrnCmp (Cmd, "oem stream-flash",
+                     AsciiStrLen ("oem stream-flash"))) {
+    return TRUE;
+  }
+
+  if (StreamFlash.Armed) {
+    if (!AsciiStrnCmp (Cmd, "download:", AsciiStrLen ("download:"))) {
+      return TRUE;
+    }
+  } else if (!AsciiStrnCmp (Cmd, "flash:", AsciiStrLen ("flash:"))) {
+    Arg = Cmd + AsciiStrLen ("flash:");
+    if (AsciiStrLen (Arg) < MAX_GPT_NAME_SIZE) {
+      AsciiStrToUnicodeStr (Arg, PartitionName);
+      if (PartitionHasMultiSlot ((CONST CHAR16 *)L"boot")) {
+        GetPartitionHasSlot (PartitionName, ARRAY_SIZE (PartitionName),
+                             SlotSuffix, MAX_SLOT_SUFFIX_SZ);
+      }
+
+      if (!StrCmp (PartitionName, StreamFlash.PartitionName)) {
+        return TRUE;
+      }
+    }
+  }
+
+  DEBUG ((EFI_D_ERROR, "Stream flash of %s dropped by: %a\n",
+          StreamFlash.PartitionName, Cmd));
+  StreamFlash.Armed = FALSE;
+  StreamFlash.State = StreamFlashIdle;
+  return FALSE;
+}
+
 #endif
 
 /* Handle Download Command */
@@ -1439,12 +2649,19 @@ CmdDownload (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
   gBS->CopyMem (GetFastbootDeviceData ()->gTxBuffer, Response,
                 sizeof (Response));
 
+  if (FlashRingDepth) {
+    FlashRingWaitSlot ();
+  }
+
   if (IsUseMThreadParallel ()) {
     KernIntf->Lock->AcquireLock (LockDownload);
   }
 
   mState = ExpectDataState;
   mBytesReceivedSoFar = 0;
+#ifdef ENABLE_UPDATE_PARTITIONS_CMDS
+  StreamFlashBegin (mUsbDataBuffer, mNumDataBytes);
+#endif
   GetFastbootDeviceData ()->UsbDeviceProtocol->Send (
       ENDPOINT_OUT, sizeof (Response), GetFastbootDeviceData ()->gTxBuffer);
   DEBUG ((EFI_D_VERBOSE, "CmdDownload: Send 12 %a\n",
@@ -1540,6 +2757,7 @@ STATIC VOID ClearFastbootVarsofAB (VOID)
     else
       PrevList->next = CurrentList->next;
 
+    FastbootVarUnhash (CurrentList);
     FreePool (CurrentList);
     CurrentList = NULL;
   }
@@ -1633,6 +2851,163 @@ STATIC VOID ExchangeFlashAndUsbDataBuf (VOID)
   }
 }
 
+/* Inflate a compressed payload and point the flash buffer at the image.
+ * Downloads without the compressed image header are left untouched.
+ */
+STATIC EFI_STATUS
+InflateFlashData (BOOLEAN *Inflated)
+{
+  CompressedImgHeader *Hdr = (CompressedImgHeader *)mFlashDataBuffer;
+  UINT8 *Payload;
+  UINT64 PayloadSize;
+  UINT64 BufferSize;
+  UINT32 OutLen = 0;
+
+  *Inflated = FALSE;
+  if (mFlashNumDataBytes < sizeof (*Hdr) ||
+      CompareMem (Hdr->Magic, COMPRESSED_IMG_MAGIC,
+                  COMPRESSED_IMG_MAGIC_SIZE)) {
+    return EFI_SUCCESS;
+  }
+
+  /* A threaded flash of the previous image may still read InflateBuffer */
+  WaitForFlashFinished ();
+
+  Payload = mFlashDataBuffer + sizeof (*Hdr);
+  PayloadSize = mFlashNumDataBytes - sizeof (*Hdr);
+
+  if (!Hdr->ImageSize ||
+      Hdr->ImageSize > MaxDownLoadSize) {
+    DEBUG ((EFI_D_ERROR, "Compressed image size %lld is not supported\n",
+            Hdr->ImageSize));
+    return EFI_BAD_BUFFER_SIZE;
+  }
+
+  if (!is_gzip_package (Payload, PayloadSize) &&
+      !is_lz4_package (Payload, PayloadSize)) {
+    DEBUG ((EFI_D_ERROR, "Unknown compression of the flash payload\n"));
+    return EFI_UNSUPPORTED;
+  }
+
+  /* gunzip wants more room than the input even for incompressible data */
+  BufferSize = MAX (Hdr->ImageSize, PayloadSize + 1);
+  BufferSize = LOCAL_ROUND_TO_PAGE (BufferSize, EFI_PAGE_SIZE);
+  if (InflateBufferSize < BufferSize) {
+    if (InflateBuffer) {
+      FreePages (InflateBuffer, EFI_SIZE_TO_PAGES (InflateBufferSize));
+    }
+    InflateBufferSize = 0;
+    InflateBuffer = AllocatePages (EFI_SIZE_TO_PAGES (BufferSize));
+    if (!InflateBuffer) {
+      DEBUG ((EFI_D_ERROR, "Failed to allocate %lld bytes to inflate\n",
+              BufferSize));
+      return EFI_OUT_OF_RESOURCES;
+    }
+    InflateBufferSize = BufferSize;
+  }
+
+  if (decompress (Payload, PayloadSize, InflateBuffer, InflateBufferSize,
+                  NULL, &OutLen) ||
+      OutLen != Hdr->ImageSize) {
+    DEBUG ((EFI_D_ERROR, "Inflated %d bytes, expected %lld\n", OutLen,
+            Hdr->ImageSize));
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  DEBUG ((EFI_D_INFO, "Inflated flash payload: %lld -> %d bytes\n",
+          PayloadSize, OutLen));
+  mFlashDataBuffer = InflateBuffer;
+  mFlashNumDataBytes = OutLen;
+  *Inflated = TRUE;
+
+  return EFI_SUCCESS;
+}
+
+/* Plain sparse and raw images to a named partition can be flashed by the
+ * ring worker, anything that needs the partition table, a lun or one of
+ * the special image formats is flashed inline. So is boot, flashing it
+ * rewrites the slot attributes in the GPT.
+ */
+STATIC BOOLEAN
+FlashRingQueueable (CHAR16 *PartitionName, BOOLEAN *Sparse)
+{
+  sparse_header_t *SparseHeader = (sparse_header_t *)mFlashDataBuffer;
+  meta_header_t *MetaHeader = (meta_header_t *)mFlashDataBuffer;
+  UbiHeader_t *UbiHeader = (UbiHeader_t *)mFlashDataBuffer;
+
+  if (StrStr (PartitionName, L":") ||
+      !StrnCmp (PartitionName, L"partition", StrLen (L"partition")) ||
+      !StrnCmp (PartitionName, L"boot", StrLen (L"boot")) ||
+      !StrnCmp (PartitionName, L"avb_custom_key",
+                StrLen (L"avb_custom_key"))) {
+    return FALSE;
+  }
+
+#ifdef ENABLE_UPDATE_PARTITIONS_CMDS
+  if (StreamFlash.State != StreamFlashIdle) {
+    return FALSE;
+  }
+#endif
+
+  if ((MetaHeader->magic == META_HEADER_MAGIC) ||
+      !AsciiStrnCmp (UbiHeader->HdrMagic, UBI_HEADER_MAGIC, 4)) {
+    return FALSE;
+  }
+
+  *Sparse = (SparseHeader->magic == SPARSE_HEADER_MAGIC);
+  return TRUE;
+}
+
+/* The image is acknowledged as soon as it is queued, so fail the checks
+ * the worker would fail on here. Only write errors are left to be
+ * reported by the next command.
+ */
+STATIC EFI_STATUS
+FlashRingCheck (CHAR16 *PartitionName, BOOLEAN Sparse)
+{
+  EFI_STATUS Status;
+  EFI_BLOCK_IO_PROTOCOL *BlockIo = NULL;
+  EFI_HANDLE *Handle = NULL;
+  sparse_header_t *SparseHeader = (sparse_header_t *)mFlashDataBuffer;
+  CHAR16 Name[MAX_GPT_NAME_SIZE];
+  CHAR16 SlotSuffix[MAX_SLOT_SUFFIX_SZ];
+  UINT64 PartitionSize;
+  UINT64 ImageSize = mFlashNumDataBytes;
+
+  /* The worker resolves the slot on its own copy of the name */
+  StrnCpyS (Name, ARRAY_SIZE (Name), PartitionName, StrLen (PartitionName));
+  if (PartitionHasMultiSlot ((CONST CHAR16 *)L"boot")) {
+    GetPartitionHasSlot (Name, ARRAY_SIZE (Name), SlotSuffix,
+                         MAX_SLOT_SUFFIX_SZ);
+  }
+
+  Status = PartitionGetInfo (Name, &BlockIo, &Handle);
+  if (Status != EFI_SUCCESS) {
+    return Status;
+  }
+  if (!BlockIo ||
+      !Handle) {
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  if (Sparse) {
+    if (mFlashNumDataBytes < sizeof (sparse_header_t)) {
+      return EFI_BAD_BUFFER_SIZE;
+    }
+    ImageSize = (UINT64)SparseHeader->total_blks * SparseHeader->blk_sz;
+  }
+
+  PartitionSize = GetPartitionSize (BlockIo);
+  if (!PartitionSize ||
+      PartitionSize < ImageSize) {
+    DEBUG ((EFI_D_ERROR, "Partition Size:\t%ld\nImage Size:\t%ld\n",
+            PartitionSize, ImageSize));
+    return EFI_VOLUME_FULL;
+  }
+
+  return EFI_SUCCESS;
+}
+
 STATIC EFI_STATUS
 ReenumeratePartTable (VOID)
 {
@@ -1697,6 +3072,53 @@ ReenumeratePartTable (VOID)
 }
 
 
+/* Re-read size and type of the partitions starting with Arg on their next
+ * getvar, of every partition when Arg is NULL.
+ */
+STATIC VOID
+InvalidateGetVarPartitionInfo (CONST CHAR8 *Arg)
+{
+  UINT32 Idx;
+
+  for (Idx = 0; Idx < MAX_NUM_PARTITIONS; Idx++) {
+    if (!Arg ||
+        !AsciiStrnCmp (PublishedPartInfo[Idx].part_name, Arg,
+                       AsciiStrLen (Arg))) {
+      PublishedPartInfo[Idx].valid = FALSE;
+    }
+  }
+}
+
+/* The cached overlaid DTB is built from these images */
+STATIC VOID
+InvalidateDtbCache (CONST CHAR8 *Arg)
+{
+  STATIC CONST CHAR8 *DtbImages[] = {"boot", "dtbo", "recovery",
+                                      "vendor_boot"};
+  UINT32 Idx;
+
+  for (Idx = 0; Idx < ARRAY_SIZE (DtbImages); Idx++) {
+    if (!AsciiStrnCmp (Arg, DtbImages[Idx], AsciiStrLen (DtbImages[Idx]))) {
+      DtbCacheInvalidate ();
+      return;
+    }
+  }
+}
+
+/* Any write may touch an image whose digest was cached, dropping the
+ * cache once per fastboot session is enough as nothing stores it here.
+ */
+STATIC VOID
+InvalidateVbCache (VOID)
+{
+  STATIC BOOLEAN Invalidated;
+
+  if (!Invalidated) {
+    VbCacheInvalidate ();
+    Invalidated = TRUE;
+  }
+}
+
 /* Handle Flash Command */
 STATIC VOID
 CmdFlash (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
@@ -1720,8 +3142,18 @@ CmdFlash (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
   UINT64 PartitionSize = 0;
   UINT32 Ret;
   VirtualAbMergeStatus SnapshotMergeStatus;
-
-  ExchangeFlashAndUsbDataBuf ();
+  BOOLEAN Sparse = FALSE;
+  BOOLEAN Inflated = FALSE;
+  BOOLEAN SparseAsync = FALSE;
+
+  if (FlashRingDepth) {
+    /* Flash straight from the ring slot the image was downloaded to */
+    FlashRingWaitSlot ();
+    mFlashDataBuffer = mUsbDataBuffer;
+    mFlashNumDataBytes = mNumDataBytes;
+  } else {
+    ExchangeFlashAndUsbDataBuf ();
+  }
   if (mFlashDataBuffer == NULL) {
     // Doesn't look like we were sent any data
     FastbootFail ("No data to flash");
@@ -1748,6 +3180,10 @@ CmdFlash (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
     }
   }
 
+  InvalidateDtbCache (arg);
+  InvalidateVbCache ();
+  InvalidateGetVarPartitionInfo (arg);
+
   if (IsVirtualAbOtaSupported ()) {
     if (CheckVirtualAbCriticalPartition (PartitionName)) {
       AsciiSPrint (FlashResultStr, MAX_RSP_SIZE,
@@ -1762,18 +3198,69 @@ CmdFlash (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
           (SnapshotMergeStatus == SNAPSHOTTED)) &&
           !StrnCmp (PartitionName, L"super", StrLen (L"super"))) {
 
-      Status = SetSnapshotMergeStatus (CANCELLED);
-      if (Status != EFI_SUCCESS) {
-        FastbootFail ("Failed to update snapshot state to cancel");
+      Status = SetSnapshotMergeStatus (CANCELLED);
+      if (Status != EFI_SUCCESS) {
+        FastbootFail ("Failed to update snapshot state to cancel");
+        return;
+      }
+
+      //updating fbvar snapshot-merge-state
+      AsciiSPrint (SnapshotMergeState,
+                    AsciiStrLen (VabSnapshotMergeStatus[NONE_MERGE_STATUS]) + 1,
+                    "%a", VabSnapshotMergeStatus[NONE_MERGE_STATUS]);
+    }
+  }
+
+  Status = InflateFlashData (&Inflated);
+  if (EFI_ERROR (Status)) {
+    AsciiSPrint (FlashResultStr, MAX_RSP_SIZE, "%a : %r",
+                 "Error decompressing image", Status);
+    FastbootFail (FlashResultStr);
+    return;
+  }
+
+  /* The inflate buffer is reused, so inflated images are flashed inline */
+  if (FlashRingDepth) {
+    if (!Inflated &&
+        FlashRingQueueable (PartitionName, &Sparse)) {
+      Status = FlashRingCheck (PartitionName, Sparse);
+      if (EFI_ERROR (Status)) {
+        if (Status == EFI_NOT_FOUND) {
+          AsciiSPrint (FlashResultStr, MAX_RSP_SIZE, "(%s) No such partition",
+                       PartitionName);
+        } else {
+          AsciiSPrint (FlashResultStr, MAX_RSP_SIZE, "%a : %r",
+                       "Error flashing partition", Status);
+        }
+        DEBUG ((EFI_D_ERROR, "%a\n", FlashResultStr));
+        FastbootFail (FlashResultStr);
         return;
       }
 
-      //updating fbvar snapshot-merge-state
-      AsciiSPrint (SnapshotMergeState,
-                    AsciiStrLen (VabSnapshotMergeStatus[NONE_MERGE_STATUS]) + 1,
-                    "%a", VabSnapshotMergeStatus[NONE_MERGE_STATUS]);
+      FlashRingQueue (PartitionName, Sparse);
+      FastbootOkay ("");
+      goto out;
+    }
+
+    /* Inline flashes must not race the queued images */
+    WaitForFlashFinished ();
+  }
+
+  /* Sparse image already written while it was downloaded */
+  Status = StreamFlashComplete (PartitionName);
+  if (Status != EFI_UNSUPPORTED) {
+    if (EFI_ERROR (Status)) {
+      AsciiSPrint (FlashResultStr, MAX_RSP_SIZE, "%a : %r",
+                   "Error flashing partition", Status);
+      DEBUG ((EFI_D_ERROR, "%a\n", FlashResultStr));
+      FastbootFail (FlashResultStr);
+    } else {
+      DEBUG ((EFI_D_INFO, "flash image status:  %r\n", Status));
+      FastbootOkay ("");
     }
+    goto out;
   }
+  Status = EFI_SUCCESS;
 
   /* Handle virtual partition avb_custom_key */
   if (!StrnCmp (PartitionName, L"avb_custom_key", StrLen (L"avb_custom_key"))) {
@@ -1842,6 +3329,7 @@ CmdFlash (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
     if (Status == EFI_SUCCESS)  {
       Status = ReenumeratePartTable ();
       if (Status == EFI_SUCCESS) {
+        InvalidateGetVarPartitionInfo (NULL);
         FastbootOkay ("");
         goto out;
       }
@@ -1879,8 +3367,16 @@ CmdFlash (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
       goto out;
     }
 
-    if ((PartitionSize > MaxDownLoadSize) &&
-         !IsDisableParallelDownloadFlash ()) {
+    /* An inflated image lives in InflateBuffer, which the next compressed
+     * download reuses, so it is flashed before the OKAY. So is an image
+     * that was not queued on the ring: its slot is handed to the next
+     * download as soon as this command returns.
+     */
+    SparseAsync = (PartitionSize > MaxDownLoadSize) &&
+                  !IsDisableParallelDownloadFlash () &&
+                  !Inflated &&
+                  !FlashRingDepth;
+    if (SparseAsync) {
       if (IsUseMThreadParallel ()) {
         FlashInfo* ThreadFlashInfo = AllocateZeroPool (sizeof (FlashInfo));
         if (!ThreadFlashInfo) {
@@ -1896,6 +3392,8 @@ CmdFlash (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
                 PartitionName, ARRAY_SIZE (PartitionName));
         ThreadFlashInfo->PartitionSize = ARRAY_SIZE (PartitionName);
 
+        /* Keep streamed downloads off the disk until the thread is done */
+        IsFlashComplete = FALSE;
         Status = CreateSparseImgFlashThread (ThreadFlashInfo);
       } else {
         IsFlashComplete = FALSE;
@@ -1917,7 +3415,7 @@ CmdFlash (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
 
     if (EFI_ERROR (Status) ||
       !IsUseMThreadParallel () ||
-      (PartitionSize <= MaxDownLoadSize)) {
+      !SparseAsync) {
       FlashResult = HandleSparseImgFlash (PartitionName,
                                         ARRAY_SIZE (PartitionName),
                                         mFlashDataBuffer, mFlashNumDataBytes);
@@ -1947,10 +3445,8 @@ CmdFlash (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
    * sparse images.
    */
   if ((sparse_header->magic != SPARSE_HEADER_MAGIC) ||
-        (PartitionSize < MaxDownLoadSize) ||
-        ((PartitionSize > MaxDownLoadSize) &&
-        (IsDisableParallelDownloadFlash () ||
-        (Status != EFI_SUCCESS)))) {
+        !SparseAsync ||
+        (Status != EFI_SUCCESS)) {
     if (EFI_ERROR (FlashResult)) {
       if (FlashResult == EFI_NOT_FOUND) {
         AsciiSPrint (FlashResultStr, MAX_RSP_SIZE, "(%s) No such partition",
@@ -1986,104 +3482,229 @@ out:
   LunSet = FALSE;
 }
 
+/* Arm streaming flash of the next sparse download to a partition,
+ * "oem stream-flash" without a partition name disarms it again.
+ */
 STATIC VOID
-CmdErase (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
+CmdOemStreamFlash (CONST CHAR8 *Arg, VOID *Data, UINT32 Size)
 {
   EFI_STATUS Status;
-  CHAR16 OutputString[FASTBOOT_STRING_MAX_LENGTH];
-  BOOLEAN HasSlot = FALSE;
+  CHAR16 PartitionName[MAX_GPT_NAME_SIZE];
   CHAR16 SlotSuffix[MAX_SLOT_SUFFIX_SZ];
+  CHAR8 Resp[MAX_RSP_SIZE] = "";
+
+  WaitForFlashFinished ();
+
+  StreamFlash.Armed = FALSE;
+  StreamFlash.State = StreamFlashIdle;
+
+  while (*Arg == ' ') {
+    Arg++;
+  }
+
+  if (*Arg == '\0') {
+    FastbootOkay ("");
+    return;
+  }
+
+  if (AsciiStrLen (Arg) >= MAX_GPT_NAME_SIZE) {
+    FastbootFail ("Invalid partition name");
+    return;
+  }
+  AsciiStrToUnicodeStr (Arg, PartitionName);
+
+  if (PartitionHasMultiSlot ((CONST CHAR16 *)L"boot")) {
+    GetPartitionHasSlot (PartitionName, ARRAY_SIZE (PartitionName),
+                         SlotSuffix, MAX_SLOT_SUFFIX_SZ);
+  }
+
+  Status = StreamFlashAllowed (PartitionName);
+  if (!EFI_ERROR (Status) &&
+      (GetPartitionIndex (PartitionName) == INVALID_PTN)) {
+    Status = EFI_NOT_FOUND;
+  }
+
+  if (EFI_ERROR (Status)) {
+    AsciiSPrint (Resp, MAX_RSP_SIZE, "%a : %r", "Cannot stream flash", Status);
+    FastbootFail (Resp);
+    return;
+  }
+
+  StrnCpyS (StreamFlash.PartitionName, ARRAY_SIZE (StreamFlash.PartitionName),
+            PartitionName, StrLen (PartitionName));
+  StreamFlash.Armed = TRUE;
+  DEBUG ((EFI_D_INFO, "Stream flash armed for %s\n", PartitionName));
+  FastbootOkay ("");
+}
+
+STATIC VOID
+CmdErase (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
+{
+  EFI_STATUS Status;
   BOOLEAN MultiSlotBoot = PartitionHasMultiSlot (L"boot");
+  CHAR8 Name[MAX_GPT_NAME_SIZE];
   CHAR16 PartitionName[MAX_GPT_NAME_SIZE];
   CHAR8 EraseResultStr[MAX_RSP_SIZE] = "";
   VirtualAbMergeStatus SnapshotMergeStatus;
+  CONST CHAR8 *Next = arg;
+  UINTN NameLen;
+  EraseJob *Jobs = NULL;
+  EraseJob *Job;
+  UINT32 NumJobs = 0;
+  UINT32 i;
+  BOOLEAN CancelSnapshot = FALSE;
+  BOOLEAN EraseKey = FALSE;
 
   WaitForFlashFinished ();
 
-  if (AsciiStrLen (arg) >= MAX_GPT_NAME_SIZE) {
-    FastbootFail ("Invalid partition name");
+  Jobs = AllocateZeroPool (sizeof (*Jobs) * MAX_ERASE_LIST);
+  if (Jobs == NULL) {
+    FastbootFail ("Failed to allocate erase list");
     return;
   }
-  AsciiStrToUnicodeStr (arg, PartitionName);
-
 
-  if ((GetAVBVersion () == AVB_LE) ||
-      ((GetAVBVersion () != AVB_LE) &&
-      (TargetBuildVariantUser ()))) {
-    if (!IsUnlocked ()) {
-      FastbootFail ("Erase is not allowed in Lock State");
-      return;
+  /* "erase:a,b,c" erases every listed partition in one go. The whole list
+   * is checked before anything is changed, so a bad entry fails the
+   * command without side effects.
+   */
+  while (Next) {
+    NameLen = AsciiStrLen (Next);
+    if (AsciiStrStr (Next, ",")) {
+      NameLen = AsciiStrStr (Next, ",") - Next;
     }
 
-    if (!IsUnlockCritical () && IsCriticalPartition (PartitionName)) {
-      FastbootFail ("Erase is not allowed for Critical Partitions\n");
-      return;
+    if (!NameLen ||
+        NameLen >= MAX_GPT_NAME_SIZE) {
+      FastbootFail ("Invalid partition name");
+      goto out;
     }
-  }
+    gBS->CopyMem (Name, (VOID *)Next, NameLen);
+    Name[NameLen] = '\0';
+    Next = Next[NameLen] ? Next + NameLen + 1 : NULL;
+    AsciiStrToUnicodeStr (Name, PartitionName);
+
+    if ((GetAVBVersion () == AVB_LE) ||
+        ((GetAVBVersion () != AVB_LE) &&
+        (TargetBuildVariantUser ()))) {
+      if (!IsUnlocked ()) {
+        FastbootFail ("Erase is not allowed in Lock State");
+        goto out;
+      }
 
-  if (IsVirtualAbOtaSupported ()) {
-    if (CheckVirtualAbCriticalPartition (PartitionName)) {
-      AsciiSPrint (EraseResultStr, MAX_RSP_SIZE,
-                    "Erase of %s is not allowed in %a state",
-                    PartitionName, SnapshotMergeState);
-      FastbootFail (EraseResultStr);
-      return;
+      if (!IsUnlockCritical () && IsCriticalPartition (PartitionName)) {
+        FastbootFail ("Erase is not allowed for Critical Partitions\n");
+        goto out;
+      }
     }
 
-    SnapshotMergeStatus = GetSnapshotMergeStatus ();
-    if (((SnapshotMergeStatus == MERGING) ||
-          (SnapshotMergeStatus == SNAPSHOTTED)) &&
-          !StrnCmp (PartitionName, L"super", StrLen (L"super"))) {
+    if (IsVirtualAbOtaSupported ()) {
+      if (CheckVirtualAbCriticalPartition (PartitionName)) {
+        AsciiSPrint (EraseResultStr, MAX_RSP_SIZE,
+                      "Erase of %s is not allowed in %a state",
+                      PartitionName, SnapshotMergeState);
+        FastbootFail (EraseResultStr);
+        goto out;
+      }
 
-      Status = SetSnapshotMergeStatus (CANCELLED);
-      if (Status != EFI_SUCCESS) {
-        FastbootFail ("Failed to update snapshot state to cancel");
-        return;
+      SnapshotMergeStatus = GetSnapshotMergeStatus ();
+      if (((SnapshotMergeStatus == MERGING) ||
+            (SnapshotMergeStatus == SNAPSHOTTED)) &&
+            !StrnCmp (PartitionName, L"super", StrLen (L"super"))) {
+        CancelSnapshot = TRUE;
       }
+    }
 
-      //updating fbvar snapshot-merge-state
-      AsciiSPrint (SnapshotMergeState,
-                    AsciiStrLen (VabSnapshotMergeStatus[NONE_MERGE_STATUS]) + 1,
-                    "%a", VabSnapshotMergeStatus[NONE_MERGE_STATUS]);
+    /* Handle virtual partition avb_custom_key */
+    if (!StrnCmp (PartitionName, L"avb_custom_key",
+                  StrLen (L"avb_custom_key"))) {
+      EraseKey = TRUE;
+      continue;
+    }
+
+    if (NumJobs >= MAX_ERASE_LIST) {
+      FastbootFail ("Too many partitions to erase");
+      goto out;
     }
+
+    /* In A/B to have backward compatibility user can still give fastboot
+     * erase boot/system/modem etc
+     * based on current slot Suffix try to look for "partition"_a/b if not
+     * found fall back to look for just the "partition" in case some of the
+     * partitions are no included for A/B implementation
+     */
+    Job = &Jobs[NumJobs++];
+    AsciiStrnCpyS (Job->Name, ARRAY_SIZE (Job->Name), Name, NameLen);
+    Job->Lun = GetPartitionLunByName (PartitionName);
+    if (MultiSlotBoot)
+      Job->HasSlot = GetPartitionHasSlot (PartitionName,
+                                          ARRAY_SIZE (PartitionName),
+                                          Job->SlotSuffix, MAX_SLOT_SUFFIX_SZ);
+    StrnCpyS (Job->PartitionName, ARRAY_SIZE (Job->PartitionName),
+              PartitionName, StrLen (PartitionName));
+    Job->Serial = !StrCmp (PartitionName, L"userdata") ||
+                  !StrnCmp (PartitionName, L"boot", StrLen (L"boot"));
+  }
+
+  InvalidateVbCache ();
+  for (i = 0; i < NumJobs; i++) {
+    InvalidateDtbCache (Jobs[i].Name);
+    InvalidateGetVarPartitionInfo (Jobs[i].Name);
+  }
+
+  if (CancelSnapshot) {
+    Status = SetSnapshotMergeStatus (CANCELLED);
+    if (Status != EFI_SUCCESS) {
+      FastbootFail ("Failed to update snapshot state to cancel");
+      goto out;
+    }
+
+    //updating fbvar snapshot-merge-state
+    AsciiSPrint (SnapshotMergeState,
+                  AsciiStrLen (VabSnapshotMergeStatus[NONE_MERGE_STATUS]) + 1,
+                  "%a", VabSnapshotMergeStatus[NONE_MERGE_STATUS]);
   }
 
-  /* Handle virtual partition avb_custom_key */
-  if (!StrnCmp (PartitionName, L"avb_custom_key", StrLen (L"avb_custom_key"))) {
+  if (EraseKey) {
     DEBUG ((EFI_D_INFO, "erasing avb_custom_key\n"));
     Status = EraseUserKey ();
     if (Status != EFI_SUCCESS) {
       FastbootFail ("Erasing avb_custom_key failed");
-    } else {
-      FastbootOkay ("");
+      goto out;
     }
-    return;
   }
 
-  /* In A/B to have backward compatibility user can still give fastboot flash
-   * boot/system/modem etc
-   * based on current slot Suffix try to look for "partition"_a/b if not found
-   * fall back to look for
-   * just the "partition" in case some of the partitions are no included for A/B
-   * implementation
-   */
-  if (MultiSlotBoot)
-    HasSlot = GetPartitionHasSlot (PartitionName, ARRAY_SIZE (PartitionName),
-                                   SlotSuffix, MAX_SLOT_SUFFIX_SZ);
+  EraseJobs (Jobs, NumJobs);
 
-  // Build output string
-  UnicodeSPrint (OutputString, sizeof (OutputString),
-                 L"Erasing partition %s\r\n", PartitionName);
-  Status = FastbootErasePartition (PartitionName);
-  if (EFI_ERROR (Status)) {
-    FastbootFail ("Check device console.");
-    DEBUG ((EFI_D_ERROR, "Couldn't erase image:  %r\n", Status));
-  } else {
-    if (MultiSlotBoot && HasSlot &&
-        !(StrnCmp (PartitionName, L"boot", StrLen (L"boot"))))
-      FastbootUpdateAttr (SlotSuffix);
-    FastbootOkay ("");
+  for (i = 0; i < NumJobs; i++) {
+    Job = &Jobs[i];
+    if (!EFI_ERROR (Job->Status) &&
+        MultiSlotBoot && Job->HasSlot &&
+        !(StrnCmp (Job->PartitionName, L"boot", StrLen (L"boot"))))
+      FastbootUpdateAttr (Job->SlotSuffix);
+  }
+
+  for (i = 0; i < NumJobs; i++) {
+    Job = &Jobs[i];
+    if (EFI_ERROR (Job->Status)) {
+      DEBUG ((EFI_D_ERROR, "Couldn't erase %s:  %r\n", Job->PartitionName,
+              Job->Status));
+      FastbootFail ("Check device console.");
+      goto out;
+    }
+
+    /* Report the erase throughput of every partition */
+    AsciiSPrint (EraseResultStr, MAX_RSP_SIZE, "%s: %lld MB in %lld ms",
+                 Job->PartitionName, Job->Size / SIZE_1MB, Job->TimeMs);
+    DEBUG ((EFI_D_INFO, "Erased %a (%lld MB/s)\n", EraseResultStr,
+            (Job->Size / SIZE_1MB) * 1000 / MAX (Job->TimeMs, 1)));
+    FastbootInfo (EraseResultStr);
+    WaitForTransferComplete ();
   }
+
+  FastbootOkay ("");
+
+out:
+  FreePool (Jobs);
 }
 
 /*Function to set given slot as high priority
@@ -2107,6 +3728,9 @@ CmdSetActive (CONST CHAR8 *Arg, VOID *Data, UINT32 Size)
   Slot NewSlot = {{0}};
   EFI_STATUS Status;
 
+  /* Queued images must not race the slot attribute update */
+  WaitForFlashFinished ();
+
   if (TargetBuildVariantUser () && !IsUnlocked ()) {
     FastbootFail ("Slot Change is not allowed in Lock State\n");
     return;
@@ -2170,6 +3794,7 @@ CmdSetActive (CONST CHAR8 *Arg, VOID *Data, UINT32 Size)
     FastbootFail ("set_active failed");
     return;
   }
+  InvalidateGetVarPartitionInfo (NULL);
 
   // Updating fbvar `current-slot'
   UnicodeStrToAsciiStr (GetCurrentSlotSuffix ().Suffix, CurrentSlotFB);
@@ -2287,6 +3912,10 @@ AcceptData (IN UINT64 Size, IN VOID *Data)
     GetFastbootDeviceData ()->UsbDeviceProtocol->Send (
         ENDPOINT_IN, GetXfrSize (), (Data + mBytesReceivedSoFar));
     DEBUG ((EFI_D_VERBOSE, "AcceptData: Send %d\n", GetXfrSize ()));
+#ifdef ENABLE_UPDATE_PARTITIONS_CMDS
+    /* Write what arrived so far while the next transfer is in flight */
+    StreamFlashFeed (mBytesReceivedSoFar);
+#endif
   }
 }
 
@@ -2335,6 +3964,17 @@ FastbootCmdsUnInit (VOID)
       return Status;
     }
   }
+#ifdef ENABLE_UPDATE_PARTITIONS_CMDS
+  if (FillBuf) {
+    FreePool (FillBuf);
+    FillBuf = NULL;
+  }
+#endif
+  if (InflateBuffer) {
+    FreePages (InflateBuffer, EFI_SIZE_TO_PAGES (InflateBufferSize));
+    InflateBuffer = NULL;
+    InflateBufferSize = 0;
+  }
   FastbootUnInit ();
   GetFastbootDeviceData ()->UsbDeviceProtocol->Stop ();
   return EFI_SUCCESS;
@@ -2424,8 +4064,12 @@ GetMaxAllocatableMemory (
 //Shoud block command until flash finished
 VOID WaitForFlashFinished (VOID)
 {
-  if (!IsFlashComplete &&
-    IsUseMThreadParallel ()) {
+  if (!IsUseMThreadParallel ()) {
+    return;
+  }
+
+  /* The ring worker takes LockFlash once for every queued image */
+  while (!IsFlashComplete) {
     KernIntf->Lock->AcquireLock (LockFlash);
     KernIntf->Lock->ReleaseLock (LockFlash);
   }
@@ -2483,12 +4127,58 @@ VOID InitMultiThreadEnv ()
           "InitMultiThreadEnv successfully, will use thread to flash \n"));
 }
 
+/* Carve the fastboot buffer into the download ring when flashing is
+ * threaded, otherwise keep the flash/usb buffer pair.
+ */
+STATIC VOID
+FlashRingInit (UINT8 *Base, UINT64 BufferSize)
+{
+  EFI_STATUS Status;
+  UINT32 Depth;
+  UINT32 Idx;
+
+  if (!IsUseMThreadParallel () ||
+      (CheckRootDeviceType () == NAND)) {
+    return;
+  }
+
+  Depth = BufferSize / MaxDownLoadSize;
+  if (Depth > FLASH_RING_MAX_DEPTH) {
+    Depth = FLASH_RING_MAX_DEPTH;
+  }
+  if (Depth < 2) {
+    return;
+  }
+
+  Status = KernIntf->Lock->InitLock ("RING", &LockRing);
+  if ((Status != EFI_SUCCESS) ||
+      (LockRing == NULL)) {
+    DEBUG ((EFI_D_ERROR, "InitLock LockRing error: %r\n", Status));
+    return;
+  }
+
+  for (Idx = 0; Idx < Depth; Idx++) {
+    FlashRing[Idx].Buffer = Base + (Idx * MaxDownLoadSize);
+  }
+
+  FlashRingHead = 0;
+  FlashRingPending = 0;
+  FlashRingUsb = 0;
+  FlashRingDepth = Depth;
+  mUsbDataBuffer = FlashRing[0].Buffer;
+
+  DEBUG ((EFI_D_INFO, "Fastboot download ring: %d slots of %ld bytes\n",
+          Depth, MaxDownLoadSize));
+}
+
 EFI_STATUS
 FastbootCmdsInit (VOID)
 {
   EFI_STATUS Status;
   EFI_EVENT mFatalSendErrorEvent;
   CHAR8 *FastBootBuffer;
+  UINT64 BufferSize;
+  UINT64 BufferLimit = MAX_BUFFER_SIZE;
 
   mDataBuffer = NULL;
   mUsbDataBuffer = NULL;
@@ -2512,6 +4202,16 @@ FastbootCmdsInit (VOID)
     return Status;
   }
 
+  InitMultiThreadEnv ();
+
+  /* Threaded flash can keep several downloads in flight, give it room for
+   * a full ring of slots when the memory is there.
+   */
+  if (IsUseMThreadParallel () &&
+      (CheckRootDeviceType () != NAND)) {
+    BufferLimit = FLASH_RING_SLOT_SIZE * FLASH_RING_MAX_DEPTH;
+  }
+
   /* Allocate buffer used to store images passed by the download command */
   GetMaxAllocatableMemory (&MaxDownLoadSize);
   if (!MaxDownLoadSize) {
@@ -2531,8 +4231,8 @@ FastbootCmdsInit (VOID)
 
     /* If available buffer on target is more than max buffer size,
        we limit this to max buffer buffer size we support */
-    if (MaxDownLoadSize > MAX_BUFFER_SIZE) {
-      MaxDownLoadSize = MAX_BUFFER_SIZE;
+    if (MaxDownLoadSize > BufferLimit) {
+      MaxDownLoadSize = BufferLimit;
     }
 
     Status =
@@ -2551,12 +4251,17 @@ FastbootCmdsInit (VOID)
   DEBUG ((EFI_D_VERBOSE,
                   "Fastboot Buffer Size allocated: %ld\n", MaxDownLoadSize));
 
-  MaxDownLoadSize = (CheckRootDeviceType () == NAND) ?
-                              MaxDownLoadSize : MaxDownLoadSize / 2;
+  BufferSize = MaxDownLoadSize;
+  if (CheckRootDeviceType () != NAND) {
+    MaxDownLoadSize = MaxDownLoadSize / 2;
+    if (MaxDownLoadSize > FLASH_RING_SLOT_SIZE) {
+      MaxDownLoadSize = FLASH_RING_SLOT_SIZE;
+    }
+  }
 
   FastbootCommandSetup ((VOID *)FastBootBuffer, MaxDownLoadSize);
 
-  InitMultiThreadEnv ();
+  FlashRingInit ((UINT8 *)FastBootBuffer, BufferSize);
 
   return EFI_SUCCESS;
 }
@@ -2740,12 +4445,18 @@ STATIC VOID WaitForTransferComplete (VOID)
 STATIC VOID CmdGetVarAll (VOID)
 {
   FASTBOOT_VAR *Var;
+  CONST CHAR8 *Value;
   CHAR8 GetVarAll[MAX_RSP_SIZE];
 
   for (Var = Varlist; Var; Var = Var->next) {
+    Value = FastbootVarValue (Var);
+    if (!Value) {
+      continue;
+    }
+
     AsciiStrnCpyS (GetVarAll, sizeof (GetVarAll), Var->name, MAX_RSP_SIZE);
     AsciiStrnCatS (GetVarAll, sizeof (GetVarAll), ":", AsciiStrLen (":"));
-    AsciiStrnCatS (GetVarAll, sizeof (GetVarAll), Var->value, MAX_RSP_SIZE);
+    AsciiStrnCatS (GetVarAll, sizeof (GetVarAll), Value, MAX_RSP_SIZE);
     FastbootInfo (GetVarAll);
     /* Wait for the transfer to complete */
     WaitForTransferComplete ();
@@ -2755,10 +4466,26 @@ STATIC VOID CmdGetVarAll (VOID)
   FastbootOkay (GetVarAll);
 }
 
+/* Send every completed boot timeline span as an INFO line */
+STATIC VOID CmdGetVarBootTimeline (VOID)
+{
+  CHAR8 Span[BT_SPAN_STR_LEN];
+  UINT32 Index;
+
+  for (Index = 0; BootTimelineGetSpan (Index, Span, sizeof (Span)); Index++) {
+    FastbootInfo (Span);
+    /* Wait for the transfer to complete */
+    WaitForTransferComplete ();
+  }
+
+  FastbootOkay ("");
+}
+
 STATIC VOID
 CmdGetVar (CONST CHAR8 *Arg, VOID *Data, UINT32 Size)
 {
   FASTBOOT_VAR *Var;
+  CONST CHAR8 *Value;
   Slot CurrentSlot;
   CHAR16 PartNameUniStr[MAX_GPT_NAME_SIZE];
   CHAR8 *Token = AsciiStrStr (Arg, "partition-");
@@ -2771,6 +4498,11 @@ CmdGetVar (CONST CHAR8 *Arg, VOID *Data, UINT32 Size)
     return;
   }
 
+  if (!(AsciiStrCmp ("boot-timeline", Arg))) {
+    CmdGetVarBootTimeline ();
+    return;
+  }
+
   if (Token) {
     Token = AsciiStrStr (Arg, ":");
     if (Token) {
@@ -2791,9 +4523,11 @@ CmdGetVar (CONST CHAR8 *Arg, VOID *Data, UINT32 Size)
     }
   }
 
-  for (Var = Varlist; Var; Var = Var->next) {
-    if (!AsciiStrCmp (Var->name, Arg)) {
-      FastbootOkay (Var->value);
+  Var = FastbootFindVar (Arg);
+  if (Var) {
+    Value = FastbootVarValue (Var);
+    if (Value) {
+      FastbootOkay (Value);
       return;
     }
   }
@@ -3399,6 +5133,28 @@ AcceptCmdHandler (IN EFI_EVENT Event, IN VOID *Context)
   AcceptCmdInfo = NULL;
 }
 
+STATIC BOOLEAN
+FlashMustFinish (CONST CHAR8 *Cmd)
+{
+  STATIC CONST CHAR8 *Cmds[] = {
+    "reboot",
+    "continue",
+    "set_active",
+    "boot",
+    "flashing",
+    "erase",
+  };
+  UINT32 Idx;
+
+  for (Idx = 0; Idx < ARRAY_SIZE (Cmds); Idx++) {
+    if (!AsciiStrnCmp (Cmd, Cmds[Idx], AsciiStrLen (Cmds[Idx]))) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
 STATIC VOID
 AcceptCmd (IN UINT64 Size, IN CHAR8 *Data)
 {
@@ -3431,21 +5187,32 @@ AcceptCmd (IN UINT64 Size, IN CHAR8 *Data)
       }
     }
 
-    /* Check last flash result */
+    /* Queued flashes must be on the disk before the device leaves
+     * fastboot or its slots change, so their result is seen first.
+     */
+    if (FlashMustFinish (Data)) {
+      WaitForFlashFinished ();
+    }
+
+    /* Check last flash result, whatever command comes next reports it */
     if (FlashResult != EFI_SUCCESS) {
       AsciiSPrint (FlashResultStr, MAX_RSP_SIZE, "%a : %r",
                  "Error: Last flash failed", FlashResult);
 
       DEBUG ((EFI_D_ERROR, "%a\n", FlashResultStr));
-      if (!AsciiStrnCmp (Data, "flash", AsciiStrLen ("flash")) ||
-          !AsciiStrnCmp (Data, "download", AsciiStrLen ("download"))) {
-        FastbootFail (FlashResultStr);
-        FlashResult = EFI_SUCCESS;
-        return;
-      }
+      FastbootFail (FlashResultStr);
+      FlashResult = EFI_SUCCESS;
+      return;
     }
   }
 
+#ifdef ENABLE_UPDATE_PARTITIONS_CMDS
+  if (!StreamFlashCmdAllowed (Data)) {
+    FastbootFail ("Stream flash pending, image dropped");
+    return;
+  }
+#endif
+
   if (FixedPcdGetBool (EnableBatteryVoltageCheck)) {
     /* Check battery voltage before erase or flash image
      * It gets partition type once when to flash or erase image,
@@ -3614,6 +5381,42 @@ GetPartitionSizeViaName (IN CHAR16 *PartName, OUT CHAR8 * PartSize)
 
 }
 
+/* Partition size and type are read from the disk on their first getvar
+ * and again after the partition was flashed or erased, instead of for
+ * every partition while fastboot starts.
+ */
+STATIC VOID
+RefreshGetVarPartitionInfo (struct GetVarPartitionInfo *PartInfo)
+{
+  CHAR16 PartitionName[MAX_GPT_NAME_SIZE];
+  EFI_STATUS Status;
+
+  if (PartInfo->valid) {
+    return;
+  }
+
+  /* Queued flashes may still change what is on the disk */
+  WaitForFlashFinished ();
+
+  AsciiStrToUnicodeStr (PartInfo->part_name, PartitionName);
+
+  Status = GetPartitionSizeViaName (PartitionName, PartInfo->size_response);
+  if (Status != EFI_SUCCESS) {
+    DEBUG ((EFI_D_ERROR, "Error Publishing size info for %s partition\n",
+                                                        PartitionName));
+    PartInfo->size_response[0] = '\0';
+  }
+
+  Status = GetPartitionType (PartitionName, PartInfo->type_response);
+  if (Status != EFI_SUCCESS) {
+    DEBUG ((EFI_D_ERROR, "Error Publishing type info for %s partition\n",
+                                                        PartitionName));
+    PartInfo->type_response[0] = '\0';
+  }
+
+  PartInfo->valid = TRUE;
+}
+
 STATIC EFI_STATUS
 PublishGetVarPartitionInfo (
                             IN struct GetVarPartitionInfo *PublishedPartInfo,
@@ -3623,18 +5426,14 @@ PublishGetVarPartitionInfo (
   EFI_STATUS Status = EFI_INVALID_PARAMETER;
   EFI_STATUS RetStatus = EFI_SUCCESS;
   CHAR16 *PartitionNameUniCode = NULL;
-  BOOLEAN PublishType;
-  BOOLEAN PublishSize;
 
   /* Clear Published Partition Buffer */
   gBS->SetMem (PublishedPartInfo,
           sizeof (struct GetVarPartitionInfo) * MAX_NUM_PARTITIONS, 0);
 
-  /* Loop will go through each partition entry
-     and publish info for all partitions.*/
+  /* Loop will go through each partition entry and publish the variables,
+     their values are filled in on the first getvar.*/
   for (PtnLoopCount = 1; PtnLoopCount <= NumParts; PtnLoopCount++) {
-    PublishType = FALSE;
-    PublishSize = FALSE;
     PartitionNameUniCode = PtnEntries[PtnLoopCount].PartEntry.PartitionName;
     /* Skip Null/last partition */
     if (PartitionNameUniCode[0] == '\0') {
@@ -3643,7 +5442,7 @@ PublishGetVarPartitionInfo (
     UnicodeStrToAsciiStr (PtnEntries[PtnLoopCount].PartEntry.PartitionName,
                           (CHAR8 *)PublishedPartInfo[PtnLoopCount].part_name);
 
-    /* Fill partition size variable and response string */
+    /* Fill partition size variable */
     AsciiStrnCpyS (PublishedPartInfo[PtnLoopCount].getvar_size_str,
                       MAX_GET_VAR_NAME_SIZE, "partition-size:",
                       AsciiStrLen ("partition-size:"));
@@ -3653,15 +5452,16 @@ PublishGetVarPartitionInfo (
                             AsciiStrLen (
                               PublishedPartInfo[PtnLoopCount].part_name));
     if (!EFI_ERROR (Status)) {
-      Status = GetPartitionSizeViaName (
-                            PartitionNameUniCode,
-                            PublishedPartInfo[PtnLoopCount].size_response);
-      if (Status == EFI_SUCCESS) {
-        PublishSize = TRUE;
-      }
+      FastbootPublishVarInfo (PublishedPartInfo[PtnLoopCount].getvar_size_str,
+                              PublishedPartInfo[PtnLoopCount].size_response,
+                              &PublishedPartInfo[PtnLoopCount]);
+    } else {
+        DEBUG ((EFI_D_ERROR, "Error Publishing size info for %s partition\n",
+                                                        PartitionNameUniCode));
+        RetStatus = EFI_INVALID_PARAMETER;
     }
 
-    /* Fill partition type variable and response string */
+    /* Fill partition type variable */
     AsciiStrnCpyS (PublishedPartInfo[PtnLoopCount].getvar_type_str,
                     MAX_GET_VAR_NAME_SIZE, "partition-type:",
                     AsciiStrLen ("partition-type:"));
@@ -3671,26 +5471,9 @@ PublishGetVarPartitionInfo (
                               AsciiStrLen (
                                 PublishedPartInfo[PtnLoopCount].part_name));
     if (!EFI_ERROR (Status)) {
-      Status = GetPartitionType (
-                            PartitionNameUniCode,
-                            PublishedPartInfo[PtnLoopCount].type_response);
-      if (Status == EFI_SUCCESS) {
-        PublishType = TRUE;
-      }
-    }
-
-    if (PublishSize) {
-      FastbootPublishVar (PublishedPartInfo[PtnLoopCount].getvar_size_str,
-                              PublishedPartInfo[PtnLoopCount].size_response);
-    } else {
-        DEBUG ((EFI_D_ERROR, "Error Publishing size info for %s partition\n",
-                                                        PartitionNameUniCode));
-        RetStatus = EFI_INVALID_PARAMETER;
-    }
-
-    if (PublishType) {
-      FastbootPublishVar (PublishedPartInfo[PtnLoopCount].getvar_type_str,
-                              PublishedPartInfo[PtnLoopCount].type_response);
+      FastbootPublishVarInfo (PublishedPartInfo[PtnLoopCount].getvar_type_str,
+                              PublishedPartInfo[PtnLoopCount].type_response,
+                              &PublishedPartInfo[PtnLoopCount]);
     } else {
         DEBUG ((EFI_D_ERROR, "Error Publishing type info for %s partition\n",
                                                         PartitionNameUniCode));
@@ -3778,6 +5561,7 @@ FastbootCommandSetup (IN VOID *Base, IN UINT64 Size)
       {"flashing get_unlock_ability", CmdFlashingGetUnlockAbility},
       {"flashing unlock", CmdFlashingUnlock},
       {"flashing lock", CmdFlashingLock},
+      {"oem stream-flash", CmdOemStreamFlash},
 #endif
 /*
  *CAUTION(CRITICAL): Enabling these commands will allow changes to bootimage.
@@ -3916,6 +5700,11 @@ FastbootCommandSetup (IN VOID *Base, IN UINT64 Size)
     FastbootPublishVar ("parallel-download-flash", "yes");
   }
 
+#ifdef ENABLE_UPDATE_PARTITIONS_CMDS
+  FastbootPublishVar ("stream-flash", (Type == NAND) ? "no" : "yes");
+#endif
+  FastbootPublishVar ("compressed-flash", "gzip,lz4");
+
   /* Register handlers for the supported commands*/
   UINT32 FastbootCmdCnt = sizeof (cmd_list) / sizeof (cmd_list[0]);
   for (i = 1; i < FastbootCmdCnt; i++)
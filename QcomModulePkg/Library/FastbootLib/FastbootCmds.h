@@ -44,6 +44,7 @@
 #define ENDPOINT_OUT 0x81
 
 #define MAX_WRITE_SIZE (1024 * 1024)
+#define MAX_FILL_BUFFER_SIZE (4 * 1024 * 1024)
 #define MAX_RSP_SIZE 64
 #define ERASE_BUFF_SIZE 256 * 1024
 #define ERASE_BUFF_BLOCKS 256 * 2
@@ -52,6 +53,8 @@
 #define FASTBOOT_STRING_MAX_LENGTH 256
 #define FASTBOOT_COMMAND_MAX_LENGTH 64
 #define MAX_GET_VAR_NAME_SIZE 32
+/* Partitions in one "erase:a,b,c" command */
+#define MAX_ERASE_LIST 16
 #define SIGACTUAL 4096
 #define SLOT_SUFFIX_ARRAY_SIZE 10
 #define SLOT_ATTR_SIZE 32
@@ -76,6 +79,20 @@
 #define MIN_BUFFER_SIZE (67108864)
 /* 1.5GB */
 #define MAX_BUFFER_SIZE (1610612736)
+/* Download ring used by the threaded flash, up to 4 slots of 768MB */
+#define FLASH_RING_MAX_DEPTH 4
+#define FLASH_RING_SLOT_SIZE ((UINT64)MAX_BUFFER_SIZE / 2)
+
+/* Compressed flash payload: this header followed by a gzip or LZ4 legacy
+ * stream of the image. Hosts check "getvar compressed-flash" first.
+ */
+#define COMPRESSED_IMG_MAGIC "FBZIMG01"
+#define COMPRESSED_IMG_MAGIC_SIZE 8
+typedef struct {
+  CHAR8 Magic[COMPRESSED_IMG_MAGIC_SIZE];
+  /* Size of the image once decompressed */
+  UINT64 ImageSize;
+} CompressedImgHeader;
 
 typedef enum FsSignature {
   EXT_FS_SIGNATURE = 1,
@@ -91,11 +108,20 @@ struct FastbootCmdDesc {
   fastboot_cmd_fn cb;
 };
 
+/* Buckets of the getvar name hash */
+#define FASTBOOT_VAR_HASH_SIZE 128
+
+struct GetVarPartitionInfo;
+
 /* Fastboot Variable list */
 typedef struct _FASTBOOT_VAR {
   struct _FASTBOOT_VAR *next;
+  /* Next variable in the same hash bucket */
+  struct _FASTBOOT_VAR *hash_next;
   CONST CHAR8 *name;
   CONST CHAR8 *value;
+  /* Partition size/type variables are read from the disk on demand */
+  struct GetVarPartitionInfo *part_info;
 } FASTBOOT_VAR;
 
 /* Partition info fastboot variable */
@@ -105,6 +131,8 @@ struct GetVarPartitionInfo {
   CHAR8 getvar_type_str[MAX_GET_VAR_NAME_SIZE];
   CHAR8 size_response[MAX_RSP_SIZE];
   CHAR8 type_response[MAX_RSP_SIZE];
+  /* Responses are up to date with the disk */
+  BOOLEAN valid;
 };
 
 /* Fastboot State */
@@ -46,6 +46,12 @@ avb_sha256_init (AvbSHA256Ctx *Ctx)
   EFI_STATUS Status = EFI_SUCCESS;
   EFI_HASH2_PROTOCOL *pEfiHash2Protocol = NULL;
 
+  Ctx->user_data = NULL;
+  if (avb_sha256_engine () != AVB_SHA_ENGINE_HASH2) {
+    avb_sha256_sw_init (Ctx);
+    return;
+  }
+
   GUARD_OUT (gBS->LocateProtocol (&gEfiHash2ProtocolGuid, NULL,
                                   (VOID **)&pEfiHash2Protocol));
 
@@ -56,7 +62,10 @@ avb_sha256_init (AvbSHA256Ctx *Ctx)
 
 out:
   if (Status != EFI_SUCCESS) {
+    DEBUG ((EFI_D_ERROR, "avb_sha256_init: Hash2 failed %r, using software "
+                         "SHA-256\n", Status));
     Ctx->user_data = NULL;
+    avb_sha256_sw_init (Ctx);
   }
 }
 
@@ -78,7 +87,7 @@ avb_sha256_update (AvbSHA256Ctx *Ctx, const uint8_t *Data, uint32_t Len)
 
   pEfiHash2Protocol = Ctx->user_data;
   if (pEfiHash2Protocol == NULL) {
-    DEBUG ((EFI_D_ERROR, "avb_sha256_update failed, Ctx->user_data is NULL\n"));
+    avb_sha256_sw_update (Ctx, Data, Len);
     return;
   }
 
@@ -102,9 +111,7 @@ avb_sha256_final (AvbSHA256Ctx *Ctx)
 
   pEfiHash2Protocol = Ctx->user_data;
   if (pEfiHash2Protocol == NULL) {
-    DEBUG ((EFI_D_ERROR, "avb_sha256_final failed, Ctx->user_data is NULL\n"));
-    Status = EFI_INVALID_PARAMETER;
-    goto out;
+    return avb_sha256_sw_final (Ctx);
   }
 
   GUARD_OUT (pEfiHash2Protocol->HashFinal (pEfiHash2Protocol, &Hash2Output));
@@ -0,0 +1,223 @@
+/* Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * * Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "VerifiedBoot.h"
+#include "avb_sha.h"
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/TimerLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Protocol/Hash2.h>
+#include <Uefi.h>
+
+/* ID_AA64ISAR0_EL1.SHA2: 1 - SHA-256 instructions, 2 - SHA-256 and SHA-512 */
+#define ID_AA64ISAR0_SHA2_SHIFT 12
+#define ID_AA64ISAR0_SHA2_MASK 0xF
+#define ID_AA64ISAR0_SHA2_SHA256 1
+#define ID_AA64ISAR0_SHA2_SHA512 2
+
+STATIC BOOLEAN Sha256EngineSelected = FALSE;
+STATIC BOOLEAN Sha512EngineSelected = FALSE;
+STATIC AvbSHAEngine Sha256Engine = AVB_SHA_ENGINE_SCALAR;
+STATIC AvbSHAEngine Sha512Engine = AVB_SHA_ENGINE_SCALAR;
+
+STATIC CONST CHAR8 *ShaEngineName[] = {
+  [AVB_SHA_ENGINE_SCALAR] = "scalar",
+  [AVB_SHA_ENGINE_CE] = "crypto extensions",
+  [AVB_SHA_ENGINE_HASH2] = "Hash2 protocol",
+};
+
+/* Performance counter ticks spent in the digest updates of the partition
+ * being verified, and the bytes hashed in them.
+ */
+STATIC UINT64 ShaTicks;
+STATIC UINT64 ShaBytes;
+
+#if defined(MDE_CPU_AARCH64)
+/* FIPS 180-2 two block test vectors, an engine is only used once it
+ * reproduces these.
+ */
+STATIC CONST CHAR8 Sha256KatMsg[] =
+    "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+STATIC CONST UINT8 Sha256KatDigest[AVB_SHA256_DIGEST_SIZE] = {
+    0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26,
+    0x93, 0x0c, 0x3e, 0x60, 0x39, 0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff,
+    0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1};
+
+STATIC CONST CHAR8 Sha512KatMsg[] =
+    "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+    "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu";
+STATIC CONST UINT8 Sha512KatDigest[AVB_SHA512_DIGEST_SIZE] = {
+    0x8e, 0x95, 0x9b, 0x75, 0xda, 0xe3, 0x13, 0xda, 0x8c, 0xf4, 0xf7,
+    0x28, 0x14, 0xfc, 0x14, 0x3f, 0x8f, 0x77, 0x79, 0xc6, 0xeb, 0x9f,
+    0x7f, 0xa1, 0x72, 0x99, 0xae, 0xad, 0xb6, 0x88, 0x90, 0x18, 0x50,
+    0x1d, 0x28, 0x9e, 0x49, 0x00, 0xf7, 0xe4, 0x33, 0x1b, 0x99, 0xde,
+    0xc4, 0xb5, 0x43, 0x3a, 0xc7, 0xd3, 0x29, 0xee, 0xb6, 0xdd, 0x26,
+    0x54, 0x5e, 0x96, 0xe5, 0x5b, 0x87, 0x4b, 0xe9, 0x09};
+
+STATIC UINTN
+ShaCeLevel (VOID)
+{
+  return (AvbShaCeFeatures () >> ID_AA64ISAR0_SHA2_SHIFT) &
+         ID_AA64ISAR0_SHA2_MASK;
+}
+
+/* Called with Sha256Engine already set to the engine under test */
+STATIC BOOLEAN
+Sha256KatPassed (VOID)
+{
+  AvbSHA256Ctx Ctx;
+
+  avb_sha256_sw_init (&Ctx);
+  avb_sha256_sw_update (&Ctx, (CONST UINT8 *)Sha256KatMsg,
+                        AsciiStrLen (Sha256KatMsg));
+  return CompareMem (avb_sha256_sw_final (&Ctx), Sha256KatDigest,
+                     sizeof (Sha256KatDigest)) == 0;
+}
+
+STATIC BOOLEAN
+Sha512KatPassed (VOID)
+{
+  AvbSHA512Ctx Ctx;
+
+  avb_sha512_init (&Ctx);
+  avb_sha512_update (&Ctx, (CONST UINT8 *)Sha512KatMsg,
+                     AsciiStrLen (Sha512KatMsg));
+  return CompareMem (avb_sha512_final (&Ctx), Sha512KatDigest,
+                     sizeof (Sha512KatDigest)) == 0;
+}
+#endif
+
+/* Crypto Extensions are preferred, they run in the caller's context
+ * without a protocol round trip per update. The Hash2 protocol comes next
+ * and the scalar C code is the last resort.
+ */
+AvbSHAEngine
+avb_sha256_engine (VOID)
+{
+  EFI_STATUS Status;
+  EFI_HASH2_PROTOCOL *pEfiHash2Protocol = NULL;
+
+  if (Sha256EngineSelected) {
+    return Sha256Engine;
+  }
+  Sha256EngineSelected = TRUE;
+  Sha256Engine = AVB_SHA_ENGINE_SCALAR;
+
+#if defined(MDE_CPU_AARCH64)
+  if (ShaCeLevel () >= ID_AA64ISAR0_SHA2_SHA256) {
+    Sha256Engine = AVB_SHA_ENGINE_CE;
+    if (!Sha256KatPassed ()) {
+      DEBUG ((EFI_D_ERROR, "SHA-256 crypto extensions failed self test\n"));
+      Sha256Engine = AVB_SHA_ENGINE_SCALAR;
+    }
+  }
+#endif
+
+  if (Sha256Engine == AVB_SHA_ENGINE_SCALAR) {
+    Status = gBS->LocateProtocol (&gEfiHash2ProtocolGuid, NULL,
+                                  (VOID **)&pEfiHash2Protocol);
+    if (Status == EFI_SUCCESS &&
+        pEfiHash2Protocol != NULL) {
+      Sha256Engine = AVB_SHA_ENGINE_HASH2;
+    }
+  }
+
+  DEBUG ((EFI_D_VERBOSE, "SHA-256 engine: %a\n", ShaEngineName[Sha256Engine]));
+  return Sha256Engine;
+}
+
+AvbSHAEngine
+avb_sha512_engine (VOID)
+{
+  if (Sha512EngineSelected) {
+    return Sha512Engine;
+  }
+  Sha512EngineSelected = TRUE;
+  Sha512Engine = AVB_SHA_ENGINE_SCALAR;
+
+#if defined(MDE_CPU_AARCH64)
+  if (ShaCeLevel () >= ID_AA64ISAR0_SHA2_SHA512) {
+    Sha512Engine = AVB_SHA_ENGINE_CE;
+    if (!Sha512KatPassed ()) {
+      DEBUG ((EFI_D_ERROR, "SHA-512 crypto extensions failed self test\n"));
+      Sha512Engine = AVB_SHA_ENGINE_SCALAR;
+    }
+  }
+#endif
+
+  DEBUG ((EFI_D_VERBOSE, "SHA-512 engine: %a\n", ShaEngineName[Sha512Engine]));
+  return Sha512Engine;
+}
+
+uint64_t
+avb_sha_timestamp (VOID)
+{
+  return GetPerformanceCounter ();
+}
+
+VOID
+avb_sha_account (uint64_t Start, size_t Len)
+{
+  ShaTicks += GetPerformanceCounter () - Start;
+  ShaBytes += Len;
+}
+
+VOID
+avb_sha_account_reset (VOID)
+{
+  ShaTicks = 0;
+  ShaBytes = 0;
+}
+
+/* Logs the hashing throughput of a partition, this is the number to look
+ * at when comparing the engines on a target.
+ */
+VOID
+avb_sha_report (CONST CHAR8 *PartName, bool Sha512)
+{
+  UINT64 Freq;
+  UINT64 Us;
+  UINT64 MiBps = 0;
+
+  Freq = GetPerformanceCounterProperties (NULL, NULL);
+  if (Freq != 0 &&
+      ShaTicks != 0) {
+    Us = DivU64x64Remainder (MultU64x32 (ShaTicks, 1000000), Freq, NULL);
+    MiBps = DivU64x64Remainder (MultU64x64 (ShaBytes, Freq), ShaTicks,
+                                NULL) >> 20;
+  } else {
+    Us = 0;
+  }
+
+  DEBUG ((EFI_D_INFO, "%a: SHA-%d (%a) hashed %lu KiB in %lu us, %lu MiB/s\n",
+          PartName, Sha512 ? 512 : 256,
+          ShaEngineName[Sha512 ? avb_sha512_engine () : avb_sha256_engine ()],
+          ShaBytes >> 10, Us, MiBps));
+}
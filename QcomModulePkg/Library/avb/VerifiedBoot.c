@@ -67,6 +67,7 @@
 #include <Library/MenuKeysDetection.h>
 #include <Library/VerifiedBootMenu.h>
 #include <Library/LEOEMCertificate.h>
+#include <Library/VbCache.h>
 
 STATIC CONST CHAR8 *VerityMode = " androidboot.veritymode=";
 STATIC CONST CHAR8 *VerifiedState = " androidboot.verifiedbootstate=";
@@ -77,6 +78,8 @@ STATIC CONST CHAR8 *Space = " ";
 
 #define MAX_NUM_REQ_PARTITION    8
 #define MAX_PROPERTY_SIZE        10
+/* Covers the ext4 superblock and the first group descriptors */
+#define SYSTEM_ROOT_CHECK_SIZE   (2 * SIZE_4KB)
 
 static CHAR8 *avb_verify_partition_name[] = {
      "boot",
@@ -1030,6 +1033,55 @@ ComputeVbMetaDigest (AvbSlotVerifyData* SlotData, CHAR8* Digest) {
   avb_memcpy (Digest, avb_sha256_final(&Ctx), AVB_SHA256_DIGEST_SIZE);
 }
 
+/* With system as root the kernel mounts system without a ramdisk, check
+ * the start of the file system against the hashtree here so that a
+ * corrupted system is caught before jumping to the kernel. Only the
+ * tree blocks on the path of these blocks are read.
+ */
+STATIC EFI_STATUS
+VerifySystemRoot (AvbOps *Ops, AvbSlotVerifyData *SlotData,
+                  CONST CHAR8 *SlotSuffix)
+{
+  AvbHashtreeVerifier *Verifier = NULL;
+  AvbSlotVerifyResult Result;
+  UINT8 *Buffer = NULL;
+  EFI_STATUS Status = EFI_SUCCESS;
+
+  Result = avb_hashtree_verifier_new (Ops, SlotData, "system", SlotSuffix,
+                                      &Verifier);
+  if (Result == AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_ARGUMENT) {
+    DEBUG ((EFI_D_VERBOSE, "No system hashtree to check\n"));
+    return EFI_SUCCESS;
+  } else if (Result != AVB_SLOT_VERIFY_RESULT_OK) {
+    DEBUG ((EFI_D_ERROR, "System hashtree unusable: %a\n",
+            avb_slot_verify_result_to_string (Result)));
+    return EFI_UNSUPPORTED;
+  }
+
+  Buffer = avb_malloc (SYSTEM_ROOT_CHECK_SIZE);
+  if (Buffer == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out;
+  }
+
+  Result = avb_hashtree_verifier_read (Verifier, 0, SYSTEM_ROOT_CHECK_SIZE,
+                                       Buffer);
+  if (Result == AVB_SLOT_VERIFY_RESULT_ERROR_VERIFICATION) {
+    Status = EFI_SECURITY_VIOLATION;
+  } else if (Result != AVB_SLOT_VERIFY_RESULT_OK) {
+    Status = EFI_DEVICE_ERROR;
+  }
+  DEBUG ((EFI_D_VERBOSE, "System hashtree check: %a\n",
+          avb_slot_verify_result_to_string (Result)));
+
+out:
+  if (Buffer != NULL) {
+    avb_free (Buffer);
+  }
+  avb_hashtree_verifier_free (Verifier);
+  return Status;
+}
+
 static UINT32 ParseBootSecurityLevel (CONST CHAR8 *BootSecurityLevel,
                                       size_t BootSecurityLevelSize)
 {
@@ -1336,6 +1388,26 @@ LoadImageAndAuthVB2 (BootInfo *Info)
 
   DEBUG ((EFI_D_VERBOSE, "Total loaded partition %d\n", Info->NumLoadedImages));
 
+  if (IsBuildAsSystemRootImage () &&
+      !IsDynamicPartitionSupport ()) {
+    Status = VerifySystemRoot (Ops, SlotData, SlotSuffix);
+    /* Only a mismatch is fatal, and only where dm-verity would refuse
+     * to mount it as well. Recovery has to stay reachable to repair it.
+     */
+    if (Status == EFI_SECURITY_VIOLATION &&
+        !AllowVerificationError &&
+        !Info->BootIntoRecovery) {
+      DEBUG ((EFI_D_ERROR, "ERROR: System does not match its hashtree\n"));
+      Status = EFI_LOAD_ERROR;
+      Info->BootState = RED;
+      goto out;
+    } else if (Status != EFI_SUCCESS) {
+      DEBUG ((EFI_D_WARN, "System hashtree check failed: %r, continuing\n",
+              Status));
+    }
+    Status = EFI_SUCCESS;
+  }
+
   VBData = (VB2Data *)avb_calloc (sizeof (VB2Data));
   if (VBData == NULL) {
     DEBUG ((EFI_D_ERROR, "ERROR: Failed to allocate VB2Data\n"));
@@ -1436,6 +1508,9 @@ LoadImageAndAuthVB2 (BootInfo *Info)
   GUARD_OUT (KeyMasterSetRotAndBootState (&Data));
   ComputeVbMetaDigest (SlotData, (CHAR8 *)&Digest);
   GUARD_OUT (SetVerifiedBootHash ((CONST CHAR8 *)&Digest, sizeof(Digest)));
+  if (AllowVerificationError) {
+    VbCacheStore ((CONST UINT8 *)Digest, sizeof (Digest));
+  }
   DEBUG ((EFI_D_INFO, "VB2: Authenticate complete! boot state is: %a\n",
           VbSn[Info->BootState].name));
 
@@ -61,8 +61,30 @@
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
 #include <Library/MemoryAllocationLib.h>
+#include <Library/ThreadStack.h>
+#include <Library/VbCache.h>
 #include <Uefi.h>
 
+/* Hash partitions are read in chunks of this size so that the hash of one
+ * chunk overlaps with the read of the next one.
+ */
+#define AVB_HASH_CHUNK_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+	Semaphore *ChunkReady;
+	CONST UINT8 *Buffer;
+	volatile UINTN ReadBytes;
+	volatile BOOLEAN Done;
+	UINTN HashBytes;
+	UINTN HashedBytes;
+	void (*HashUpdate)(void *HashCtx, const uint8_t *Data, size_t Len);
+	VOID *HashCtx;
+} AvbHashPipeline;
+
+STATIC EFI_KERNEL_PROTOCOL *KernIntf = NULL;
+STATIC BOOLEAN HashThreadChecked = FALSE;
+STATIC BOOLEAN HashThreadSupported = FALSE;
+
 STATIC AvbIOResult GetHandleInfo(const char *Partition, HandleInfo *HandleInfo)
 {
 	EFI_STATUS Status = EFI_SUCCESS;
@@ -310,6 +332,241 @@ out:
 	return Result;
 }
 
+/* Hash everything that has been read so far. */
+STATIC VOID HashPipelineCatchUp(AvbHashPipeline *Pipeline)
+{
+	UINTN Limit = MIN(Pipeline->ReadBytes, Pipeline->HashBytes);
+
+	if (Limit > Pipeline->HashedBytes) {
+		Pipeline->HashUpdate(Pipeline->HashCtx,
+		                     Pipeline->Buffer + Pipeline->HashedBytes,
+		                     Limit - Pipeline->HashedBytes);
+		Pipeline->HashedBytes = Limit;
+	}
+}
+
+INT32 __attribute__ ( (no_sanitize ("safe-stack")))
+HashPipelineThread(VOID *Arg)
+{
+	Thread *CurrentThread = KernIntf->Thread->GetCurrentThread();
+	AvbHashPipeline *Pipeline = (AvbHashPipeline *)Arg;
+	BOOLEAN Done;
+
+	do {
+		KernIntf->Sem->SemWait(Pipeline->ChunkReady);
+		/* Sample Done first, the final ReadBytes is published before it */
+		Done = Pipeline->Done;
+		MemoryFence();
+		HashPipelineCatchUp(Pipeline);
+	} while (!Done && Pipeline->HashedBytes < Pipeline->HashBytes);
+
+	ThreadStackNodeRemove(CurrentThread);
+	KernIntf->Thread->ThreadExit(0);
+
+	return 0;
+}
+
+/* The hash only runs on its own thread when another CPU can pick it up,
+ * otherwise it is done inline after every chunk.
+ */
+STATIC BOOLEAN IsHashThreadSupported(VOID)
+{
+	EFI_STATUS Status;
+
+	if (HashThreadChecked) {
+		return HashThreadSupported;
+	}
+	HashThreadChecked = TRUE;
+
+	Status = gBS->LocateProtocol(&gEfiKernelProtocolGuid, NULL,
+	                             (VOID **)&KernIntf);
+	if ((Status != EFI_SUCCESS) ||
+	    (KernIntf == NULL) ||
+	    KernIntf->Version < EFI_KERNEL_PROTOCOL_VER_UNSAFE_STACK_APIS) {
+		DEBUG((EFI_D_VERBOSE, "Hash thread is not supported.\n"));
+		return FALSE;
+	}
+
+	if (KernIntf->MpCpu->MpcoreGetAvailCpuCount() < 2) {
+		DEBUG((EFI_D_VERBOSE, "Single CPU, hash partitions inline.\n"));
+		return FALSE;
+	}
+
+	HashThreadSupported = TRUE;
+	return TRUE;
+}
+
+STATIC Thread *HashPipelineStart(AvbHashPipeline *Pipeline)
+{
+	Thread *HashThread = NULL;
+
+	if (!IsHashThreadSupported()) {
+		return NULL;
+	}
+
+	Pipeline->ChunkReady = KernIntf->Sem->SemInit(0, 0);
+	if (Pipeline->ChunkReady == NULL) {
+		return NULL;
+	}
+
+	HashThread = KernIntf->Thread->ThreadCreate("AvbHashThread",
+	                HashPipelineThread, (VOID *)Pipeline,
+	                UEFI_THREAD_PRIORITY, DEFAULT_STACK_SIZE);
+	if (HashThread == NULL) {
+		goto err;
+	}
+
+	AllocateUnSafeStackPtr(HashThread);
+
+	if (KernIntf->Thread->ThreadResume(HashThread) != 0) {
+		DEBUG((EFI_D_ERROR, "Failed to start hash thread\n"));
+		ThreadStackNodeRemove(HashThread);
+		goto err;
+	}
+
+	return HashThread;
+
+err:
+	KernIntf->Sem->SemDestroy(Pipeline->ChunkReady);
+	Pipeline->ChunkReady = NULL;
+	return NULL;
+}
+
+STATIC VOID HashPipelinePublish(AvbHashPipeline *Pipeline, UINTN ReadBytes,
+                                Thread *HashThread)
+{
+	Pipeline->ReadBytes = ReadBytes;
+	if (HashThread == NULL) {
+		HashPipelineCatchUp(Pipeline);
+		return;
+	}
+
+	MemoryFence();
+	KernIntf->Sem->SemPost(Pipeline->ChunkReady, FALSE);
+}
+
+STATIC VOID HashPipelineStop(AvbHashPipeline *Pipeline, Thread *HashThread)
+{
+	INT32 RetCode = 0;
+
+	if (HashThread == NULL) {
+		return;
+	}
+
+	MemoryFence();
+	Pipeline->Done = TRUE;
+	KernIntf->Sem->SemPost(Pipeline->ChunkReady, TRUE);
+	KernIntf->Thread->ThreadJoin(HashThread, &RetCode, INFINITE_TIME);
+	KernIntf->Sem->SemDestroy(Pipeline->ChunkReady);
+	Pipeline->ChunkReady = NULL;
+}
+
+AvbIOResult
+AvbReadAndHashFromPartition(AvbOps *Ops, const char *Partition,
+                            size_t NumBytes, void *Buffer,
+                            size_t HashNumBytes,
+                            void (*HashUpdate)(void *HashCtx,
+                                               const uint8_t *Data,
+                                               size_t Len),
+                            void *HashCtx, size_t *OutNumRead)
+{
+	AvbIOResult Result = AVB_IO_RESULT_OK;
+	EFI_STATUS Status = EFI_SUCCESS;
+	VOID *Page = NULL;
+	HandleInfo InfoList[1];
+	EFI_BLOCK_IO_PROTOCOL *BlockIo = NULL;
+	UINTN PartitionSize = 0;
+	UINT32 PageSize = 0;
+	UINTN FullBytes = 0;
+	UINTN ChunkSize = 0;
+	AvbHashPipeline Pipeline;
+	Thread *HashThread = NULL;
+	UINT64 LoadImageStartTime = GetTimerCountms();
+
+	if (Partition == NULL || Buffer == NULL || OutNumRead == NULL ||
+	    HashUpdate == NULL || NumBytes == 0) {
+		DEBUG((EFI_D_ERROR, "bad input paramaters\n"));
+		return AVB_IO_RESULT_ERROR_IO;
+	}
+	*OutNumRead = 0;
+
+	Result = GetHandleInfo(Partition, InfoList);
+	if (Result != AVB_IO_RESULT_OK) {
+		DEBUG((EFI_D_ERROR,
+		       "AvbReadAndHashFromPartition: GetHandleInfo failed"));
+		return Result;
+	}
+
+	BlockIo = InfoList[0].BlkIo;
+	PartitionSize = GetPartitionSize(BlockIo);
+	if (!PartitionSize) {
+		return AVB_IO_RESULT_ERROR_RANGE_OUTSIDE_PARTITION;
+	}
+
+	if (NumBytes > PartitionSize) {
+		NumBytes = PartitionSize;
+	}
+
+	PageSize = BlockIo->Media->BlockSize;
+	FullBytes = NumBytes - (NumBytes % PageSize);
+
+	SetMem(&Pipeline, sizeof(Pipeline), 0);
+	Pipeline.Buffer = Buffer;
+	Pipeline.HashBytes = MIN(HashNumBytes, NumBytes);
+	Pipeline.HashUpdate = HashUpdate;
+	Pipeline.HashCtx = HashCtx;
+
+	HashThread = HashPipelineStart(&Pipeline);
+
+	while (Pipeline.ReadBytes < FullBytes) {
+		ChunkSize = MIN(AVB_HASH_CHUNK_SIZE, FullBytes - Pipeline.ReadBytes);
+		Status = BlockIo->ReadBlocks(BlockIo, BlockIo->Media->MediaId,
+		                             Pipeline.ReadBytes / PageSize,
+		                             ChunkSize,
+		                             (UINT8 *)Buffer + Pipeline.ReadBytes);
+		if (Status != EFI_SUCCESS) {
+			DEBUG((EFI_D_ERROR, "ReadBlocks failed %r\n", Status));
+			Result = AVB_IO_RESULT_ERROR_IO;
+			goto out;
+		}
+		HashPipelinePublish(&Pipeline, Pipeline.ReadBytes + ChunkSize,
+		                    HashThread);
+	}
+
+	if (FullBytes < NumBytes) {
+		/* Tail of the image does not end on a block boundary */
+		Page = avb_malloc(PageSize);
+		if (Page == NULL) {
+			DEBUG((EFI_D_ERROR, "Allocate for partial read failed!"));
+			Result = AVB_IO_RESULT_ERROR_OOM;
+			goto out;
+		}
+
+		Status = BlockIo->ReadBlocks(BlockIo, BlockIo->Media->MediaId,
+		                             FullBytes / PageSize, PageSize, Page);
+		if (Status != EFI_SUCCESS) {
+			DEBUG((EFI_D_ERROR, "ReadBlocks failed %r\n", Status));
+			Result = AVB_IO_RESULT_ERROR_IO;
+			goto out;
+		}
+		avb_memcpy((UINT8 *)Buffer + FullBytes, Page, NumBytes - FullBytes);
+		HashPipelinePublish(&Pipeline, NumBytes, HashThread);
+	}
+
+	*OutNumRead = NumBytes;
+
+out:
+	HashPipelineStop(&Pipeline, HashThread);
+
+	if (Page != NULL) {
+		avb_free(Page);
+	}
+
+	DEBUG((EFI_D_INFO, "Load and hash Image %a total time: %lu ms \n",
+	       Partition, GetTimerCountms() - LoadImageStartTime));
+	return Result;
+}
+
 AvbIOResult AvbWriteToPartition(AvbOps *Ops, const char *Partition, int64_t Offset,
                                 size_t NumBytes, const void *Buffer)
 {
@@ -601,6 +858,22 @@ AvbIOResult AvbGetSizeOfPartition(AvbOps *Ops, const char *Partition, uint64_t *
 	return AVB_IO_RESULT_OK;
 }
 
+bool AvbIsDigestCached(AvbOps *Ops, const char *Partition,
+                       const uint8_t *VbMetaDigest, const uint8_t *Digest,
+                       size_t DigestLen, const uint8_t *Data, size_t DataSize)
+{
+	return VbCacheLookup(Partition, VbMetaDigest, AVB_SHA256_DIGEST_SIZE,
+	                     Digest, DigestLen, Data, DataSize);
+}
+
+void AvbCacheDigest(AvbOps *Ops, const char *Partition,
+                    const uint8_t *VbMetaDigest, const uint8_t *Digest,
+                    size_t DigestLen, const uint8_t *Data, size_t DataSize)
+{
+	VbCacheUpdate(Partition, VbMetaDigest, AVB_SHA256_DIGEST_SIZE,
+	              Digest, DigestLen, Data, DataSize);
+}
+
 AvbOps *AvbOpsNew(VOID *UserData)
 {
 	AvbOps *Ops = avb_calloc(sizeof(AvbOps));
@@ -620,6 +893,15 @@ AvbOps *AvbOpsNew(VOID *UserData)
 	Ops->read_is_device_unlocked = AvbReadIsDeviceUnlocked;
 	Ops->get_unique_guid_for_partition = AvbGetUniqueGuidForPartition;
 	Ops->get_size_of_partition = AvbGetSizeOfPartition;
+	Ops->read_and_hash_from_partition = AvbReadAndHashFromPartition;
+
+	/* Digests kept across boots are only trusted when verification
+	 * errors would be ignored anyway.
+	 */
+	if (IsUnlocked()) {
+		Ops->is_digest_cached = AvbIsDigestCached;
+		Ops->cache_digest = AvbCacheDigest;
+	}
 
 out:
 	return Ops;
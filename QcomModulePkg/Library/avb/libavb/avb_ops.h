@@ -247,6 +247,55 @@ struct AvbOps {
       bool* out_is_trusted,
       uint32_t* out_rollback_index_location);
 
+  /* Optional. Like read_from_partition() with |offset| 0, except that the
+   * first |hash_num_bytes| bytes of the data are also passed to
+   * |hash_update| while the rest of the partition is still being read.
+   * The hash callback is invoked in order and may run on another thread
+   * than the caller; it is guaranteed to have returned for the last time
+   * before this function returns.
+   *
+   * If NULL, read_from_partition() is used and the data is hashed by the
+   * caller once it has been fully loaded.
+   */
+  AvbIOResult (*read_and_hash_from_partition)(
+      AvbOps* ops,
+      const char* partition,
+      size_t num_bytes,
+      void* buffer,
+      size_t hash_num_bytes,
+      void (*hash_update)(void* hash_ctx, const uint8_t* data, size_t len),
+      void* hash_ctx,
+      size_t* out_num_read);
+
+  /* Optional. Returns true if the |data_size| bytes of |partition| just
+   * read into |data| are known to hash to |digest| from a descriptor in
+   * the vbmeta image whose SHA-256 is |vbmeta_digest|, in which case they
+   * are not hashed again. Only meant to be set when verification errors
+   * are allowed anyway since the answer comes from unprotected storage.
+   *
+   * It is first called with |data| set to NULL before anything is read,
+   * only when that returns true the partition is read with
+   * read_from_partition() and checked again with its data. Otherwise
+   * the partition is hashed while it is being read.
+   */
+  bool (*is_digest_cached)(AvbOps* ops,
+                           const char* partition,
+                           const uint8_t* vbmeta_digest,
+                           const uint8_t* digest,
+                           size_t digest_len,
+                           const uint8_t* data,
+                           size_t data_size);
+
+  /* Optional. Called after the data of |partition| was hashed and
+   * matched |digest|, so that is_digest_cached() can report it later.
+   */
+  void (*cache_digest)(AvbOps* ops,
+                       const char* partition,
+                       const uint8_t* vbmeta_digest,
+                       const uint8_t* digest,
+                       size_t digest_len,
+                       const uint8_t* data,
+                       size_t data_size);
 };
 
 typedef struct {
@@ -62,6 +62,48 @@ typedef struct {
   uint8_t buf[AVB_SHA512_DIGEST_SIZE]; /* Used for storing the final digest. */
 } AvbSHA512Ctx;
 
+/* Engines that can back the digest functions below. The engine is picked
+ * once, at first use, from what the platform provides; the scalar C code is
+ * always available as a fallback.
+ */
+typedef enum {
+  AVB_SHA_ENGINE_SCALAR,
+  AVB_SHA_ENGINE_CE,    /* ARMv8 Crypto Extensions, AArch64 only */
+  AVB_SHA_ENGINE_HASH2, /* EFI_HASH2_PROTOCOL, SHA-256 only */
+} AvbSHAEngine;
+
+/* Returns the engine used for SHA-256 and SHA-512 respectively. */
+AvbSHAEngine avb_sha256_engine(void);
+AvbSHAEngine avb_sha512_engine(void);
+
+/* Throughput accounting of the partition hashes. avb_sha_account() adds
+ * |len| bytes hashed since |start|, a value from avb_sha_timestamp().
+ * avb_sha_report() logs the total for |part_name|, avb_sha_account_reset()
+ * starts a new one.
+ */
+uint64_t avb_sha_timestamp(void);
+void avb_sha_account(uint64_t start, size_t len);
+void avb_sha_account_reset(void);
+void avb_sha_report(const char* part_name, bool sha512);
+
+#if defined(MDE_CPU_AARCH64)
+/* Crypto Extensions block transforms, |blocks| full blocks of |data| are
+ * hashed into |state|.
+ */
+void AvbSha256CeTransform(uint32_t* state, const uint8_t* data, size_t blocks);
+void AvbSha512CeTransform(uint64_t* state, const uint8_t* data, size_t blocks);
+uint64_t AvbShaCeFeatures(void);
+#endif
+
+/* Software SHA-256 (Crypto Extensions or scalar C), used when the SHA-256
+ * engine is not EFI_HASH2_PROTOCOL or when the protocol fails.
+ */
+void avb_sha256_sw_init(AvbSHA256Ctx* ctx);
+void avb_sha256_sw_update(AvbSHA256Ctx* ctx,
+                          const uint8_t* data,
+                          uint32_t len);
+uint8_t* avb_sha256_sw_final(AvbSHA256Ctx* ctx) AVB_ATTR_WARN_UNUSED_RESULT;
+
 /* Initializes the SHA-256 context. */
 void avb_sha256_init(AvbSHA256Ctx* ctx);
 
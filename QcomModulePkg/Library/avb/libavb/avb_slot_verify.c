@@ -54,6 +54,7 @@
 #include "avb_chain_partition_descriptor.h"
 #include "avb_footer.h"
 #include "avb_hash_descriptor.h"
+#include "avb_hashtree_descriptor.h"
 #include "avb_kernel_cmdline_descriptor.h"
 #include "avb_sha.h"
 #include "avb_util.h"
@@ -98,12 +99,31 @@ static inline bool result_should_continue(AvbSlotVerifyResult result) {
   return false;
 }
 
+static void hash_update_sha256(void* hash_ctx,
+                               const uint8_t* data,
+                               size_t len) {
+  uint64_t start = avb_sha_timestamp();
+
+  avb_sha256_update((AvbSHA256Ctx*)hash_ctx, data, len);
+  avb_sha_account(start, len);
+}
+
+static void hash_update_sha512(void* hash_ctx,
+                               const uint8_t* data,
+                               size_t len) {
+  uint64_t start = avb_sha_timestamp();
+
+  avb_sha512_update((AvbSHA512Ctx*)hash_ctx, data, len);
+  avb_sha_account(start, len);
+}
+
 static AvbSlotVerifyResult load_and_verify_hash_partition(
     AvbOps* ops,
     const char* const* requested_partitions,
     const char* ab_suffix,
     bool allow_verification_error,
     const AvbDescriptor* descriptor,
+    const uint8_t* vbmeta_digest,
     AvbSlotVerifyData* slot_data) {
   AvbHashDescriptor hash_desc;
   AvbSHA256Ctx sha256_ctx;
@@ -120,6 +140,10 @@ static AvbSlotVerifyResult load_and_verify_hash_partition(
   size_t digest_len;
   const char* found;
   uint64_t image_size;
+  uint64_t hash_size;
+  void (*hash_update)(void* hash_ctx, const uint8_t* data, size_t len);
+  void* hash_ctx = NULL;
+  bool cached = false;
   static bool bootImgLoaded = FALSE;
   static bool vendorBootImgLoaded = FALSE;
 
@@ -184,6 +208,36 @@ static AvbSlotVerifyResult load_and_verify_hash_partition(
     avb_debugv (part_name, ": Loading entire partition.\n", NULL);
   }
 
+  /* Pick the hash up front so that it can be updated while the
+   * partition is being read.
+   */
+  avb_sha_account_reset();
+  if (Avb_StrnCmp ( (CONST CHAR8*)hash_desc.hash_algorithm, "sha256",
+                 avb_strlen ("sha256")) == 0) {
+    avb_sha256_init(&sha256_ctx);
+    avb_sha256_update(&sha256_ctx, desc_salt, hash_desc.salt_len);
+    hash_update = hash_update_sha256;
+    hash_ctx = &sha256_ctx;
+    digest_len = AVB_SHA256_DIGEST_SIZE;
+  } else if (Avb_StrnCmp ( (CONST CHAR8*)hash_desc.hash_algorithm, "sha512",
+                  avb_strlen ("sha512")) == 0) {
+    avb_sha512_init(&sha512_ctx);
+    avb_sha512_update(&sha512_ctx, desc_salt, hash_desc.salt_len);
+    hash_update = hash_update_sha512;
+    hash_ctx = &sha512_ctx;
+    digest_len = AVB_SHA512_DIGEST_SIZE;
+  } else {
+    avb_errorv(part_name, ": Unsupported hash algorithm.\n", NULL);
+    ret = AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_METADATA;
+    goto out;
+  }
+
+  /* The partition may be smaller than the hashed image when verification
+   * errors are allowed, the digest then simply won't match.
+   */
+  hash_size = hash_desc.image_size < image_size ? hash_desc.image_size
+                                                : image_size;
+
   image_buf = avb_malloc(image_size);
   if (image_buf == NULL) {
     ret = AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
@@ -197,8 +251,49 @@ static AvbSlotVerifyResult load_and_verify_hash_partition(
     BootStatsSetTimeStamp (BS_KERNEL_LOAD_START);
   }
 
-  io_ret = ops->read_from_partition(
-      ops, part_name, 0 /* offset */, image_size, image_buf, &part_num_read);
+  /* Only a partition with a cached digest is read before it is hashed,
+   * the data is needed to check that it did not change. Anything else is
+   * hashed while it is being read.
+   */
+  if (ops->is_digest_cached != NULL && vbmeta_digest != NULL &&
+      digest_len == hash_desc.digest_len &&
+      ops->is_digest_cached(ops,
+                            part_name,
+                            vbmeta_digest,
+                            desc_digest,
+                            digest_len,
+                            NULL,
+                            image_size)) {
+    io_ret = ops->read_from_partition(
+        ops, part_name, 0 /* offset */, image_size, image_buf, &part_num_read);
+    if (io_ret == AVB_IO_RESULT_OK && part_num_read == image_size) {
+      cached = ops->is_digest_cached(ops,
+                                     part_name,
+                                     vbmeta_digest,
+                                     desc_digest,
+                                     digest_len,
+                                     image_buf,
+                                     image_size);
+      if (!cached) {
+        hash_update(hash_ctx, image_buf, hash_size);
+      }
+    }
+  } else if (ops->read_and_hash_from_partition != NULL) {
+    io_ret = ops->read_and_hash_from_partition(ops,
+                                               part_name,
+                                               image_size,
+                                               image_buf,
+                                               hash_size,
+                                               hash_update,
+                                               hash_ctx,
+                                               &part_num_read);
+  } else {
+    io_ret = ops->read_from_partition(
+        ops, part_name, 0 /* offset */, image_size, image_buf, &part_num_read);
+    if (io_ret == AVB_IO_RESULT_OK && part_num_read == image_size) {
+      hash_update(hash_ctx, image_buf, hash_size);
+    }
+  }
   if (io_ret == AVB_IO_RESULT_ERROR_OOM) {
     ret = AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
     goto out;
@@ -223,25 +318,20 @@ static AvbSlotVerifyResult load_and_verify_hash_partition(
     BootStatsSetTimeStamp (BS_KERNEL_LOAD_DONE);
   }
 
-  if (Avb_StrnCmp ( (CONST CHAR8*)hash_desc.hash_algorithm, "sha256",
-                 avb_strlen ("sha256")) == 0) {
-    avb_sha256_init(&sha256_ctx);
-    avb_sha256_update(&sha256_ctx, desc_salt, hash_desc.salt_len);
-    avb_sha256_update(&sha256_ctx, image_buf, hash_desc.image_size);
+  if (cached) {
+    avb_debugv(part_name, ": success: Digest matched on an earlier boot\n",
+               NULL);
+    ret = AVB_SLOT_VERIFY_RESULT_OK;
+    goto out;
+  }
+
+  if (hash_ctx == &sha256_ctx) {
     digest = avb_sha256_final(&sha256_ctx);
-    digest_len = AVB_SHA256_DIGEST_SIZE;
-  } else if (Avb_StrnCmp ( (CONST CHAR8*)hash_desc.hash_algorithm, "sha512",
-                  avb_strlen ("sha512")) == 0) {
-    avb_sha512_init(&sha512_ctx);
-    avb_sha512_update(&sha512_ctx, desc_salt, hash_desc.salt_len);
-    avb_sha512_update(&sha512_ctx, image_buf, hash_desc.image_size);
-    digest = avb_sha512_final(&sha512_ctx);
-    digest_len = AVB_SHA512_DIGEST_SIZE;
   } else {
-    avb_errorv(part_name, ": Unsupported hash algorithm.\n", NULL);
-    ret = AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_METADATA;
-    goto out;
+    digest = avb_sha512_final(&sha512_ctx);
   }
+  avb_sha_report(part_name, hash_ctx == &sha512_ctx);
+  hash_ctx = NULL;
 
   if (digest_len != hash_desc.digest_len) {
     avb_errorv(
@@ -258,11 +348,26 @@ static AvbSlotVerifyResult load_and_verify_hash_partition(
     goto out;
   } else {
     avb_debugv (part_name, ": success: Image verification completed\n", NULL);
+    if (ops->cache_digest != NULL && vbmeta_digest != NULL) {
+      ops->cache_digest(ops,
+                        part_name,
+                        vbmeta_digest,
+                        desc_digest,
+                        digest_len,
+                        image_buf,
+                        image_size);
+    }
   }
 
   ret = AVB_SLOT_VERIFY_RESULT_OK;
 
 out:
+  /* Terminate a hash left open by a failed read, the SHA-256 engine
+   * refuses to start a new one until the previous one is finalized.
+   */
+  if (hash_ctx == &sha256_ctx) {
+    digest = avb_sha256_final(&sha256_ctx);
+  }
 
   /* If it worked and something was loaded, copy to slot_data. */
   if ((ret == AVB_SLOT_VERIFY_RESULT_OK || result_should_continue(ret)) &&
@@ -407,6 +512,9 @@ static AvbSlotVerifyResult load_and_verify_vbmeta(
   bool is_main_vbmeta;
   bool look_for_vbmeta_footer;
   AvbVBMetaData* vbmeta_image_data = NULL;
+  AvbSHA256Ctx vbmeta_sha256_ctx;
+  uint8_t vbmeta_digest[AVB_SHA256_DIGEST_SIZE];
+  const uint8_t* cache_vbmeta_digest = NULL;
 
   ret = AVB_SLOT_VERIFY_RESULT_OK;
 
@@ -782,6 +890,20 @@ static AvbSlotVerifyResult load_and_verify_vbmeta(
    *   image, verify vbmeta image (includes rollback checks, hash
    *   checks, bail on chained partitions).
    */
+  /* Cached digests of hash partitions are bound to the vbmeta image
+   * that carries their descriptors.
+   */
+  if (ops->is_digest_cached != NULL) {
+    avb_sha256_init(&vbmeta_sha256_ctx);
+    avb_sha256_update(&vbmeta_sha256_ctx,
+                      vbmeta_image_data->vbmeta_data,
+                      vbmeta_image_data->vbmeta_size);
+    avb_memcpy(vbmeta_digest,
+               avb_sha256_final(&vbmeta_sha256_ctx),
+               AVB_SHA256_DIGEST_SIZE);
+    cache_vbmeta_digest = vbmeta_digest;
+  }
+
   descriptors =
       avb_descriptor_get_all(vbmeta_buf, vbmeta_num_read, &num_descriptors);
   if (descriptors == NULL) {
@@ -804,6 +926,7 @@ static AvbSlotVerifyResult load_and_verify_vbmeta(
                                                  ab_suffix,
                                                  allow_verification_error,
                                                  descriptors[n],
+                                                 cache_vbmeta_digest,
                                                  slot_data);
         if (sub_ret != AVB_SLOT_VERIFY_RESULT_OK) {
           ret = sub_ret;
@@ -1632,6 +1755,401 @@ void avb_slot_verify_data_free(AvbSlotVerifyData* data) {
   avb_free(data);
 }
 
+/* Number of verified tree blocks kept per hashtree level. */
+#define HASHTREE_CACHE_SLOTS 16
+
+/* Deepest tree accepted, a 4 KiB block SHA-512 tree of this depth
+ * already covers far more than any partition.
+ */
+#define HASHTREE_MAX_LEVELS 16
+
+struct AvbHashtreeVerifier {
+  AvbOps* ops;
+  char part_name[PART_NAME_MAX_SIZE];
+  uint64_t image_size;
+  uint64_t tree_offset;
+  uint32_t data_block_size;
+  uint32_t hash_block_size;
+  bool is_sha512;
+  size_t digest_len;
+  /* Digests are padded to a power of two inside the tree. */
+  size_t digest_size;
+  uint8_t* salt;
+  size_t salt_len;
+  uint8_t root_digest[AVB_SHA512_DIGEST_SIZE];
+  uint32_t num_levels;
+  /* Offsets from |tree_offset|, level 0 hashes the data blocks. */
+  uint64_t level_offset[HASHTREE_MAX_LEVELS];
+  uint64_t level_size[HASHTREE_MAX_LEVELS];
+  /* Per level direct mapped cache of verified tree blocks, a tag holds
+   * the block index plus one or zero when the slot is empty.
+   */
+  uint64_t* cache_tags;
+  uint8_t* cache;
+  uint8_t* block_buf;
+};
+
+static void hashtree_hash(AvbHashtreeVerifier* verifier,
+                          const uint8_t* data,
+                          size_t len,
+                          uint8_t* out_digest) {
+  if (verifier->is_sha512) {
+    AvbSHA512Ctx ctx;
+    avb_sha512_init(&ctx);
+    avb_sha512_update(&ctx, verifier->salt, verifier->salt_len);
+    avb_sha512_update(&ctx, data, len);
+    avb_memcpy(out_digest, avb_sha512_final(&ctx), AVB_SHA512_DIGEST_SIZE);
+  } else {
+    AvbSHA256Ctx ctx;
+    avb_sha256_init(&ctx);
+    avb_sha256_update(&ctx, verifier->salt, verifier->salt_len);
+    avb_sha256_update(&ctx, data, len);
+    avb_memcpy(out_digest, avb_sha256_final(&ctx), AVB_SHA256_DIGEST_SIZE);
+  }
+}
+
+static AvbSlotVerifyResult hashtree_read(AvbHashtreeVerifier* verifier,
+                                         uint64_t offset,
+                                         size_t num_bytes,
+                                         uint8_t* buffer) {
+  AvbIOResult io_ret;
+  size_t num_read;
+
+  io_ret = verifier->ops->read_from_partition(
+      verifier->ops, verifier->part_name, offset, num_bytes, buffer, &num_read);
+  if (io_ret == AVB_IO_RESULT_ERROR_OOM) {
+    return AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
+  } else if (io_ret != AVB_IO_RESULT_OK || num_read != num_bytes) {
+    avb_errorv(verifier->part_name, ": Error loading hashtree data.\n", NULL);
+    return AVB_SLOT_VERIFY_RESULT_ERROR_IO;
+  }
+  return AVB_SLOT_VERIFY_RESULT_OK;
+}
+
+/* Returns block |index| of tree level |level| once it has been checked
+ * against its parent, walking up only as far as the first cached block.
+ * Parent and child live in different cache levels, so the parent stays
+ * valid while the child is compared against it.
+ */
+static AvbSlotVerifyResult hashtree_get_block(AvbHashtreeVerifier* verifier,
+                                              uint32_t level,
+                                              uint64_t index,
+                                              const uint8_t** out_block) {
+  size_t slot = level * HASHTREE_CACHE_SLOTS + index % HASHTREE_CACHE_SLOTS;
+  uint8_t* block = verifier->cache + slot * verifier->hash_block_size;
+  uint8_t digest[AVB_SHA512_DIGEST_SIZE];
+  const uint8_t* expected;
+  AvbSlotVerifyResult ret;
+
+  if (verifier->cache_tags[slot] == index + 1) {
+    *out_block = block;
+    return AVB_SLOT_VERIFY_RESULT_OK;
+  }
+
+  if ((index + 1) * verifier->hash_block_size > verifier->level_size[level]) {
+    return AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_ARGUMENT;
+  }
+
+  verifier->cache_tags[slot] = 0;
+  ret = hashtree_read(verifier,
+                      verifier->tree_offset + verifier->level_offset[level] +
+                          index * verifier->hash_block_size,
+                      verifier->hash_block_size,
+                      block);
+  if (ret != AVB_SLOT_VERIFY_RESULT_OK) {
+    return ret;
+  }
+  hashtree_hash(verifier, block, verifier->hash_block_size, digest);
+
+  if (level + 1 == verifier->num_levels) {
+    expected = verifier->root_digest;
+  } else {
+    const uint8_t* parent;
+    uint64_t pos = index * verifier->digest_size;
+
+    ret = hashtree_get_block(
+        verifier, level + 1, pos / verifier->hash_block_size, &parent);
+    if (ret != AVB_SLOT_VERIFY_RESULT_OK) {
+      return ret;
+    }
+    expected = parent + pos % verifier->hash_block_size;
+  }
+
+  if (avb_safe_memcmp(digest, expected, verifier->digest_len) != 0) {
+    avb_errorv(verifier->part_name,
+               ": Hashtree block does not match its parent digest.\n",
+               NULL);
+    return AVB_SLOT_VERIFY_RESULT_ERROR_VERIFICATION;
+  }
+
+  verifier->cache_tags[slot] = index + 1;
+  *out_block = block;
+  return AVB_SLOT_VERIFY_RESULT_OK;
+}
+
+/* Lays out the levels the way avbtool does: level 0 holds the digests
+ * of the data blocks, each level is padded to a whole hash block and
+ * the levels are stored top level first.
+ */
+static bool hashtree_calc_levels(AvbHashtreeVerifier* verifier) {
+  uint64_t num_blocks = (verifier->image_size + verifier->data_block_size - 1) /
+                        verifier->data_block_size;
+  uint64_t size = verifier->image_size;
+  uint64_t offset = 0;
+  uint32_t level;
+
+  verifier->num_levels = 0;
+  while (size > (verifier->num_levels == 0 ? verifier->data_block_size
+                                           : verifier->hash_block_size)) {
+    uint64_t level_size;
+
+    if (verifier->num_levels == HASHTREE_MAX_LEVELS) {
+      return false;
+    }
+    level_size = num_blocks * verifier->digest_size;
+    level_size = (level_size + verifier->hash_block_size - 1) /
+                 verifier->hash_block_size * verifier->hash_block_size;
+    verifier->level_size[verifier->num_levels++] = level_size;
+    num_blocks = level_size / verifier->hash_block_size;
+    size = level_size;
+  }
+
+  for (level = verifier->num_levels; level > 0; level--) {
+    verifier->level_offset[level - 1] = offset;
+    offset += verifier->level_size[level - 1];
+  }
+  return verifier->num_levels > 0;
+}
+
+static const uint8_t* hashtree_find_descriptor(
+    const AvbSlotVerifyData* slot_data,
+    const char* partition_name,
+    AvbHashtreeDescriptor* out_desc) {
+  size_t name_len = avb_strlen(partition_name);
+  const uint8_t* found = NULL;
+  size_t n;
+
+  for (n = 0; n < slot_data->num_vbmeta_images && found == NULL; n++) {
+    const AvbDescriptor** descriptors;
+    size_t num_descriptors;
+    size_t i;
+
+    descriptors = avb_descriptor_get_all(slot_data->vbmeta_images[n].vbmeta_data,
+                                         slot_data->vbmeta_images[n].vbmeta_size,
+                                         &num_descriptors);
+    if (descriptors == NULL) {
+      continue;
+    }
+    for (i = 0; i < num_descriptors && found == NULL; i++) {
+      AvbDescriptor desc;
+      const uint8_t* desc_partition_name;
+
+      if (!avb_descriptor_validate_and_byteswap(descriptors[i], &desc) ||
+          desc.tag != AVB_DESCRIPTOR_TAG_HASHTREE ||
+          !avb_hashtree_descriptor_validate_and_byteswap(
+              (const AvbHashtreeDescriptor*)descriptors[i], out_desc)) {
+        continue;
+      }
+      desc_partition_name =
+          ((const uint8_t*)descriptors[i]) + sizeof(AvbHashtreeDescriptor);
+      if (out_desc->partition_name_len == name_len &&
+          avb_memcmp(desc_partition_name, partition_name, name_len) == 0) {
+        found = desc_partition_name;
+      }
+    }
+    avb_free(descriptors);
+  }
+  return found;
+}
+
+void avb_hashtree_verifier_free(AvbHashtreeVerifier* verifier) {
+  if (verifier == NULL) {
+    return;
+  }
+  if (verifier->salt != NULL) {
+    avb_free(verifier->salt);
+  }
+  if (verifier->cache_tags != NULL) {
+    avb_free(verifier->cache_tags);
+  }
+  if (verifier->cache != NULL) {
+    avb_free(verifier->cache);
+  }
+  if (verifier->block_buf != NULL) {
+    avb_free(verifier->block_buf);
+  }
+  avb_free(verifier);
+}
+
+AvbSlotVerifyResult avb_hashtree_verifier_new(
+    AvbOps* ops,
+    const AvbSlotVerifyData* slot_data,
+    const char* partition_name,
+    const char* ab_suffix,
+    AvbHashtreeVerifier** out_verifier) {
+  AvbHashtreeVerifier* verifier = NULL;
+  AvbHashtreeDescriptor hashtree_desc;
+  AvbVBMetaImageHeader toplevel_vbmeta;
+  const uint8_t* desc_partition_name;
+  const uint8_t* desc_salt;
+  const uint8_t* desc_root_digest;
+  size_t num_slots;
+  AvbSlotVerifyResult ret;
+
+  *out_verifier = NULL;
+  if (slot_data == NULL || slot_data->num_vbmeta_images == 0) {
+    return AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_ARGUMENT;
+  }
+
+  /* Nothing to check against if dm-verity is turned off. */
+  avb_vbmeta_image_header_to_host_byte_order(
+      (const AvbVBMetaImageHeader*)slot_data->vbmeta_images[0].vbmeta_data,
+      &toplevel_vbmeta);
+  if (toplevel_vbmeta.flags & (AVB_VBMETA_IMAGE_FLAGS_HASHTREE_DISABLED |
+                               AVB_VBMETA_IMAGE_FLAGS_VERIFICATION_DISABLED)) {
+    return AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_ARGUMENT;
+  }
+
+  desc_partition_name =
+      hashtree_find_descriptor(slot_data, partition_name, &hashtree_desc);
+  if (desc_partition_name == NULL) {
+    return AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_ARGUMENT;
+  }
+  desc_salt = desc_partition_name + hashtree_desc.partition_name_len;
+  desc_root_digest = desc_salt + hashtree_desc.salt_len;
+
+  verifier = avb_calloc(sizeof(AvbHashtreeVerifier));
+  if (verifier == NULL) {
+    return AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
+  }
+  verifier->ops = ops;
+
+  if (!avb_str_concat(verifier->part_name,
+                      sizeof verifier->part_name,
+                      partition_name,
+                      avb_strlen(partition_name),
+                      ab_suffix,
+                      avb_strlen(ab_suffix))) {
+    avb_error("Partition name and suffix does not fit.\n");
+    ret = AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_METADATA;
+    goto fail;
+  }
+
+  if (Avb_StrnCmp((CONST CHAR8*)hashtree_desc.hash_algorithm, "sha256",
+                  avb_strlen("sha256")) == 0) {
+    verifier->digest_len = AVB_SHA256_DIGEST_SIZE;
+  } else if (Avb_StrnCmp((CONST CHAR8*)hashtree_desc.hash_algorithm, "sha512",
+                         avb_strlen("sha512")) == 0) {
+    verifier->is_sha512 = true;
+    verifier->digest_len = AVB_SHA512_DIGEST_SIZE;
+  } else {
+    avb_errorv(verifier->part_name, ": Unsupported hashtree algorithm.\n",
+               NULL);
+    ret = AVB_SLOT_VERIFY_RESULT_ERROR_UNSUPPORTED_VERSION;
+    goto fail;
+  }
+  /* SHA-256 and SHA-512 digests are already a power of two. */
+  verifier->digest_size = verifier->digest_len;
+
+  verifier->image_size = hashtree_desc.image_size;
+  verifier->tree_offset = hashtree_desc.tree_offset;
+  verifier->data_block_size = hashtree_desc.data_block_size;
+  verifier->hash_block_size = hashtree_desc.hash_block_size;
+  if (hashtree_desc.dm_verity_version != 1 ||
+      hashtree_desc.root_digest_len != verifier->digest_len ||
+      verifier->data_block_size == 0 ||
+      verifier->hash_block_size < verifier->digest_size ||
+      verifier->hash_block_size % verifier->digest_size != 0 ||
+      !hashtree_calc_levels(verifier) ||
+      verifier->level_offset[0] + verifier->level_size[0] >
+          hashtree_desc.tree_size) {
+    avb_errorv(verifier->part_name, ": Unusable hashtree descriptor.\n", NULL);
+    ret = AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_METADATA;
+    goto fail;
+  }
+  avb_memcpy(verifier->root_digest, desc_root_digest, verifier->digest_len);
+
+  verifier->salt_len = hashtree_desc.salt_len;
+  num_slots = verifier->num_levels * HASHTREE_CACHE_SLOTS;
+  verifier->salt = avb_malloc(verifier->salt_len + 1);
+  verifier->cache_tags = avb_calloc(num_slots * sizeof(uint64_t));
+  verifier->cache = avb_malloc(num_slots * verifier->hash_block_size);
+  verifier->block_buf = avb_malloc(verifier->data_block_size);
+  if (verifier->salt == NULL || verifier->cache_tags == NULL ||
+      verifier->cache == NULL || verifier->block_buf == NULL) {
+    ret = AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
+    goto fail;
+  }
+  avb_memcpy(verifier->salt, desc_salt, verifier->salt_len);
+
+  *out_verifier = verifier;
+  return AVB_SLOT_VERIFY_RESULT_OK;
+
+fail:
+  avb_hashtree_verifier_free(verifier);
+  return ret;
+}
+
+AvbSlotVerifyResult avb_hashtree_verifier_read(AvbHashtreeVerifier* verifier,
+                                               uint64_t offset,
+                                               size_t num_bytes,
+                                               uint8_t* buffer) {
+  uint8_t digest[AVB_SHA512_DIGEST_SIZE];
+  AvbSlotVerifyResult ret;
+
+  if (offset > verifier->image_size ||
+      num_bytes > verifier->image_size - offset) {
+    return AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_ARGUMENT;
+  }
+
+  while (num_bytes > 0) {
+    uint64_t block = offset / verifier->data_block_size;
+    uint64_t block_start = block * verifier->data_block_size;
+    size_t in_block = offset - block_start;
+    size_t chunk = verifier->data_block_size - in_block;
+    size_t data_len = verifier->data_block_size;
+    uint64_t pos = block * verifier->digest_size;
+    const uint8_t* parent;
+
+    if (chunk > num_bytes) {
+      chunk = num_bytes;
+    }
+    /* A short last block is hashed zero padded. */
+    if (data_len > verifier->image_size - block_start) {
+      data_len = verifier->image_size - block_start;
+      avb_memset(verifier->block_buf, 0, verifier->data_block_size);
+    }
+
+    ret = hashtree_read(verifier, block_start, data_len, verifier->block_buf);
+    if (ret != AVB_SLOT_VERIFY_RESULT_OK) {
+      return ret;
+    }
+    hashtree_hash(
+        verifier, verifier->block_buf, verifier->data_block_size, digest);
+
+    ret = hashtree_get_block(
+        verifier, 0, pos / verifier->hash_block_size, &parent);
+    if (ret != AVB_SLOT_VERIFY_RESULT_OK) {
+      return ret;
+    }
+    if (avb_safe_memcmp(digest,
+                        parent + pos % verifier->hash_block_size,
+                        verifier->digest_len) != 0) {
+      avb_errorv(verifier->part_name,
+                 ": Data block does not match hashtree.\n",
+                 NULL);
+      return AVB_SLOT_VERIFY_RESULT_ERROR_VERIFICATION;
+    }
+
+    avb_memcpy(buffer, verifier->block_buf + in_block, chunk);
+    buffer += chunk;
+    offset += chunk;
+    num_bytes -= chunk;
+  }
+
+  return AVB_SLOT_VERIFY_RESULT_OK;
+}
+
 const char* avb_slot_verify_result_to_string(AvbSlotVerifyResult result) {
   const char* ret = NULL;
 
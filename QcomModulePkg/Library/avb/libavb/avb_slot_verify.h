@@ -347,6 +347,59 @@ AvbSlotVerifyResult avb_slot_verify(AvbOps* ops,
                                     AvbHashtreeErrorMode hashtree_error_mode,
                                     AvbSlotVerifyData** out_data);
 
+/* Opaque state used to check reads from a hashtree partition, see
+ * avb_hashtree_verifier_new().
+ */
+typedef struct AvbHashtreeVerifier AvbHashtreeVerifier;
+
+/* Prepares checking reads from the hashtree partition |partition_name|
+ * (without |ab_suffix|) against the root digest in its hashtree
+ * descriptor, looked up in the vbmeta images of |slot_data| as returned
+ * by avb_slot_verify().
+ *
+ * Unlike dm-verity the tree is not loaded up front: reads only load and
+ * hash the tree blocks on the path from the data blocks to the root,
+ * and verified tree blocks are kept in a small per-level cache so that
+ * nearby reads stop at the first cached level.
+ *
+ * On success AVB_SLOT_VERIFY_RESULT_OK is returned and |out_verifier|
+ * must be freed with avb_hashtree_verifier_free().
+ *
+ * AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_ARGUMENT is returned if there is
+ * nothing to check against, i.e. no hashtree descriptor names the
+ * partition or hashtree verification is disabled in the top-level
+ * vbmeta.
+ *
+ * AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_METADATA or
+ * AVB_SLOT_VERIFY_RESULT_ERROR_UNSUPPORTED_VERSION is returned if the
+ * descriptor can't be used and AVB_SLOT_VERIFY_RESULT_ERROR_OOM if
+ * unable to allocate memory.
+ */
+AvbSlotVerifyResult avb_hashtree_verifier_new(
+    AvbOps* ops,
+    const AvbSlotVerifyData* slot_data,
+    const char* partition_name,
+    const char* ab_suffix,
+    AvbHashtreeVerifier** out_verifier);
+
+/* Reads |num_bytes| at |offset| of the partition into |buffer|,
+ * checking every data block touched against the hashtree.
+ *
+ * Returns AVB_SLOT_VERIFY_RESULT_OK if all of it verified,
+ * AVB_SLOT_VERIFY_RESULT_ERROR_VERIFICATION if a data or tree block
+ * did not match, AVB_SLOT_VERIFY_RESULT_ERROR_IO or
+ * AVB_SLOT_VERIFY_RESULT_ERROR_OOM if it could not be read and
+ * AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_ARGUMENT if the range is not
+ * covered by the hashtree.
+ */
+AvbSlotVerifyResult avb_hashtree_verifier_read(AvbHashtreeVerifier* verifier,
+                                               uint64_t offset,
+                                               size_t num_bytes,
+                                               uint8_t* buffer);
+
+/* Frees a |AvbHashtreeVerifier|, NULL is ignored. */
+void avb_hashtree_verifier_free(AvbHashtreeVerifier* verifier);
+
 #ifdef __cplusplus
 }
 #endif
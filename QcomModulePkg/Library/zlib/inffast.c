@@ -10,6 +10,22 @@
 
 #ifndef ASMINF
 
+#ifdef INFLATE_FAST_WIDE
+/* Add the next six input bytes to the bit buffer. Only used while
+   bits < 16, so the 48 new bits always fit in the 64-bit hold.
+ */
+#  define PULL6BYTES() \
+    do { \
+        hold += ((unsigned long)in[0] | ((unsigned long)in[1] << 8) | \
+                 ((unsigned long)in[2] << 16) | \
+                 ((unsigned long)in[3] << 24) | \
+                 ((unsigned long)in[4] << 32) | \
+                 ((unsigned long)in[5] << 40)) << bits; \
+        in += 6; \
+        bits += 48; \
+    } while (0)
+#endif
+
 /*
    Decode literal, length, and distance codes and write out the resulting
    literal and match bytes until either not enough input or output is
@@ -40,6 +56,9 @@
       Therefore if strm->avail_in >= 6, then there is enough input to avoid
       checking for available input while decoding.
 
+    - With INFLATE_FAST_WIDE the bit buffer is refilled six bytes at a time,
+      at most twice per length/distance pair, so 12 input bytes are needed.
+
     - The maximum bytes that a single length/distance pair can output is 258
       bytes, which is the maximum length that can be coded.  inflate_fast()
       requires strm->avail_out >= 258 for each loop to avoid checking for
@@ -78,7 +97,7 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
     /* copy state to local variables */
     state = (struct inflate_state FAR *)strm->state;
     in = strm->next_in;
-    last = in + (strm->avail_in - 5);
+    last = in + (strm->avail_in - (INFLATE_FAST_MIN_INPUT - 1));
     out = strm->next_out;
     beg = out - (start - strm->avail_out);
     end = out + (strm->avail_out - 257);
@@ -100,10 +119,14 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
        input data or output space */
     do {
         if (bits < 15) {
+#ifdef INFLATE_FAST_WIDE
+            PULL6BYTES();
+#else
             hold += (unsigned long)(*in++) << bits;
             bits += 8;
             hold += (unsigned long)(*in++) << bits;
             bits += 8;
+#endif
         }
         here = lcode[hold & lmask];
       dolen:
@@ -122,8 +145,12 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
             op &= 15;                           /* number of extra bits */
             if (op) {
                 if (bits < op) {
+#ifdef INFLATE_FAST_WIDE
+                    PULL6BYTES();
+#else
                     hold += (unsigned long)(*in++) << bits;
                     bits += 8;
+#endif
                 }
                 len += (unsigned)hold & ((1U << op) - 1);
                 hold >>= op;
@@ -131,10 +158,14 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
             }
             Tracevv((stderr, "inflate:         length %u\n", len));
             if (bits < 15) {
+#ifdef INFLATE_FAST_WIDE
+                PULL6BYTES();
+#else
                 hold += (unsigned long)(*in++) << bits;
                 bits += 8;
                 hold += (unsigned long)(*in++) << bits;
                 bits += 8;
+#endif
             }
             here = dcode[hold & dmask];
           dodist:
@@ -146,12 +177,16 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                 dist = (unsigned)(here.val);
                 op &= 15;                       /* number of extra bits */
                 if (bits < op) {
+#ifdef INFLATE_FAST_WIDE
+                    PULL6BYTES();
+#else
                     hold += (unsigned long)(*in++) << bits;
                     bits += 8;
                     if (bits < op) {
                         hold += (unsigned long)(*in++) << bits;
                         bits += 8;
                     }
+#endif
                 }
                 dist += (unsigned)hold & ((1U << op) - 1);
 #ifdef INFLATE_STRICT
@@ -248,6 +283,26 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                 }
                 else {
                     from = out - dist;          /* copy direct from output */
+#ifdef INFLATE_FAST_WIDE
+                    if (dist >= 8) {            /* chunks don't overlap */
+                        while (len >= 8) {
+                            out[0] = from[0];
+                            out[1] = from[1];
+                            out[2] = from[2];
+                            out[3] = from[3];
+                            out[4] = from[4];
+                            out[5] = from[5];
+                            out[6] = from[6];
+                            out[7] = from[7];
+                            out += 8;
+                            from += 8;
+                            len -= 8;
+                        }
+                        while (len--)
+                            *out++ = *from++;
+                        continue;
+                    }
+#endif
                     do {                        /* minimum length is three */
                         *out++ = *from++;
                         *out++ = *from++;
@@ -291,12 +346,14 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
     len = bits >> 3;
     in -= len;
     bits -= len << 3;
-    hold &= (1U << bits) - 1;
+    hold &= (1UL << bits) - 1;
 
     /* update state and return */
     strm->next_in = in;
     strm->next_out = out;
-    strm->avail_in = (unsigned)(in < last ? 5 + (last - in) : 5 - (in - last));
+    strm->avail_in = (unsigned)(in < last ?
+                                (INFLATE_FAST_MIN_INPUT - 1) + (last - in) :
+                                (INFLATE_FAST_MIN_INPUT - 1) - (in - last));
     strm->avail_out = (unsigned)(out < end ?
                                  257 + (end - out) : 257 - (out - end));
     state->hold = hold;
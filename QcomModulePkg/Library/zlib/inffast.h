@@ -8,4 +8,15 @@
    subject to change. Applications should only use zlib.h.
  */
 
+/* INFLATE_FAST_WIDE refills the 64-bit bit buffer 48 bits at a time and
+   copies matches in 8 byte chunks. It needs an unsigned long of at least
+   64 bits and a few more input bytes to be available before inflate_fast()
+   can be entered.
+ */
+#ifdef INFLATE_FAST_WIDE
+#  define INFLATE_FAST_MIN_INPUT 12
+#else
+#  define INFLATE_FAST_MIN_INPUT 6
+#endif
+
 void ZLIB_INTERNAL inflate_fast OF((z_streamp strm, unsigned start));